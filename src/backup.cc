@@ -0,0 +1,94 @@
+#include "common.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "config.hh"
+#include "event_utils.hh"
+#include "fsutils.hh"
+#include "log_db.hh"
+#include "sqlite3_db.hh"
+#include "strutils.hh"
+
+using namespace stuff;
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: `backup TARGET [CONFIG]`" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto cfg = Config::create();
+    if (argc == 3) {
+        if (!cfg->load(argv[2])) {
+            std::cerr << "Error loading config: " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!cfg->load("./event.config")) {
+        cfg->load(SYSCONFDIR "/event.config");
+    }
+    std::string const target(argv[1]);
+    if (!mkdir_p(target)) {
+        std::cerr << "Unable to create " << target << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto const jobs = cfg->get_long("backup_jobs", 2);
+    auto const pages = cfg->get_long("backup_pages", 64);
+    auto const pause_ms = cfg->get_long("backup_pause_ms", 10);
+    if (jobs <= 0 || pages <= 0 || pause_ms < 0) {
+        std::cerr << "backup_jobs and backup_pages must be positive"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto const path = EventUtils::db_path(cfg.get());
+    cfg.reset();
+    std::vector<std::string> files;
+    if (!list_dir(path, &files)) {
+        std::cerr << "Unable to list " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    files.erase(std::remove_if(files.begin(), files.end(),
+                               [](const std::string& file) {
+                                   return !ends_with(file, ".db") &&
+                                       !ends_with(file, ".log");
+                               }), files.end());
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::mutex err_mutex;
+    auto worker = [&]() {
+        while (true) {
+            auto const index = next++;
+            if (index >= files.size()) break;
+            const auto& file = files[index];
+            bool ok;
+            std::string error;
+            if (ends_with(file, ".log")) {
+                ok = LogDB::backup(path + "/" + file, target + "/" + file);
+            } else {
+                ok = SQLite3::backup(path + "/" + file, target + "/" + file,
+                                     pages, pause_ms, &error);
+            }
+            if (!ok) {
+                std::lock_guard<std::mutex> lock(err_mutex);
+                std::cerr << "Backup of " << file << " failed";
+                if (!error.empty()) std::cerr << ": " << error;
+                std::cerr << std::endl;
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    auto const count = std::min(static_cast<size_t>(jobs), files.size());
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,5 +1,7 @@
 #include "common.hh"
 
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <unordered_map>
 
@@ -48,6 +50,16 @@ private:
 
 }  // namespace
 
+long Config::get_long(const std::string& name, long fallback) const {
+    auto value = get(name, "");
+    if (value.empty()) return fallback;
+    char* end = nullptr;
+    errno = 0;
+    auto tmp = strtol(value.c_str(), &end, 10);
+    if (errno || !end || *end) return fallback;
+    return tmp;
+}
+
 std::unique_ptr<Config> Config::create() {
     return std::unique_ptr<Config>(new ConfigImpl());
 }
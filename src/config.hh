@@ -12,6 +12,9 @@ public:
 
     virtual std::string get(const std::string& name,
                             const std::string& fallback) const = 0;
+    // Same as get but the value is parsed as an integer. Returns fallback if
+    // there is no such value or if it isn't an integer
+    long get_long(const std::string& name, long fallback) const;
     virtual bool load(const std::string& path) = 0;
 
     static std::unique_ptr<Config> create();
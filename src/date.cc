@@ -0,0 +1,249 @@
+#include "common.hh"
+
+#include <cstdint>
+#include <cstring>
+
+#include "date.hh"
+
+namespace stuff {
+
+namespace {
+
+const int64_t kDay = 24 * 60 * 60;
+const int64_t kWeek = 7 * kDay;
+const int64_t kHalfYear = 365 * kDay / 2;
+// Time zones do not change offset twice within this long, so two dates
+// this close with the same offset have the same offset in between too
+const int64_t kOffsetSpan = 7 * kDay;
+const int64_t kOffsetGrow = 4 * kOffsetSpan;
+
+const char* const kWeekdays[] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+    "Saturday",
+};
+
+bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+const char* skip_space(const char* str) {
+    while (is_space(*str)) ++str;
+    return str;
+}
+
+// Same rules as strptime(): leading space is skipped and at most digits
+// are read, stopping early if another digit would make it larger than to
+const char* number(const char* str, int from, int to, int digits,
+                   int* value) {
+    str = skip_space(str);
+    if (!is_digit(*str)) return nullptr;
+    int tmp = 0;
+    do {
+        tmp = tmp * 10 + (*str++ - '0');
+    } while (--digits > 0 && tmp * 10 <= to && is_digit(*str));
+    if (tmp < from || tmp > to) return nullptr;
+    *value = tmp;
+    return str;
+}
+
+// Returns the length of the prefix of str matching name, ignoring case
+size_t match(const char* str, const char* name) {
+    size_t i = 0;
+    while (name[i] && to_lower(str[i]) == to_lower(name[i])) ++i;
+    return i;
+}
+
+// Full or three letter weekday name, longest match wins
+const char* weekday(const char* str, int* wday) {
+    size_t best = 0;
+    for (int i = 0; i < 7; i++) {
+        auto const len = match(str, kWeekdays[i]);
+        if (len == strlen(kWeekdays[i])) {
+            best = len;
+            *wday = i;
+            break;
+        }
+        if (len >= 3 && best < 3) {
+            best = 3;
+            *wday = i;
+        }
+    }
+    return best ? str + best : nullptr;
+}
+
+char* append(char* out, const char* str) {
+    while (*str) *out++ = *str++;
+    return out;
+}
+
+char* append2(char* out, unsigned int value) {
+    *out++ = '0' + value / 10 % 10;
+    *out++ = '0' + value % 10;
+    return out;
+}
+
+char* append_year(char* out, int64_t year) {
+    if (year < 0) {
+        *out++ = '-';
+        year = -year;
+    }
+    char tmp[20];
+    size_t len = 0;
+    do {
+        tmp[len++] = '0' + year % 10;
+        year /= 10;
+    } while (year);
+    while (len) *out++ = tmp[--len];
+    return out;
+}
+
+// Days since epoch to year, month (1-12) and day (1-31) in the proleptic
+// Gregorian calendar
+void civil_from_days(int64_t days, int64_t* year, unsigned int* month,
+                     unsigned int* day) {
+    days += 719468;
+    int64_t const era = (days >= 0 ? days : days - 146096) / 146097;
+    auto const doe = static_cast<unsigned int>(days - era * 146097);
+    auto const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    auto const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    auto const mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = static_cast<int64_t>(yoe) + era * 400 + (*month <= 2 ? 1 : 0);
+}
+
+long gmtoff(time_t date) {
+    struct tm tm;
+    localtime_r(&date, &tm);
+    return tm.tm_gmtoff;
+}
+
+}  // namespace
+
+bool Date::parse(const std::string& str, time_t now, time_t* date) {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    auto ptr = str.c_str();
+    int wday = -1, value;
+    if (!is_digit(*ptr) && !is_space(*ptr)) {
+        ptr = weekday(ptr, &wday);
+        if (!ptr) return false;
+    }
+    // The separator after the first number tells which format it is
+    auto sep = skip_space(ptr);
+    while (is_digit(*sep)) ++sep;
+    switch (*sep) {
+    case ':':
+        break;
+    case '/':
+        ptr = number(ptr, 1, 31, 2, &value);
+        if (!ptr || *ptr++ != '/') return false;
+        tm.tm_mday = value;
+        ptr = number(ptr, 1, 12, 2, &value);
+        if (!ptr) return false;
+        tm.tm_mon = value - 1;
+        // With a date the weekday is just for show
+        wday = -1;
+        break;
+    case '-':
+        if (wday >= 0) return false;
+        ptr = number(ptr, 0, 9999, 4, &value);
+        if (!ptr || *ptr++ != '-') return false;
+        tm.tm_year = value - 1900;
+        ptr = number(ptr, 1, 12, 2, &value);
+        if (!ptr || *ptr++ != '-') return false;
+        tm.tm_mon = value - 1;
+        ptr = number(ptr, 1, 31, 2, &value);
+        if (!ptr) return false;
+        tm.tm_mday = value;
+        break;
+    default:
+        return false;
+    }
+    ptr = number(ptr, 0, 23, 2, &value);
+    if (!ptr || *ptr++ != ':') return false;
+    tm.tm_hour = value;
+    ptr = number(ptr, 0, 59, 2, &value);
+    if (!ptr || *ptr) return false;
+    tm.tm_min = value;
+    if (wday >= 0) {
+        // Given the weekday, figure out distance to "now"
+        int days = wday - tm.tm_wday;
+        if (days <= 0) days += 7;
+        *date = mktime(&tm) + days * kDay;
+    } else {
+        *date = mktime(&tm);
+    }
+    return true;
+}
+
+Date::Formatter::Formatter(time_t now)
+    : now_(now), offset_(gmtoff(now)), first_(now), last_(now) {
+}
+
+long Date::Formatter::offset(time_t date) {
+    // Grow the span a week at a time towards dates close to it, for dates
+    // further away, or if the offset changes, just ask
+    if (date > last_ && date - last_ <= kOffsetGrow) {
+        while (date > last_ && gmtoff(last_ + kOffsetSpan) == offset_) {
+            last_ += kOffsetSpan;
+        }
+    } else if (date < first_ && first_ - date <= kOffsetGrow) {
+        while (date < first_ && gmtoff(first_ - kOffsetSpan) == offset_) {
+            first_ -= kOffsetSpan;
+        }
+    }
+    if (date >= first_ && date <= last_) return offset_;
+    return gmtoff(date);
+}
+
+std::string Date::Formatter::format(time_t date) {
+    int64_t const local = static_cast<int64_t>(date) + offset(date);
+    int64_t days = local / kDay;
+    int64_t secs = local % kDay;
+    if (secs < 0) {
+        secs += kDay;
+        days--;
+    }
+    auto const diff = static_cast<int64_t>(date) - now_;
+    char tmp[64];
+    char* out = tmp;
+    if (diff > kDay) {
+        int64_t year;
+        unsigned int month, day;
+        civil_from_days(days, &year, &month, &day);
+        if (diff <= kHalfYear) {
+            auto wday = (days + 4) % 7;
+            if (wday < 0) wday += 7;
+            out = append(out, kWeekdays[wday]);
+            *out++ = ' ';
+            if (diff > kWeek) {
+                out = append2(out, day);
+                *out++ = '/';
+                out = append2(out, month);
+                *out++ = ' ';
+            }
+        } else {
+            out = append_year(out, year);
+            *out++ = '-';
+            out = append2(out, month);
+            *out++ = '-';
+            out = append2(out, day);
+            *out++ = ' ';
+        }
+    }
+    out = append2(out, secs / 3600);
+    *out++ = ':';
+    out = append2(out, secs / 60 % 60);
+    return std::string(tmp, out - tmp);
+}
+
+}  // namespace stuff
@@ -0,0 +1,48 @@
+#ifndef DATE_HH
+#define DATE_HH
+
+#include <ctime>
+#include <string>
+
+namespace stuff {
+
+class Date {
+public:
+    // Parse a time as written by users, in local time. Supported formats
+    // are "HH:MM", "DAY HH:MM", "DD/MM HH:MM", "DAY DD/MM HH:MM" and
+    // "YYYY-MM-DD HH:MM" where DAY is a weekday name, full or abbreviated.
+    // Fields not given are taken from now, a DAY without a date means the
+    // next such day. The string is scanned once.
+    static bool parse(const std::string& str, time_t now, time_t* date);
+
+    // Formats dates relative to now, the closer the shorter: "HH:MM" for
+    // the next day, "DAY HH:MM" for the next week, "DAY DD/MM HH:MM" for
+    // the next half year and "YYYY-MM-DD HH:MM" after that.
+    // Create one per request, it keeps the time zone offset and only asks
+    // for it again for dates far from the ones already formatted.
+    class Formatter {
+    public:
+        explicit Formatter(time_t now);
+
+        std::string format(time_t date);
+
+    private:
+        long offset(time_t date);
+
+        time_t const now_;
+        long offset_;
+        // offset_ is known to be valid between first_ and last_
+        time_t first_;
+        time_t last_;
+    };
+
+private:
+    Date() = delete;
+    ~Date() = delete;
+    Date(Date&) = delete;
+    Date& operator=(Date&) = delete;
+};
+
+}  // namespace stuff
+
+#endif /* DATE_HH */
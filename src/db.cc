@@ -1,9 +1,23 @@
 #include "common.hh"
 
+#include <zlib.h>
+
 #include "db.hh"
 
 namespace stuff {
 
+namespace {
+
+// Tag, size of the text as 32 bit little endian and then a zlib stream
+const char kTagZlib = 1;
+const size_t kHeaderSize = 5;
+// Shorter texts are stored as they are
+const size_t kCompressMinSize = 256;
+// Sanity check of the size in the header
+const size_t kCompressMaxSize = 64 * 1024 * 1024;
+
+}  // namespace
+
 DB::Value::Value(const std::string& value)
     : type_(DB::Type::STRING), string_(value) {
 }
@@ -57,6 +71,48 @@ double DB::Value::d() const {
     return data_.d;
 }
 
+// static
+bool DB::compress_text(const std::string& text, std::string* data) {
+    if (text.size() < kCompressMinSize || text.size() > kCompressMaxSize) {
+        return false;
+    }
+    auto bound = compressBound(text.size());
+    data->resize(kHeaderSize + bound);
+    (*data)[0] = kTagZlib;
+    for (size_t i = 0; i < 4; i++) {
+        (*data)[1 + i] = static_cast<char>((text.size() >> (8 * i)) & 0xff);
+    }
+    if (compress2(reinterpret_cast<Bytef*>(&(*data)[kHeaderSize]), &bound,
+                  reinterpret_cast<const Bytef*>(text.data()), text.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK ||
+        kHeaderSize + bound >= text.size()) {
+        data->clear();
+        return false;
+    }
+    data->resize(kHeaderSize + bound);
+    return true;
+}
+
+// static
+bool DB::uncompress_text(const void* data, size_t size, std::string* text) {
+    auto const bytes = reinterpret_cast<const uint8_t*>(data);
+    if (size < kHeaderSize || bytes[0] != kTagZlib) return false;
+    size_t text_size = 0;
+    for (size_t i = 0; i < 4; i++) {
+        text_size |= static_cast<size_t>(bytes[1 + i]) << (8 * i);
+    }
+    if (text_size > kCompressMaxSize) return false;
+    text->resize(text_size);
+    uLongf len = text_size;
+    if (uncompress(reinterpret_cast<Bytef*>(&(*text)[0]), &len,
+                   bytes + kHeaderSize, size - kHeaderSize) != Z_OK ||
+        len != text_size) {
+        text->clear();
+        return false;
+    }
+    return true;
+}
+
 std::shared_ptr<DB::Snapshot> DB::select(
         const std::string& table, const OrderBy& order_by) {
     std::vector<OrderBy> order_by_vector(1, order_by);
@@ -98,7 +98,9 @@ public:
                          size_t size) = 0;
 
         // Return true if the insert/update succeeded, false in case of error
-        // After calling commit, release the object, it's no longer usable
+        // After calling commit the values are kept, an insert editor can be
+        // committed again to insert another row with whatever values were
+        // changed. Setting the same columns each time reuses the statement.
         virtual bool commit() = 0;
 
         // Return the latest inserted rowid
@@ -226,12 +228,21 @@ public:
             NEGATIVE,
             IS_NULL,
         };
+        enum SetOperator {
+            IN,
+        };
+        enum RangeOperator {
+            // Inclusive, low <= column <= high
+            BETWEEN,
+        };
         enum Mode {
             NOOP,
             BOOL_BINARY,
             BOOL_UNARY,
             COMP_BINARY,
-            COMP_UNARY
+            COMP_UNARY,
+            COMP_SET,
+            COMP_RANGE
         };
 
         Condition()
@@ -261,6 +272,30 @@ public:
             : mode_(COMP_UNARY), c_(c) {
             op_.comp_unary = op;
         }
+        // The values are bound as one parameter, the statement is the same
+        // no matter how many values there are
+        Condition(const Column& c, SetOperator op,
+                  const std::vector<Value>& values)
+            : mode_(COMP_SET), c_(c),
+              vs_(std::make_shared<const std::vector<Value>>(values)) {
+            op_.comp_set = op;
+        }
+        Condition(const std::string& name, SetOperator op,
+                  const std::vector<Value>& values)
+            : mode_(COMP_SET), c_(Column(name)),
+              vs_(std::make_shared<const std::vector<Value>>(values)) {
+            op_.comp_set = op;
+        }
+        Condition(const Column& c, RangeOperator op, const Value& low,
+                  const Value& high)
+            : mode_(COMP_RANGE), c_(c), v_(low), v2_(high) {
+            op_.comp_range = op;
+        }
+        Condition(const std::string& name, RangeOperator op, const Value& low,
+                  const Value& high)
+            : mode_(COMP_RANGE), c_(Column(name)), v_(low), v2_(high) {
+            op_.comp_range = op;
+        }
 
         Mode mode() const {
             return mode_;
@@ -300,8 +335,19 @@ public:
             return op_.comp_unary;
         }
 
+        SetOperator set_op() const {
+            assert(mode_ == COMP_SET);
+            return op_.comp_set;
+        }
+
+        RangeOperator range_op() const {
+            assert(mode_ == COMP_RANGE);
+            return op_.comp_range;
+        }
+
         const Column& column() const {
-            assert(mode_ == COMP_BINARY || mode_ == COMP_UNARY);
+            assert(mode_ == COMP_BINARY || mode_ == COMP_UNARY ||
+                   mode_ == COMP_SET || mode_ == COMP_RANGE);
             return c_;
         }
 
@@ -310,16 +356,34 @@ public:
             return v_;
         }
 
+        const std::vector<Value>& values() const {
+            assert(mode_ == COMP_SET);
+            return *vs_;
+        }
+
+        const Value& low() const {
+            assert(mode_ == COMP_RANGE);
+            return v_;
+        }
+
+        const Value& high() const {
+            assert(mode_ == COMP_RANGE);
+            return v2_;
+        }
+
     private:
         const Mode mode_;
         const std::shared_ptr<Condition> c1_, c2_;
         const Column c_;
-        const Value v_;
+        const Value v_, v2_;
+        const std::shared_ptr<const std::vector<Value>> vs_;
         union {
             BinaryBooleanOperator bool_binary;
             UnaryBooleanOperator bool_unary;
             BinaryOperator comp_binary;
             UnaryOperator comp_unary;
+            SetOperator comp_set;
+            RangeOperator comp_range;
         } op_;
     };
 
@@ -345,15 +409,17 @@ public:
         bool ascending_;
     };
 
+    // With write set the transaction is started with
+    // start_write_transaction()
     class Transaction {
     public:
-        Transaction(std::shared_ptr<DB> db)
+        Transaction(std::shared_ptr<DB> db, bool write = false)
             : db_(db), ptr_(db.get()) {
-            start();
+            start(write);
         }
-        Transaction(DB* db)
+        Transaction(DB* db, bool write = false)
             : ptr_(db) {
-            start();
+            start(write);
         }
         ~Transaction() {
             rollback();
@@ -380,6 +446,38 @@ public:
     private:
         Transaction(const Transaction&) = delete;
         Transaction& operator=(const Transaction&) = delete;
+        void start(bool write) {
+            good_ = ptr_ && (write ? ptr_->start_write_transaction()
+                             : ptr_->start_transaction());
+        }
+
+        std::shared_ptr<DB> db_;
+        DB* ptr_;
+        bool good_;
+    };
+
+    // All reads done while a ReadTransaction is alive see the same state of
+    // the database and the read lock is only taken once. Transactions nest
+    // but writes should not be done inside a ReadTransaction as upgrading the
+    // lock may fail.
+    class ReadTransaction {
+    public:
+        ReadTransaction(std::shared_ptr<DB> db)
+            : db_(db), ptr_(db.get()) {
+            start();
+        }
+        ReadTransaction(DB* db)
+            : ptr_(db) {
+            start();
+        }
+        ~ReadTransaction() {
+            if (ptr_ && good_ && !ptr_->commit_transaction()) {
+                ptr_->rollback_transaction();
+            }
+        }
+    private:
+        ReadTransaction(const ReadTransaction&) = delete;
+        ReadTransaction& operator=(const ReadTransaction&) = delete;
         void start() {
             good_ = ptr_ && ptr_->start_transaction();
         }
@@ -389,6 +487,15 @@ public:
         bool good_;
     };
 
+    // Long texts can be stored compressed, as a BLOB in a STRING column.
+    // The first byte of the BLOB tags the format. Text indexes and search()
+    // see the text and not the BLOB.
+    // Returns false if text is too short to gain anything, store it as it is
+    static bool compress_text(const std::string& text, std::string* data);
+    // Returns false if data isn't compressed text or is corrupt
+    static bool uncompress_text(const void* data, size_t size,
+                                std::string* text);
+
     // Create a table with the given declarations.
     // If a table with that name already exists nothing happens.
     // Returns false in case of error
@@ -396,6 +503,36 @@ public:
                               const Declaration& declaration) = 0;
     // Returns false in case of error. The table not existing is not an error.
     virtual bool remove_table(const std::string& table) = 0;
+    // Rename table to new_name, its indexes follow. Returns false in case of
+    // error, including if new_name already exists
+    virtual bool rename_table(const std::string& table,
+                              const std::string& new_name) = 0;
+    // Add a column to table, existing rows get NULL for it so the column
+    // can't be primary key, unique or not null.
+    // Returns false in case of error, including if the column already exists
+    virtual bool insert_column(const std::string& table,
+                               const std::string& name,
+                               const Constraint& constraint) = 0;
+    // Create an index named name on table covering columns, in the given
+    // order and direction.
+    // If an index with that name already exists nothing happens.
+    // Returns false in case of error
+    virtual bool insert_index(const std::string& table,
+                              const std::string& name,
+                              const std::vector<OrderBy>& columns) = 0;
+    // Create a full-text index over the given text columns of table, kept up
+    // to date with writes done through DB and used by search(). Rows written
+    // by other tools are not indexed. A table has at most one.
+    // If the table already has one nothing happens.
+    // Returns false in case of error
+    virtual bool insert_text_index(const std::string& table,
+                                   const std::vector<std::string>& columns)
+        = 0;
+    // Remove all indexes made by insert_index() and insert_text_index() on
+    // table, to insert many rows faster and then create them again.
+    // Backends where keeping them costs nothing may keep them.
+    // Returns false in case of error
+    virtual bool remove_indexes(const std::string& table) = 0;
     // Create an editor for inserting an row in the table.
     // Always succeeds and doesn't do anything until commit is called on the
     // Editor.
@@ -416,12 +553,60 @@ public:
     std::shared_ptr<Snapshot> select(
             const std::string& table, const Condition& condition,
             const OrderBy& order_by);
+    // Like select() but the snapshot only has the given columns, in that
+    // order, and at most limit rows. 0 limit for all rows.
+    // Check bad() in snapshot for errors
+    virtual std::shared_ptr<Snapshot> select_columns(
+            const std::string& table, const std::vector<std::string>& columns,
+            const Condition& condition = Condition(),
+            const std::vector<OrderBy>& order_by = std::vector<OrderBy>(),
+            size_t limit = 0) = 0;
+    // Return a snapshot for the at most limit rows in table that contain all
+    // words in their text indexed columns, best match first.
+    // Check bad() in snapshot for errors
+    virtual std::shared_ptr<Snapshot> search(
+            const std::string& table, const std::vector<std::string>& words,
+            size_t limit) = 0;
     // Remove all rows matching condition in table. Returns number of rows
     // removed or -1 in case of error
     virtual int64_t remove(const std::string& table,
                            const Condition& condition = Condition()) = 0;
 
+    // Return at most pages unused pages to the filesystem. A database that
+    // can't do that yet is converted first, which rewrites it once. Must not
+    // be called inside a transaction. Returns false in case of error
+    virtual bool incremental_vacuum(int64_t pages) = 0;
+
+    // Returns a number that changes every time the database is modified, by
+    // this or any other connection. Returns -1 in case of error
+    virtual int64_t version() = 0;
+
+    struct Stats {
+        // Bytes used to cache rows or pages
+        int64_t cache_bytes;
+        // Bytes used by everything else, schema and prepared statements
+        int64_t other_bytes;
+    };
+
+    // Fill in current memory usage of this connection. Returns false in
+    // case of error
+    virtual bool stats(Stats* stats) = 0;
+
+    // Limit the cache to about bytes, 0 restores the default. Returns false
+    // in case of error
+    virtual bool set_cache_size(int64_t bytes) = 0;
+
+    // Free as much memory as possible without closing the connection
+    virtual void release_memory() = 0;
+
+    // Transactions nest, only the outermost commit is written
     virtual bool start_transaction() = 0;
+    // Like start_transaction() but takes the write lock at once instead of
+    // on the first write, so what is read inside can't change before the
+    // commit and waiting for the lock never deadlocks. Use it when what to
+    // write depends on what is read. Nested in another transaction it's the
+    // same as start_transaction()
+    virtual bool start_write_transaction() = 0;
     virtual bool commit_transaction() = 0;
     virtual bool rollback_transaction() = 0;
 
@@ -1,7 +1,22 @@
 #include "common.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <istream>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "db.hh"
 #include "event.hh"
+#include "json.hh"
 
 namespace stuff {
 
@@ -9,10 +24,481 @@ namespace {
 
 const std::string kEventTable = "events";
 const std::string kEventGoingTable = "events_going";
+const std::string kUserTable = "users";
+const std::string kSchemaTable = "schema";
+const std::string kStatsTable = "stats";
+const std::string kUserStatsTable = "user_stats";
+
+// 1: events_going stores the user name in every row
+// 2: events_going refers to users by id
+// 3: events has going_count and not_going_count
+// 4: events has repeat_days and repeat_until
+// 5: events has capacity and waiting_count, events_going has waiting
+// 6: stats and user_stats count events and answers
+// 7: events text and events_going note can be compressed
+// 8: the events text index has no triggers
+const int64_t kSchemaVersion = 8;
+
+// Occurrences of repeating events are expanded this far ahead, and always
+// at least the next one
+const time_t kRepeatWindow = 28 * 24 * 60 * 60;
+// repeat_until for repeating events without an end
+const int64_t kRepeatForever = std::numeric_limits<int64_t>::max();
+
+// Occurrences of a repeating event have negative ids made from the id of the
+// repeating event and the number of the occurrence. That way an occurrence
+// has the same id before and after it's stored, and storing it is what
+// replaces the expanded one.
+int64_t occurrence_id(int64_t series, uint32_t occurrence) {
+    return -((series << 32) | occurrence);
+}
+
+int64_t series_id(int64_t id) {
+    return id < 0 ? -id >> 32 : 0;
+}
+
+// Start of occurrence number occurrence, at the same local time as start
+time_t occurrence_start(time_t start, unsigned int days, uint32_t occurrence) {
+    struct tm tm;
+    localtime_r(&start, &tm);
+    tm.tm_mday += days * occurrence;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+struct NameEntry {
+    std::string name;
+    // Number of Names::Ref, the entry is free for reuse when 0. Copying and
+    // dropping a Ref only changes this, the mutex is only taken to intern,
+    // find or free a name
+    std::atomic<uint32_t> refs;
+    // Set while name is in g_names_index
+    bool used;
+};
+
+// Entries are allocated in chunks that never move, so that Names::get() and
+// Ref can reach them without the mutex
+const uint32_t kNameChunkSize = 1024;
+const uint32_t kNameChunks = 16384;
+
+std::mutex g_names_mutex;
+std::unordered_map<std::string, uint32_t> g_names_index;
+std::unique_ptr<NameEntry[]> g_names[kNameChunks];
+uint32_t g_names_end;
+std::vector<uint32_t> g_names_free;
+
+NameEntry& name_entry(uint32_t id) {
+    return g_names[id / kNameChunkSize][id % kNameChunkSize];
+}
+
+// Going list with constant time lookup by name. Iterates over the ones going
+// first, then the waitlist and then the ones not going, each in the order
+// they were added.
+class GoingList {
+public:
+    typedef std::list<Event::Going> List;
+
+    GoingList() {
+    }
+
+    GoingList(const GoingList& other)
+        : going_(other.going_), waiting_(other.waiting_),
+          not_going_(other.not_going_) {
+        reindex();
+    }
+
+    GoingList& operator=(const GoingList& other) {
+        going_ = other.going_;
+        waiting_ = other.waiting_;
+        not_going_ = other.not_going_;
+        reindex();
+        return *this;
+    }
+
+    bool empty() const {
+        return index_.empty();
+    }
+
+    void clear() {
+        going_.clear();
+        waiting_.clear();
+        not_going_.clear();
+        index_.clear();
+    }
+
+    // Appends to the end of its part, remove any entry with the same name
+    // first
+    void push_back(const Event::Going& going) {
+        auto& list = part(going);
+        index_[going.name_id] = list.insert(list.end(), going);
+    }
+
+    // Returns nullptr if there is no entry with that name
+    const Event::Going* find(uint32_t name_id) const {
+        auto it = index_.find(name_id);
+        return it == index_.end() ? nullptr : &*it->second;
+    }
+
+    void erase(uint32_t name_id) {
+        auto it = index_.find(name_id);
+        if (it == index_.end()) return;
+        part(*it->second).erase(it->second);
+        index_.erase(it);
+    }
+
+    // Change the entry for name_id the same way storing the change does,
+    // capacity is 0 for no limit
+    void update(uint32_t name_id, bool is_going, const std::string& note,
+                time_t added, size_t capacity) {
+        auto it = index_.find(name_id);
+        bool seated = false;
+        if (it != index_.end()) {
+            auto& current = *it->second;
+            if (current.is_going == is_going) {
+                current.note = note;
+                return;
+            }
+            seated = current.is_going && !current.waiting;
+            erase(name_id);
+        }
+        push_back(Event::Going(name_id, is_going, note, added,
+                               is_going && capacity &&
+                               going_.size() >= capacity));
+        if (seated) promote(capacity);
+    }
+
+    // Move the first ones on the waitlist to the free seats
+    void promote(size_t capacity) {
+        while (!waiting_.empty() &&
+               (capacity == 0 || going_.size() < capacity)) {
+            waiting_.front().waiting = false;
+            // Iterators in index_ stay valid
+            going_.splice(going_.end(), waiting_, waiting_.begin());
+        }
+    }
+
+    const List& going() const {
+        return going_;
+    }
+
+    const List& waiting() const {
+        return waiting_;
+    }
+
+    const List& not_going() const {
+        return not_going_;
+    }
+
+private:
+    List& part(const Event::Going& going) {
+        if (!going.is_going) return not_going_;
+        return going.waiting ? waiting_ : going_;
+    }
+
+    void reindex() {
+        index_.clear();
+        for (auto list : { &going_, &waiting_, &not_going_ }) {
+            for (auto it = list->begin(); it != list->end(); ++it) {
+                index_[it->name_id] = it;
+            }
+        }
+    }
+
+    List going_;
+    List waiting_;
+    List not_going_;
+    std::unordered_map<uint32_t, List::iterator> index_;
+};
+
+// Add the name of each user in ids to names, keyed by user id
+bool load_users(DB* db, const std::vector<DB::Value>& ids,
+                std::unordered_map<int64_t, Event::Names::Ref>* names) {
+    if (ids.empty()) return true;
+    auto snapshot = db->select(kUserTable,
+                               DB::Condition("id", DB::Condition::IN, ids));
+    if (!snapshot) return false;
+    do {
+        int64_t id;
+        std::string name;
+        if (!snapshot->get(0, &id) || !snapshot->get(1, &name)) return false;
+        (*names)[id] = Event::Names::intern(name);
+    } while (snapshot->next());
+    return !snapshot->bad();
+}
+
+// Add the user id for each name in names to ids, keyed by name id.
+// Users that don't exist yet are inserted
+bool store_users(DB* db, const std::vector<uint32_t>& names,
+                 std::unordered_map<uint32_t, int64_t>* ids) {
+    std::vector<DB::Value> values;
+    for (auto name : names) {
+        if (!ids->count(name)) values.emplace_back(Event::Names::get(name));
+    }
+    if (values.empty()) return true;
+    auto snapshot = db->select(kUserTable,
+                               DB::Condition("name", DB::Condition::IN,
+                                             values));
+    if (snapshot) {
+        do {
+            int64_t id;
+            std::string name;
+            if (!snapshot->get(0, &id) || !snapshot->get(1, &name)) {
+                return false;
+            }
+            (*ids)[Event::Names::intern(name)] = id;
+        } while (snapshot->next());
+        if (snapshot->bad()) return false;
+    }
+    for (auto name : names) {
+        if (ids->count(name)) continue;
+        auto editor = db->insert(kUserTable);
+        editor->set("name", Event::Names::get(name));
+        if (!editor->commit()) return false;
+        (*ids)[name] = editor->last_insert_rowid();
+    }
+    return true;
+}
+
+// Changes to the attendance statistics, applied by store_stats()
+class StatsChange {
+public:
+    StatsChange()
+        : events_(0) {
+    }
+
+    void count_event(int64_t n) {
+        events_ += n;
+    }
+
+    // Count n answers, negative to take them back
+    void count(int64_t user, bool is_going, bool waiting, int64_t n) {
+        auto& counts = users_[user];
+        if (!is_going) {
+            counts.not_going += n;
+        } else if (waiting) {
+            counts.waiting += n;
+        } else {
+            counts.going += n;
+        }
+    }
+
+    // Count the rows in snapshot, which has the columns user, is_going and
+    // waiting
+    bool count(DB::Snapshot* snapshot, int64_t n) {
+        if (!snapshot) return true;
+        do {
+            int64_t user;
+            bool is_going, waiting;
+            if (!snapshot->get(0, &user) || !snapshot->get(1, &is_going)) {
+                return false;
+            }
+            if (!snapshot->get(2, &waiting)) waiting = false;
+            count(user, is_going, waiting, n);
+        } while (snapshot->next());
+        return !snapshot->bad();
+    }
+
+    // Add the changes to the stored counters. Must be in a write transaction
+    bool store(DB* db) const {
+        if (events_ && !add(db, "events", events_)) return false;
+        for (const auto& pair : users_) {
+            auto const& counts = pair.second;
+            if (counts.going == 0 && counts.waiting == 0 &&
+                counts.not_going == 0) continue;
+            DB::Condition const condition("user", DB::Condition::EQUAL,
+                                          pair.first);
+            std::vector<std::string> columns;
+            columns.push_back("going");
+            columns.push_back("waiting");
+            columns.push_back("not_going");
+            auto snapshot = db->select_columns(kUserStatsTable, columns,
+                                               condition);
+            int64_t going = 0, waiting = 0, not_going = 0;
+            std::shared_ptr<DB::Editor> editor;
+            if (snapshot) {
+                if (!snapshot->get(0, &going) || !snapshot->get(1, &waiting) ||
+                    !snapshot->get(2, &not_going)) return false;
+                snapshot.reset();
+                editor = db->update(kUserStatsTable, condition);
+            } else {
+                editor = db->insert(kUserStatsTable);
+                editor->set("user", pair.first);
+            }
+            editor->set("going", going + counts.going);
+            editor->set("waiting", waiting + counts.waiting);
+            editor->set("not_going", not_going + counts.not_going);
+            if (!editor->commit()) return false;
+        }
+        return true;
+    }
+
+private:
+    struct Counts {
+        int64_t going = 0;
+        int64_t waiting = 0;
+        int64_t not_going = 0;
+    };
+
+    // Add n to the counter called name in the stats table
+    static bool add(DB* db, const std::string& name, int64_t n) {
+        DB::Condition const condition("name", DB::Condition::EQUAL,
+                                      DB::Value(name));
+        auto snapshot = db->select_columns(
+                kStatsTable, std::vector<std::string>(1, "value"), condition);
+        int64_t value = 0;
+        std::shared_ptr<DB::Editor> editor;
+        if (snapshot) {
+            if (!snapshot->get(0, &value)) return false;
+            snapshot.reset();
+            editor = db->update(kStatsTable, condition);
+        } else {
+            editor = db->insert(kStatsTable);
+            editor->set("name", name);
+        }
+        editor->set("value", value + n);
+        return editor->commit();
+    }
+
+    int64_t events_;
+    std::map<int64_t, Counts> users_;
+};
+
+// Columns read by StatsChange::count()
+std::vector<std::string> stats_columns() {
+    std::vector<std::string> columns;
+    columns.push_back("user");
+    columns.push_back("is_going");
+    columns.push_back("waiting");
+    return columns;
+}
+
+// Long texts are stored compressed, see DB::compress_text()
+void put_text(DB::Editor* editor, const std::string& name,
+              const std::string& text) {
+    std::string data;
+    if (DB::compress_text(text, &data)) {
+        editor->set(name, data.data(), data.size());
+    } else {
+        editor->set(name, text);
+    }
+}
+
+// Read a column written by put_text(), returns false if it's NULL or bad
+bool get_text(DB::Snapshot* snapshot, uint32_t column, std::string* text) {
+    if (snapshot->get(column, text)) return true;
+    std::vector<uint8_t> data;
+    return snapshot->get(column, &data) &&
+        DB::uncompress_text(data.data(), data.size(), text);
+}
+
+// Write the rows in snapshot to out, one JSON object per line with type set
+// to type and the columns named by columns, in order. Empty names skip the
+// column, NULL columns are left out
+bool dump_rows(DB::Snapshot* snapshot, const std::string& type,
+               const std::vector<std::string>& columns,
+               const std::vector<DB::Type>& types, std::ostream* out) {
+    if (!snapshot) return true;
+    auto obj = JsonObject::create();
+    std::string str;
+    do {
+        obj->clear();
+        obj->put("type", type);
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (columns[i].empty()) continue;
+            bool null;
+            if (!snapshot->is_null(i, &null)) return false;
+            if (null) continue;
+            switch (types[i]) {
+            case DB::Type::STRING:
+                if (!get_text(snapshot, i, &str)) return false;
+                obj->put(columns[i], str);
+                break;
+            case DB::Type::BOOL: {
+                bool b;
+                if (!snapshot->get(i, &b)) return false;
+                obj->put(columns[i], b);
+                break;
+            }
+            default: {
+                int64_t i64;
+                if (!snapshot->get(i, &i64)) return false;
+                obj->put(columns[i], i64);
+                break;
+            }
+            }
+        }
+        *out << obj->str() << '\n';
+    } while (snapshot->next());
+    return !snapshot->bad() && out->good();
+}
+
+// Fallbacks for telling a missing value from one with the wrong type
+const std::string kMissing;
+
+bool get_int64(const JsonObject& obj, const std::string& name,
+               int64_t* value) {
+    *value = obj.get(name, static_cast<int64_t>(0));
+    return *value != 0 || obj.get(name, static_cast<int64_t>(1)) == 0;
+}
+
+bool get_bool(const JsonObject& obj, const std::string& name, bool* value) {
+    *value = obj.get(name, false);
+    return *value || !obj.get(name, true);
+}
+
+// Set name in editor to the integer or, if there is none, NULL. Returns
+// false if it's there but not an integer
+bool set_int64(DB::Editor* editor, const JsonObject& obj,
+               const std::string& name) {
+    int64_t value;
+    if (get_int64(obj, name, &value)) {
+        editor->set(name, value);
+        return true;
+    }
+    editor->set_null(name);
+    return !obj.contains(name) || obj.is_null(name);
+}
+
+bool set_bool(DB::Editor* editor, const JsonObject& obj,
+              const std::string& name) {
+    bool value;
+    if (get_bool(obj, name, &value)) {
+        editor->set(name, value);
+        return true;
+    }
+    editor->set_null(name);
+    return !obj.contains(name) || obj.is_null(name);
+}
+
+bool set_string(DB::Editor* editor, const JsonObject& obj,
+                const std::string& name) {
+    auto const& value = obj.get(name, kMissing);
+    if (&value != &kMissing) {
+        editor->set(name, value);
+        return true;
+    }
+    editor->set_null(name);
+    return !obj.contains(name) || obj.is_null(name);
+}
+
+// Like set_string() but compressed if long, see put_text()
+bool set_compressed(DB::Editor* editor, const JsonObject& obj,
+                    const std::string& name) {
+    auto const& value = obj.get(name, kMissing);
+    if (&value != &kMissing) {
+        put_text(editor, name, value);
+        return true;
+    }
+    editor->set_null(name);
+    return !obj.contains(name) || obj.is_null(name);
+}
 
 class EventImpl : public Event {
 public:
     ~EventImpl() override {
+        if (batch_) {
+            batch_->erase(std::find(batch_->begin(), batch_->end(), this));
+        }
     }
 
     int64_t id() const override {
@@ -30,12 +516,19 @@ public:
     }
 
     const std::string& text() const override {
+        if (!text_data_.empty()) {
+            if (!DB::uncompress_text(text_data_.data(), text_data_.size(),
+                                     &text_)) {
+                text_.clear();
+            }
+            text_data_.clear();
+        }
         return text_;
     }
     void set_text(const std::string& text) override {
-        if (text_ == text) return;
+        if (this->text() == text) return;
         edit();
-        editor_->set("text", text);
+        put_text(editor_.get(), "text", text);
         text_ = text;
     }
 
@@ -49,104 +542,471 @@ public:
         start_ = start;
     }
 
+    unsigned int repeat_days() const override {
+        return repeat_days_;
+    }
+    time_t repeat_until() const override {
+        return repeat_until_;
+    }
+    void set_repeat(unsigned int days, time_t until) override {
+        if (series_id(id_)) return;
+        if (days == 0) until = 0;
+        if (repeat_days_ == days && repeat_until_ == until) return;
+        edit();
+        if (days) {
+            editor_->set("repeat_days", static_cast<int64_t>(days));
+            editor_->set("repeat_until",
+                         until ? static_cast<int64_t>(until) : kRepeatForever);
+        } else {
+            editor_->set_null("repeat_days");
+            editor_->set_null("repeat_until");
+        }
+        repeat_days_ = days;
+        repeat_until_ = until;
+    }
+
+    int64_t series() const override {
+        return series_id(id_);
+    }
+
+    size_t capacity() const override {
+        return capacity_;
+    }
+    void set_capacity(size_t capacity) override {
+        if (capacity_ == capacity) return;
+        edit();
+        if (capacity) {
+            editor_->set("capacity", static_cast<int64_t>(capacity));
+        } else {
+            editor_->set_null("capacity");
+        }
+        capacity_ = capacity;
+        capacity_changed_ = true;
+        if (going_loaded_) going_.promote(capacity_);
+    }
+
     void going(std::vector<Going>* going) const override {
-        going->assign(going_.begin(), going_.end());
+        if (!ensure_going()) {
+            going->clear();
+            return;
+        }
+        going->assign(going_.going().begin(), going_.going().end());
+        going->insert(going->end(), going_.waiting().begin(),
+                      going_.waiting().end());
+        going->insert(going->end(), going_.not_going().begin(),
+                      going_.not_going().end());
     }
 
     bool is_going(const std::string& name) const override {
-        for (const auto& going : going_) {
-            if (going.name == name) {
-                return going.is_going;
-            }
-        }
-        return false;
+        uint32_t name_id;
+        // Loading the going list interns its names
+        if (!ensure_going() || !Names::find(name, &name_id)) return false;
+        auto going = going_.find(name_id);
+        return going && going->is_going && !going->waiting;
+    }
+
+    bool find_going(const std::string& name, Going* going) const override {
+        uint32_t name_id;
+        // Loading the going list interns its names
+        if (!ensure_going() || !Names::find(name, &name_id)) return false;
+        auto entry = going_.find(name_id);
+        if (!entry) return false;
+        *going = *entry;
+        return true;
+    }
+
+    size_t going_count() const override {
+        return going_loaded_ ? going_.going().size() : going_count_;
+    }
+
+    size_t waiting_count() const override {
+        return going_loaded_ ? going_.waiting().size() : waiting_count_;
+    }
+
+    size_t not_going_count() const override {
+        return going_loaded_ ? going_.not_going().size() : not_going_count_;
     }
 
     void update_going(const std::string& name, bool is_going,
                       const std::string& note) override {
-        for (auto it = going_.begin(); it != going_.end(); ++it) {
-            if (it->name == name) {
-                if (it->is_going == is_going && it->note == note) {
-                    return;
-                }
-                going_.erase(it);
-                break;
-            }
-        }
-        std::vector<Going>::iterator it;
-        if (is_going) {
-            for (it = going_.begin(); it != going_.end(); ++it) {
-                if (!it->is_going) {
-                    break;
-                }
-            }
-        } else {
-            it = going_.end();
+        auto const name_id = Names::intern(name);
+        auto const now = time(NULL);
+        // Shows the change until stored, what it ends up as is decided by
+        // store()
+        if (going_loaded_) {
+            going_.update(name_id, is_going, note, now, capacity_);
         }
-        going_.emplace(it, name, is_going, note, time(NULL));
-        going_uptodate_ = false;
+        // New events have nothing stored to change, the whole list is
+        // inserted
+        if (new_ && !series_id(id_)) return;
+        changes_.push_back(Change{name_id, is_going, note, now});
     }
 
     bool store() override {
-        if (editor_) {
-            DB::Transaction transaction(db_);
-            if (!editor_->commit()) return false;
-            if (new_) {
-                id_ = editor_->last_insert_rowid();
+        if (new_ && !series_id(id_)) return store_new();
+        if (!new_ && !editor_ && changes_.empty()) return true;
+        // Seats are given out based on the stored counters, nothing else
+        // may write between reading and updating them
+        DB::Transaction transaction(db_, true);
+        StatsChange stats;
+        if (new_ && !store_occurrence(&stats)) return false;
+        Counts counts;
+        bool const counted = !changes_.empty() || capacity_changed_;
+        if (counted && !store_changes(&counts, &stats)) return false;
+        if (editor_ && !editor_->commit()) return false;
+        if (!stats.store(db_.get())) return false;
+        if (!transaction.commit()) return false;
+        new_ = false;
+        editor_.reset();
+        capacity_changed_ = false;
+        if (counted) {
+            going_count_ = counts.going;
+            waiting_count_ = counts.waiting;
+            not_going_count_ = counts.not_going;
+        }
+        if (!changes_.empty()) {
+            // Others may have changed the list too, read it again when needed
+            changes_.clear();
+            going_loaded_ = false;
+            going_.clear();
+        }
+        return true;
+    }
+
+    bool remove() override {
+        return remove(db_.get(), std::vector<EventImpl*>(1, this));
+    }
+
+    // Remove events and their going lists with one delete per table, in one
+    // transaction
+    static bool remove(DB* db, const std::vector<EventImpl*>& events) {
+        std::vector<DB::Value> ids;
+        std::set<int64_t> series;
+        for (auto event : events) {
+            if (series_id(event->id_)) {
+                series.insert(series_id(event->id_));
+            } else if (!event->new_) {
+                if (event->repeat_days_) {
+                    series.insert(event->id_);
+                } else {
+                    ids.emplace_back(event->id_);
+                }
             }
-            if (store_going() && transaction.commit()) {
-                new_ = false;
-                editor_.reset();
-                return true;
-            } else {
-                if (new_) id_ = 0;
+        }
+        // The statistics are read and written back
+        DB::Transaction transaction(db, true);
+        StatsChange stats;
+        for (auto id : series) {
+            if (!remove_series(db, id, &stats)) return false;
+        }
+        if (!ids.empty()) {
+            DB::Condition const going("event", DB::Condition::IN, ids);
+            if (!stats.count(db->select_columns(kEventGoingTable,
+                                                stats_columns(),
+                                                going).get(), -1))
                 return false;
-            }
-        } else {
-            if (new_) return false;
-            return store_going();
+            auto const removed = db->remove(
+                    kEventTable, DB::Condition("id", DB::Condition::IN, ids));
+            if (removed < 0 || db->remove(kEventGoingTable, going) < 0)
+                return false;
+            stats.count_event(-removed);
         }
+        if (!stats.store(db) || !transaction.commit()) return false;
+        for (auto event : events) {
+            event->new_ = true;
+            event->id_ = 0;
+        }
+        return true;
     }
 
-    bool remove() override {
-        if (new_) return true;
-        DB::Transaction transaction(db_);
-        if (db_->remove(kEventTable,
-                        DB::Condition("id", DB::Condition::EQUAL, id_)) < 0 ||
-            db_->remove(kEventGoingTable,
-                        DB::Condition("event", DB::Condition::EQUAL, id_)) < 0)
-            return false;
-        if (transaction.commit()) {
-            new_ = true;
-            id_ = 0;
-            return true;
+    std::unique_ptr<Event> clone() const override {
+        assert(!editor_ && changes_.empty());
+        std::unique_ptr<EventImpl> ret(new EventImpl(db_));
+        if (!going_loaded_) {
+            // Join the batch so that the clone doesn't need its own select
+            if (!batch_) {
+                batch_ = std::make_shared<std::vector<const EventImpl*>>(
+                        1, this);
+            }
+            ret->batch_ = batch_;
+            batch_->push_back(ret.get());
         }
-        return false;
+        ret->id_ = id_;
+        ret->name_ = name_;
+        ret->text_ = text_;
+        ret->text_data_ = text_data_;
+        ret->start_ = start_;
+        ret->repeat_days_ = repeat_days_;
+        ret->repeat_until_ = repeat_until_;
+        ret->capacity_ = capacity_;
+        ret->going_count_ = going_count_;
+        ret->waiting_count_ = waiting_count_;
+        ret->not_going_count_ = not_going_count_;
+        ret->new_ = new_;
+        ret->going_ = going_;
+        ret->going_loaded_ = going_loaded_;
+        return ret;
     }
 
+    // Going is loaded on first use
     bool load(DB::Snapshot* snapshot) {
         editor_.reset();
         new_ = false;
+        going_.clear();
+        going_loaded_ = false;
+        changes_.clear();
+        capacity_changed_ = false;
         if (snapshot->bad()) return false;
         if (!snapshot->get(0, &id_)) return false;
         if (!snapshot->get(1, &name_)) return false;
         int64_t tmp;
         if (!snapshot->get(2, &tmp)) return false;
         start_ = tmp;
+        text_data_.clear();
         if (!snapshot->get(3, &text_)) {
-            text_ = "";
+            text_.clear();
+            // Compressed, left for text() to uncompress when it's needed
+            std::vector<uint8_t> data;
+            if (snapshot->get(3, &data)) {
+                text_data_.assign(data.begin(), data.end());
+            }
+        }
+        if (!snapshot->get(4, &tmp)) tmp = 0;
+        going_count_ = tmp;
+        if (!snapshot->get(5, &tmp)) tmp = 0;
+        not_going_count_ = tmp;
+        if (snapshot->get(6, &tmp) && tmp > 0) {
+            repeat_days_ = tmp;
+            if (!snapshot->get(7, &tmp)) return false;
+            repeat_until_ = tmp == kRepeatForever ? 0 : tmp;
+        } else {
+            repeat_days_ = 0;
+            repeat_until_ = 0;
+        }
+        if (!snapshot->get(8, &tmp)) tmp = 0;
+        capacity_ = tmp;
+        if (!snapshot->get(9, &tmp)) tmp = 0;
+        waiting_count_ = tmp;
+        return true;
+    }
+
+    // Create the occurrence number occurrence of series. It isn't stored
+    // until it is changed
+    static std::unique_ptr<EventImpl> occurrence(const EventImpl& series,
+                                                 uint32_t occurrence,
+                                                 time_t start) {
+        std::unique_ptr<EventImpl> ret(new EventImpl(series.db_));
+        ret->id_ = occurrence_id(series.id_, occurrence);
+        ret->name_ = series.name_;
+        ret->text_ = series.text_;
+        ret->text_data_ = series.text_data_;
+        ret->start_ = start;
+        ret->capacity_ = series.capacity_;
+        return ret;
+    }
+
+    typedef std::vector<std::pair<uint32_t, time_t>> Occurrences;
+
+    // Number and start of the occurrences starting from from to to,
+    // inclusive. With next set the first one after from is included even if
+    // it starts after to
+    Occurrences occurrences(time_t from, time_t to, bool next) const {
+        Occurrences ret;
+        auto const period = static_cast<time_t>(repeat_days_) * 24 * 60 * 60;
+        auto const until = std::min(repeat_until_ ? repeat_until_
+                                    : std::numeric_limits<time_t>::max(),
+                                    next ? std::numeric_limits<time_t>::max()
+                                    : to);
+        // Start a bit early, days aren't always 24 hours
+        int64_t number = 0;
+        if (from > start_) number = std::max<int64_t>(
+                (from - start_) / period - 1, 0);
+        for (; number <= 0xffffffff; number++) {
+            auto const start = occurrence_start(start_, repeat_days_, number);
+            if (start < from) continue;
+            if (start > until || (!ret.empty() && start > to)) break;
+            ret.emplace_back(number, start);
+        }
+        return ret;
+    }
+
+    // Ids of the stored occurrences among occurrences
+    std::unordered_set<int64_t> stored(const Occurrences& occurrences) const {
+        std::unordered_set<int64_t> ret;
+        if (occurrences.empty()) return ret;
+        auto snapshot = db_->select(
+                kEventTable,
+                DB::Condition("id", DB::Condition::BETWEEN,
+                              occurrence_id(id_, occurrences.back().first),
+                              occurrence_id(id_, occurrences.front().first)));
+        if (snapshot) {
+            do {
+                int64_t id;
+                if (snapshot->get(0, &id)) ret.insert(id);
+            } while (snapshot->next());
+        }
+        return ret;
+    }
+
+    // Add the occurrences that aren't stored to events, the stored ones are
+    // loaded like any other event. With first set only the first one is added
+    void expand(const Occurrences& occurrences,
+                const std::unordered_set<int64_t>& stored, bool first,
+                std::vector<std::unique_ptr<EventImpl>>* events) const {
+        for (const auto& pair : occurrences) {
+            if (stored.count(occurrence_id(id_, pair.first))) continue;
+            events->push_back(occurrence(*this, pair.first, pair.second));
+            if (first) break;
+        }
+    }
+
+    // Remove the repeating event with all its stored occurrences, which are
+    // taken out of stats
+    static bool remove_series(DB* db, int64_t series, StatsChange* stats) {
+        DB::Condition occurrences("id", DB::Condition::BETWEEN,
+                                  occurrence_id(series, 0xffffffff),
+                                  occurrence_id(series, 0));
+        DB::Condition going("event", DB::Condition::BETWEEN,
+                            occurrence_id(series, 0xffffffff),
+                            occurrence_id(series, 0));
+        DB::Condition const series_going("event", DB::Condition::EQUAL,
+                                         series);
+        DB::Transaction transaction(db);
+        if (!stats->count(db->select_columns(kEventGoingTable,
+                                             stats_columns(),
+                                             going).get(), -1) ||
+            !stats->count(db->select_columns(kEventGoingTable,
+                                             stats_columns(),
+                                             series_going).get(), -1) ||
+            db->remove(kEventTable,
+                       DB::Condition("id", DB::Condition::EQUAL,
+                                     series)) < 0 ||
+            db->remove(kEventGoingTable, series_going) < 0) {
+            return false;
+        }
+        auto const removed = db->remove(kEventTable, occurrences);
+        if (removed < 0 || db->remove(kEventGoingTable, going) < 0) {
+            return false;
+        }
+        stats->count_event(-removed);
+        return transaction.commit();
+    }
+
+    // Events loaded together by Event::all(), the first one to need going
+    // loads it for all of them
+    static void batch(const std::vector<const EventImpl*>& events) {
+        if (events.size() < 2) return;
+        auto batch = std::make_shared<std::vector<const EventImpl*>>(events);
+        for (auto event : events) {
+            event->batch_ = batch;
         }
-        return load_going();
     }
 
     EventImpl(std::shared_ptr<DB> db)
-        : db_(db), id_(0), new_(true), going_uptodate_(true) {
+        : db_(db), id_(0), start_(0), repeat_days_(0), repeat_until_(0),
+          capacity_(0), going_count_(0), waiting_count_(0),
+          not_going_count_(0), new_(true), capacity_changed_(false),
+          going_loaded_(true) {
     }
 
 private:
+    // A call to update_going() on a stored event
+    struct Change {
+        Names::Ref name_id;
+        bool is_going;
+        std::string note;
+        time_t added;
+    };
+
+    bool ensure_going() const {
+        if (going_loaded_) return true;
+        if (!batch_) return load_going();
+        return load_going(db_.get(), *batch_);
+    }
+
+    // Load going for all events that haven't loaded it yet with one select
+    static bool load_going(DB* db,
+                           const std::vector<const EventImpl*>& events) {
+        // Clones share id with the event they were cloned from
+        std::multimap<int64_t, const EventImpl*> ids;
+        std::vector<DB::Value> values;
+        for (auto event : events) {
+            if (event->going_loaded_) continue;
+            event->going_.clear();
+            event->going_loaded_ = true;
+            if (ids.count(event->id_) == 0) values.emplace_back(event->id_);
+            ids.emplace(event->id_, event);
+        }
+        if (ids.empty()) return true;
+        std::vector<DB::OrderBy> order_by;
+        order_by.push_back(DB::OrderBy("event"));
+        order_by.push_back(DB::OrderBy("is_going", false));
+        order_by.push_back(DB::OrderBy("added"));
+        order_by.push_back(DB::OrderBy("user"));
+        auto snapshot = db->select(kEventGoingTable,
+                                   DB::Condition("event", DB::Condition::IN,
+                                                 values),
+                                   order_by);
+        // No snapshot when none of them has any rows
+        std::vector<Row> rows;
+        std::vector<DB::Value> users;
+        std::unordered_map<int64_t, Names::Ref> names;
+        if (snapshot && (!read_going(snapshot.get(), &rows, &users) ||
+                         !load_users(db, users, &names))) {
+            for (const auto& pair : ids) {
+                pair.second->going_loaded_ = false;
+            }
+            return false;
+        }
+        for (const auto& row : rows) {
+            auto range = ids.equal_range(row.event);
+            for (auto it = range.first; it != range.second; ++it) {
+                it->second->going_.push_back(
+                        Going(names[row.user], row.is_going, row.note,
+                              row.added, row.waiting));
+            }
+        }
+        for (const auto& pair : ids) pair.second->replay_changes();
+        return true;
+    }
+
+    struct Row {
+        int64_t event;
+        int64_t user;
+        bool is_going;
+        std::string note;
+        time_t added;
+        bool waiting;
+    };
+
+    // Read all rows from snapshot, users gets each distinct user id
+    static bool read_going(DB::Snapshot* snapshot, std::vector<Row>* rows,
+                           std::vector<DB::Value>* users) {
+        std::unordered_set<int64_t> seen;
+        do {
+            Row row;
+            int64_t added;
+            if (!snapshot->get(0, &row.event) ||
+                !snapshot->get(1, &row.user) ||
+                !snapshot->get(2, &row.is_going) ||
+                !snapshot->get(4, &added)) {
+                return false;
+            }
+            if (!get_text(snapshot, 3, &row.note))
+                row.note = "";
+            if (!snapshot->get(5, &row.waiting))
+                row.waiting = false;
+            row.added = static_cast<time_t>(added);
+            if (seen.insert(row.user).second) users->emplace_back(row.user);
+            rows->push_back(std::move(row));
+        } while (snapshot->next());
+        return !snapshot->bad();
+    }
+
     void edit() {
         if (editor_) return;
-        if (new_) {
+        // Occurrences are inserted by store_occurrence() and then updated
+        if (new_ && !series_id(id_)) {
             editor_ = db_->insert(kEventTable);
         } else {
             editor_ = db_->update(kEventTable,
@@ -156,119 +1016,841 @@ private:
         }
     }
 
-    bool store_going() {
-        if (going_uptodate_) return true;
-        DB::Transaction transaction(db_);
-        if (db_->remove(kEventGoingTable,
-                        DB::Condition("event", DB::Condition::EQUAL, id_)) < 0)
+    bool store_new() {
+        edit();
+        editor_->set("going_count",
+                     static_cast<int64_t>(going_.going().size()));
+        editor_->set("waiting_count",
+                     static_cast<int64_t>(going_.waiting().size()));
+        editor_->set("not_going_count",
+                     static_cast<int64_t>(going_.not_going().size()));
+        // The statistics are read and written back
+        DB::Transaction transaction(db_, true);
+        if (!editor_->commit()) return false;
+        id_ = editor_->last_insert_rowid();
+        StatsChange stats;
+        // Repeating events only count through their stored occurrences
+        if (!repeat_days_) stats.count_event(1);
+        if (!insert_going(&stats) || !stats.store(db_.get()) ||
+            !transaction.commit()) {
+            id_ = 0;
             return false;
-        for (const auto& going : going_) {
-            auto editor = db_->insert(kEventGoingTable);
-            editor->set("event", id_);
-            editor->set("name", going.name);
-            editor->set("is_going", going.is_going);
-            editor->set("note", going.note);
-            editor->set("added", static_cast<int64_t>(going.added));
-            if (!editor->commit()) {
-                return false;
+        }
+        new_ = false;
+        editor_.reset();
+        capacity_changed_ = false;
+        return true;
+    }
+
+    // Insert all of going_, for a new event that has nothing stored
+    bool insert_going(StatsChange* stats) {
+        std::vector<uint32_t> names;
+        for (auto list : { &going_.going(), &going_.waiting(),
+                    &going_.not_going() }) {
+            for (const auto& going : *list) names.push_back(going.name_id);
+        }
+        std::unordered_map<uint32_t, int64_t> users;
+        if (!store_users(db_.get(), names, &users)) return false;
+        for (auto list : { &going_.going(), &going_.waiting(),
+                    &going_.not_going() }) {
+            for (const auto& going : *list) {
+                auto editor = db_->insert(kEventGoingTable);
+                editor->set("event", id_);
+                editor->set("user", users[going.name_id]);
+                editor->set("is_going", going.is_going);
+                editor->set("waiting", going.waiting);
+                put_text(editor.get(), "note", going.note);
+                editor->set("added", static_cast<int64_t>(going.added));
+                if (!editor->commit()) {
+                    return false;
+                }
+                stats->count(users[going.name_id], going.is_going,
+                             going.waiting, 1);
             }
         }
-        if (transaction.commit()) {
-            going_uptodate_ = true;
-            return true;
+        return true;
+    }
+
+    // Insert the occurrence as it was expanded, unless it was stored by
+    // someone else since. Changes are then stored like for any other event
+    bool store_occurrence(StatsChange* stats) {
+        std::vector<std::string> columns(1, "id");
+        if (db_->select_columns(kEventTable, columns,
+                                DB::Column("id") == id_)) return true;
+        auto editor = db_->insert(kEventTable);
+        editor->set("id", id_);
+        editor->set("name", name_);
+        if (text_data_.empty()) {
+            put_text(editor.get(), "text", text_);
+        } else {
+            editor->set("text", text_data_.data(), text_data_.size());
+        }
+        editor->set("start", static_cast<int64_t>(start_));
+        if (capacity_) {
+            editor->set("capacity", static_cast<int64_t>(capacity_));
         }
-        return false;
+        editor->set("going_count", static_cast<int64_t>(0));
+        editor->set("waiting_count", static_cast<int64_t>(0));
+        editor->set("not_going_count", static_cast<int64_t>(0));
+        if (!editor->commit()) return false;
+        stats->count_event(1);
+        return true;
+    }
+
+    struct Counts {
+        int64_t going;
+        int64_t waiting;
+        int64_t not_going;
+    };
+
+    // Apply changes_ to the stored going list one user at a time, seats
+    // are given out by the stored counters. Must be in a write transaction
+    bool store_changes(Counts* counts, StatsChange* stats) {
+        std::vector<std::string> columns;
+        columns.push_back("going_count");
+        columns.push_back("waiting_count");
+        columns.push_back("not_going_count");
+        columns.push_back("capacity");
+        auto snapshot = db_->select_columns(kEventTable, columns,
+                                            DB::Column("id") == id_);
+        if (!snapshot) return false;
+        int64_t capacity;
+        if (!snapshot->get(0, &counts->going)) counts->going = 0;
+        if (!snapshot->get(1, &counts->waiting)) counts->waiting = 0;
+        if (!snapshot->get(2, &counts->not_going)) counts->not_going = 0;
+        if (!snapshot->get(3, &capacity)) capacity = 0;
+        snapshot.reset();
+        // Set by this store, not yet written
+        if (capacity_changed_) capacity = capacity_;
+        std::vector<uint32_t> names;
+        for (const auto& change : changes_) names.push_back(change.name_id);
+        std::unordered_map<uint32_t, int64_t> users;
+        if (!store_users(db_.get(), names, &users)) return false;
+        for (const auto& change : changes_) {
+            if (!store_change(users[change.name_id], change, capacity,
+                              counts, stats) ||
+                !promote(capacity, counts, stats)) return false;
+        }
+        if (changes_.empty() && !promote(capacity, counts, stats)) {
+            return false;
+        }
+        edit();
+        editor_->set("going_count", counts->going);
+        editor_->set("waiting_count", counts->waiting);
+        editor_->set("not_going_count", counts->not_going);
+        return true;
+    }
+
+    // Same rules as GoingList::update(), but only reads the row for user
+    bool store_change(int64_t user, const Change& change, int64_t capacity,
+                      Counts* counts, StatsChange* stats) {
+        auto const condition = DB::Column("event") == id_ &&
+            DB::Column("user") == user;
+        std::vector<std::string> columns;
+        columns.push_back("is_going");
+        columns.push_back("waiting");
+        columns.push_back("note");
+        auto snapshot = db_->select_columns(kEventGoingTable, columns,
+                                            condition);
+        std::shared_ptr<DB::Editor> editor;
+        if (snapshot) {
+            bool is_going, waiting;
+            std::string note;
+            if (!snapshot->get(0, &is_going)) return false;
+            if (!snapshot->get(1, &waiting)) waiting = false;
+            if (!get_text(snapshot.get(), 2, &note)) note.clear();
+            snapshot.reset();
+            editor = db_->update(kEventGoingTable, condition);
+            if (is_going == change.is_going) {
+                if (note == change.note) return true;
+                put_text(editor.get(), "note", change.note);
+                return editor->commit();
+            }
+            if (!is_going) {
+                counts->not_going--;
+            } else if (waiting) {
+                counts->waiting--;
+            } else {
+                counts->going--;
+            }
+            stats->count(user, is_going, waiting, -1);
+        } else {
+            editor = db_->insert(kEventGoingTable);
+            editor->set("event", id_);
+            editor->set("user", user);
+        }
+        bool const waiting = change.is_going && capacity > 0 &&
+            counts->going >= capacity;
+        if (!change.is_going) {
+            counts->not_going++;
+        } else if (waiting) {
+            counts->waiting++;
+        } else {
+            counts->going++;
+        }
+        stats->count(user, change.is_going, waiting, 1);
+        editor->set("is_going", change.is_going);
+        editor->set("waiting", waiting);
+        put_text(editor.get(), "note", change.note);
+        editor->set("added", static_cast<int64_t>(change.added));
+        return editor->commit();
+    }
+
+    // Give the free seats to the first ones on the waitlist
+    bool promote(int64_t capacity, Counts* counts, StatsChange* stats) {
+        if (counts->waiting <= 0) return true;
+        size_t seats = 0;
+        if (capacity > 0) {
+            if (counts->going >= capacity) return true;
+            seats = capacity - counts->going;
+        }
+        std::vector<std::string> columns(1, "user");
+        std::vector<DB::OrderBy> order_by;
+        order_by.push_back(DB::OrderBy("added"));
+        order_by.push_back(DB::OrderBy("user"));
+        auto snapshot = db_->select_columns(
+                kEventGoingTable, columns,
+                DB::Column("event") == id_ && DB::Column("waiting") == true,
+                order_by, seats);
+        std::vector<DB::Value> users;
+        if (snapshot) {
+            do {
+                int64_t user;
+                if (!snapshot->get(0, &user)) return false;
+                users.emplace_back(user);
+                stats->count(user, true, true, -1);
+                stats->count(user, true, false, 1);
+            } while (snapshot->next());
+            if (snapshot->bad()) return false;
+            snapshot.reset();
+            auto editor = db_->update(
+                    kEventGoingTable,
+                    DB::Column("event") == id_ &&
+                    DB::Condition("user", DB::Condition::IN, users));
+            editor->set("waiting", false);
+            if (!editor->commit()) return false;
+        }
+        counts->going += users.size();
+        if (seats == 0 || users.size() < seats) {
+            // Got all of them
+            counts->waiting = 0;
+        } else {
+            counts->waiting -= users.size();
+        }
+        return true;
     }
 
-    bool load_going() {
+    bool load_going() const {
         going_.clear();
-        going_uptodate_ = true;
         std::vector<DB::OrderBy> order_by;
         order_by.push_back(DB::OrderBy("is_going", false));
         order_by.push_back(DB::OrderBy("added"));
-        order_by.push_back(DB::OrderBy("name"));
+        order_by.push_back(DB::OrderBy("user"));
         auto snapshot = db_->select(kEventGoingTable,
                                     DB::Condition("event",
                                                   DB::Condition::EQUAL,
                                                   id_),
                                     order_by);
-        if (!snapshot) return true;
-        do {
-            std::string name;
-            bool is_going;
-            std::string note;
-            int64_t added;
-            if (!snapshot->get(1, &name) || !snapshot->get(2, &is_going) ||
-                !snapshot->get(4, &added))
+        if (snapshot) {
+            std::vector<Row> rows;
+            std::vector<DB::Value> users;
+            std::unordered_map<int64_t, Names::Ref> names;
+            if (!read_going(snapshot.get(), &rows, &users) ||
+                !load_users(db_.get(), users, &names)) {
                 return false;
-            if (!snapshot->get(3, &note))
-                note = "";
-            going_.emplace_back(name, is_going, note,
-                                static_cast<time_t>(added));
-        } while (snapshot->next());
-        return !snapshot->bad();
+            }
+            for (const auto& row : rows) {
+                going_.push_back(Going(names[row.user], row.is_going,
+                                       row.note, row.added, row.waiting));
+            }
+        }
+        going_loaded_ = true;
+        replay_changes();
+        return true;
+    }
+
+    // Show the changes that aren't stored yet in the loaded list
+    void replay_changes() const {
+        for (const auto& change : changes_) {
+            going_.update(change.name_id, change.is_going, change.note,
+                          change.added, capacity_);
+        }
     }
 
     std::shared_ptr<DB> db_;
     std::shared_ptr<DB::Editor> editor_;
     int64_t id_;
     std::string name_;
-    std::string text_;
+    mutable std::string text_;
+    // Compressed text_, until text() is called
+    mutable std::string text_data_;
     time_t start_;
+    unsigned int repeat_days_;
+    time_t repeat_until_;
+    size_t capacity_;
+    // Stored counters, only used until going_ is loaded
+    size_t going_count_;
+    size_t waiting_count_;
+    size_t not_going_count_;
     bool new_;
-    bool going_uptodate_;
-    std::vector<Going> going_;
+    bool capacity_changed_;
+    mutable bool going_loaded_;
+    mutable GoingList going_;
+    // Not stored yet, only for stored events and occurrences
+    std::vector<Change> changes_;
+    // Shared with the other events from the same Event::all()
+    mutable std::shared_ptr<std::vector<const EventImpl*>> batch_;
 };
 
-std::shared_ptr<DB::Snapshot> open(std::shared_ptr<DB> db) {
+// Same order as the events_start index
+void sort_events(std::vector<std::unique_ptr<EventImpl>>* events) {
+    std::stable_sort(events->begin(), events->end(),
+                     [](const std::unique_ptr<EventImpl>& e1,
+                        const std::unique_ptr<EventImpl>& e2) {
+                         if (e1->start() != e2->start()) {
+                             return e1->start() < e2->start();
+                         }
+                         return e1->name() < e2->name();
+                     });
+}
+
+// Upcoming events ordered by start and name, with the occurrences of
+// repeating events expanded. With first set only the first one is returned.
+// valid_until, if set, gets the time before the first occurrence not
+// returned enters the window
+std::vector<std::unique_ptr<EventImpl>> upcoming(std::shared_ptr<DB> db,
+                                                 bool first,
+                                                 time_t* valid_until) {
     time_t now = time(nullptr);
+    if (valid_until) *valid_until = std::numeric_limits<time_t>::max();
+    std::vector<std::unique_ptr<EventImpl>> ret;
     std::vector<DB::OrderBy> order_by;
     order_by.push_back(DB::OrderBy("start"));
     order_by.push_back(DB::OrderBy("name"));
-    return db->select(kEventTable, DB::Condition("start",
-                                                 DB::Condition::GREATER_EQUAL,
-                                                 static_cast<int64_t>(now)),
-                      order_by);
+    auto snapshot = db->select(kEventTable,
+                               DB::Condition("start",
+                                             DB::Condition::GREATER_EQUAL,
+                                             static_cast<int64_t>(now)),
+                               order_by);
+    if (snapshot) {
+        do {
+            std::unique_ptr<EventImpl> ev(new EventImpl(db));
+            // Repeating events are only seen through their occurrences
+            if (ev->load(snapshot.get()) && !ev->repeat_days()) {
+                ret.push_back(std::move(ev));
+                if (first) break;
+            }
+        } while (snapshot->next());
+    }
+    auto const sorted = ret.size();
+    snapshot = db->select(kEventTable,
+                          DB::Condition("repeat_until",
+                                        DB::Condition::GREATER_EQUAL,
+                                        static_cast<int64_t>(now)));
+    if (snapshot) {
+        do {
+            EventImpl series(db);
+            if (series.load(snapshot.get()) && series.repeat_days()) {
+                auto const occurrences = series.occurrences(
+                        now, now + kRepeatWindow - 1, true);
+                series.expand(occurrences, series.stored(occurrences), first,
+                              &ret);
+                if (valid_until && !occurrences.empty()) {
+                    auto const after = occurrences.back().second + 1;
+                    auto const later = series.occurrences(after, after, true);
+                    if (!later.empty()) {
+                        *valid_until = std::min(
+                                *valid_until,
+                                later.front().second - kRepeatWindow);
+                    }
+                }
+            }
+        } while (snapshot->next());
+    }
+    if (ret.size() > sorted) {
+        sort_events(&ret);
+        if (first) ret.resize(1);
+    }
+    return ret;
+}
+
+// Move events_going from user names to user ids, the rows are copied to a
+// new table that then replaces the old one
+bool migrate_users(DB* db) {
+    DB::Declaration decl;
+    decl.push_back(std::make_pair("id", DB::PrimaryKey(DB::Type::INT64)));
+    decl.push_back(std::make_pair("name", DB::Unique(DB::Type::STRING)));
+    if (!db->insert_table(kUserTable, decl)) return false;
+    auto const new_table = kEventGoingTable + "_new";
+    decl.clear();
+    decl.push_back(std::make_pair("event", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("user", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("is_going", DB::NotNull(DB::Type::BOOL)));
+    decl.push_back(std::make_pair("note", DB::Type::STRING));
+    decl.push_back(std::make_pair("added", DB::NotNull(DB::Type::INT64)));
+    if (!db->remove_table(new_table) ||
+        !db->insert_table(new_table, decl)) return false;
+
+    struct Row {
+        int64_t event;
+        Event::Names::Ref name;
+        bool is_going;
+        bool has_note;
+        std::string note;
+        int64_t added;
+    };
+    std::vector<Row> rows;
+    std::vector<uint32_t> names;
+    auto snapshot = db->select(kEventGoingTable);
+    if (snapshot) {
+        do {
+            Row row;
+            std::string name;
+            if (!snapshot->get(0, &row.event) || !snapshot->get(1, &name) ||
+                !snapshot->get(2, &row.is_going) ||
+                !snapshot->get(4, &row.added)) {
+                return false;
+            }
+            row.has_note = snapshot->get(3, &row.note);
+            row.name = Event::Names::intern(name);
+            names.push_back(row.name);
+            rows.push_back(std::move(row));
+        } while (snapshot->next());
+        if (snapshot->bad()) return false;
+    }
+    snapshot.reset();
+    std::unordered_map<uint32_t, int64_t> users;
+    if (!store_users(db, names, &users)) return false;
+    for (const auto& row : rows) {
+        auto editor = db->insert(new_table);
+        editor->set("event", row.event);
+        editor->set("user", users[row.name]);
+        editor->set("is_going", row.is_going);
+        if (row.has_note) {
+            editor->set("note", row.note);
+        } else {
+            editor->set_null("note");
+        }
+        editor->set("added", row.added);
+        if (!editor->commit()) return false;
+    }
+    return db->remove_table(kEventGoingTable) &&
+        db->rename_table(new_table, kEventGoingTable);
+}
+
+// Count the going rows for every event into the new counter columns
+bool migrate_counts(DB* db) {
+    if (!db->insert_column(kEventTable, "going_count", DB::Type::INT64) ||
+        !db->insert_column(kEventTable, "not_going_count", DB::Type::INT64)) {
+        return false;
+    }
+    std::map<int64_t, std::pair<int64_t, int64_t>> counts;
+    auto snapshot = db->select(kEventGoingTable);
+    if (snapshot) {
+        do {
+            int64_t event;
+            bool is_going;
+            if (!snapshot->get(0, &event) || !snapshot->get(2, &is_going)) {
+                return false;
+            }
+            auto& count = counts[event];
+            if (is_going) {
+                count.first++;
+            } else {
+                count.second++;
+            }
+        } while (snapshot->next());
+        if (snapshot->bad()) return false;
+    }
+    snapshot.reset();
+    auto editor = db->update(kEventTable);
+    editor->set("going_count", static_cast<int64_t>(0));
+    editor->set("not_going_count", static_cast<int64_t>(0));
+    if (!editor->commit()) return false;
+    for (const auto& pair : counts) {
+        editor = db->update(kEventTable,
+                            DB::Condition("id", DB::Condition::EQUAL,
+                                          pair.first));
+        editor->set("going_count", pair.second.first);
+        editor->set("not_going_count", pair.second.second);
+        if (!editor->commit()) return false;
+    }
+    return true;
 }
 
 }  // namespace
 
+Event::Names::Ref::Ref(uint32_t id)
+    : id_(id) {
+    if (id_ == kNone) return;
+    name_entry(id_).refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+Event::Names::Ref::Ref(const Ref& ref)
+    : Ref(ref.id_) {
+}
+
+Event::Names::Ref& Event::Names::Ref::operator=(const Ref& ref) {
+    if (id_ != ref.id_) {
+        Ref tmp(ref);
+        *this = std::move(tmp);
+    }
+    return *this;
+}
+
+Event::Names::Ref& Event::Names::Ref::operator=(Ref&& ref) {
+    if (this != &ref) {
+        release();
+        id_ = ref.id_;
+        ref.id_ = kNone;
+    }
+    return *this;
+}
+
+void Event::Names::Ref::release() {
+    if (id_ == kNone) return;
+    auto& entry = name_entry(id_);
+    if (entry.refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // intern() may have found it again before the lock was taken
+        std::lock_guard<std::mutex> lock(g_names_mutex);
+        if (entry.used && entry.refs.load(std::memory_order_acquire) == 0) {
+            g_names_index.erase(entry.name);
+            std::string().swap(entry.name);
+            entry.used = false;
+            g_names_free.push_back(id_);
+        }
+    }
+    id_ = kNone;
+}
+
+// static
+Event::Names::Ref Event::Names::intern(const std::string& name) {
+    std::lock_guard<std::mutex> lock(g_names_mutex);
+    auto it = g_names_index.find(name);
+    if (it != g_names_index.end()) {
+        name_entry(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+        return Ref(it->second, Ref::Adopt());
+    }
+    uint32_t id;
+    if (g_names_free.empty()) {
+        id = g_names_end++;
+        assert(id / kNameChunkSize < kNameChunks);
+        auto& chunk = g_names[id / kNameChunkSize];
+        if (!chunk) chunk.reset(new NameEntry[kNameChunkSize]());
+    } else {
+        id = g_names_free.back();
+        g_names_free.pop_back();
+    }
+    auto& entry = name_entry(id);
+    entry.name = name;
+    entry.refs.store(1, std::memory_order_relaxed);
+    entry.used = true;
+    g_names_index.emplace(name, id);
+    return Ref(id, Ref::Adopt());
+}
+
+// static
+bool Event::Names::find(const std::string& name, uint32_t* id) {
+    std::lock_guard<std::mutex> lock(g_names_mutex);
+    auto it = g_names_index.find(name);
+    if (it == g_names_index.end()) return false;
+    *id = it->second;
+    return true;
+}
+
+// static
+const std::string& Event::Names::get(uint32_t id) {
+    auto& entry = name_entry(id);
+    assert(entry.refs.load(std::memory_order_relaxed) > 0);
+    return entry.name;
+}
+
+// static
+size_t Event::Names::size() {
+    std::lock_guard<std::mutex> lock(g_names_mutex);
+    return g_names_index.size();
+}
+
+// static
+bool Event::is_setup(DB* db) {
+    auto snapshot = db->select(kSchemaTable);
+    int64_t version;
+    return snapshot && snapshot->get(0, &version) &&
+        version == kSchemaVersion;
+}
+
 // static
 bool Event::setup(DB* db) {
+    DB::Transaction transaction(db);
     DB::Declaration decl;
+    decl.push_back(std::make_pair("version", DB::NotNull(DB::Type::INT64)));
+    if (!db->insert_table(kSchemaTable, decl)) return false;
+    // Databases created before the schema table are version 1
+    int64_t version = 1;
+    {
+        auto snapshot = db->select(kSchemaTable);
+        if (snapshot && !snapshot->get(0, &version)) return false;
+    }
+    decl.clear();
     decl.push_back(std::make_pair("id", DB::PrimaryKey(DB::Type::INT64)));
     decl.push_back(std::make_pair("name", DB::NotNull(DB::Type::STRING)));
     decl.push_back(std::make_pair("start", DB::NotNull(DB::Type::INT64)));
     decl.push_back(std::make_pair("text", DB::Type::STRING));
     if (!db->insert_table(kEventTable, decl)) return false;
+    if (version < 2) {
+        decl.clear();
+        decl.push_back(std::make_pair("event", DB::NotNull(DB::Type::INT64)));
+        decl.push_back(std::make_pair("name", DB::NotNull(DB::Type::STRING)));
+        decl.push_back(std::make_pair("is_going",
+                                      DB::NotNull(DB::Type::BOOL)));
+        decl.push_back(std::make_pair("note", DB::Type::STRING));
+        decl.push_back(std::make_pair("added", DB::NotNull(DB::Type::INT64)));
+        if (!db->insert_table(kEventGoingTable, decl) ||
+            !migrate_users(db)) return false;
+    }
+    if (version < 3 && !migrate_counts(db)) return false;
+    if (version < 4 &&
+        (!db->insert_column(kEventTable, "repeat_days", DB::Type::INT64) ||
+         !db->insert_column(kEventTable, "repeat_until", DB::Type::INT64))) {
+        return false;
+    }
+    if (version < 5 &&
+        (!db->insert_column(kEventTable, "capacity", DB::Type::INT64) ||
+         !db->insert_column(kEventTable, "waiting_count", DB::Type::INT64) ||
+         !db->insert_column(kEventGoingTable, "waiting", DB::Type::BOOL))) {
+        return false;
+    }
     decl.clear();
-    decl.push_back(std::make_pair("event", DB::NotNull(DB::Type::INT64)));
-    decl.push_back(std::make_pair("name", DB::NotNull(DB::Type::STRING)));
-    decl.push_back(std::make_pair("is_going", DB::NotNull(DB::Type::BOOL)));
-    decl.push_back(std::make_pair("note", DB::Type::STRING));
-    decl.push_back(std::make_pair("added", DB::NotNull(DB::Type::INT64)));
-    return db->insert_table(kEventGoingTable, decl);
+    decl.push_back(std::make_pair("name", DB::PrimaryKey(DB::Type::STRING)));
+    decl.push_back(std::make_pair("value", DB::NotNull(DB::Type::INT64)));
+    if (!db->insert_table(kStatsTable, decl)) return false;
+    decl.clear();
+    decl.push_back(std::make_pair("user", DB::PrimaryKey(DB::Type::INT64)));
+    decl.push_back(std::make_pair("going", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("waiting", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("not_going",
+                                  DB::NotNull(DB::Type::INT64)));
+    if (!db->insert_table(kUserStatsTable, decl)) return false;
+    // Count what is there so far
+    if (version < 6 && !rebuild_stats(db)) return false;
+    // Made again below, the text index now uncompresses what it indexes and
+    // has no triggers
+    if (version < 8 && !db->remove_indexes(kEventTable)) return false;
+    // Indexes must match the WHERE and ORDER BY used by upcoming(),
+    // load_going() and store_changes() so that none of them needs a scan or
+    // a temporary sort.
+    std::vector<DB::OrderBy> columns;
+    columns.push_back(DB::OrderBy("start"));
+    columns.push_back(DB::OrderBy("name"));
+    if (!db->insert_index(kEventTable, "events_start", columns)) return false;
+    columns.clear();
+    columns.push_back(DB::OrderBy("repeat_until"));
+    if (!db->insert_index(kEventTable, "events_repeat", columns)) return false;
+    std::vector<std::string> text;
+    text.push_back("name");
+    text.push_back("text");
+    if (!db->insert_text_index(kEventTable, text)) return false;
+    columns.clear();
+    columns.push_back(DB::OrderBy("event"));
+    columns.push_back(DB::OrderBy("is_going", false));
+    columns.push_back(DB::OrderBy("added"));
+    columns.push_back(DB::OrderBy("user"));
+    if (!db->insert_index(kEventGoingTable, "events_going_event", columns)) {
+        return false;
+    }
+    columns.clear();
+    columns.push_back(DB::OrderBy("event"));
+    columns.push_back(DB::OrderBy("user"));
+    if (!db->insert_index(kEventGoingTable, "events_going_user", columns)) {
+        return false;
+    }
+    columns.clear();
+    columns.push_back(DB::OrderBy("event"));
+    columns.push_back(DB::OrderBy("waiting"));
+    columns.push_back(DB::OrderBy("added"));
+    columns.push_back(DB::OrderBy("user"));
+    if (!db->insert_index(kEventGoingTable, "events_going_waiting",
+                          columns)) {
+        return false;
+    }
+    if (version < kSchemaVersion) {
+        if (db->remove(kSchemaTable) < 0) return false;
+        auto editor = db->insert(kSchemaTable);
+        editor->set("version", kSchemaVersion);
+        if (!editor->commit()) return false;
+    }
+    return transaction.commit();
 }
 
 // static
 std::unique_ptr<Event> Event::next(std::shared_ptr<DB> db) {
-    auto snapshot = open(db);
+    // upcoming() reads the events, their repeat ends and stored occurrences
+    // with separate selects, they must all see the same state
+    DB::ReadTransaction transaction(db.get());
+    auto events = upcoming(db, true, nullptr);
+    if (events.empty()) return nullptr;
+    return std::move(events.front());
+}
+
+// static
+std::vector<std::unique_ptr<Event>> Event::all(std::shared_ptr<DB> db,
+                                               time_t* valid_until) {
+    DB::ReadTransaction transaction(db.get());
+    auto events = upcoming(db, false, valid_until);
+    if (valid_until && !events.empty()) {
+        *valid_until = std::min(*valid_until, events.front()->start());
+    }
+    std::vector<std::unique_ptr<Event>> ret;
+    std::vector<const EventImpl*> loaded;
+    ret.reserve(events.size());
+    for (auto& ev : events) {
+        loaded.push_back(ev.get());
+        ret.push_back(std::move(ev));
+    }
+    EventImpl::batch(loaded);
+    return ret;
+}
+
+// static
+std::vector<std::unique_ptr<Event>> Event::between(std::shared_ptr<DB> db,
+                                                   time_t from, time_t to) {
+    DB::ReadTransaction transaction(db.get());
+    std::vector<std::unique_ptr<EventImpl>> events;
+    std::vector<DB::OrderBy> order_by;
+    order_by.push_back(DB::OrderBy("start"));
+    order_by.push_back(DB::OrderBy("name"));
+    auto snapshot = db->select(kEventTable,
+                               DB::Condition("start", DB::Condition::BETWEEN,
+                                             static_cast<int64_t>(from),
+                                             static_cast<int64_t>(to)),
+                               order_by);
     if (snapshot) {
         do {
-            auto ev = new EventImpl(db);
-            if (ev->load(snapshot.get())) {
-                return std::unique_ptr<Event>(ev);
+            std::unique_ptr<EventImpl> ev(new EventImpl(db));
+            if (ev->load(snapshot.get()) && !ev->repeat_days()) {
+                events.push_back(std::move(ev));
+            }
+        } while (snapshot->next());
+    }
+    snapshot = db->select(kEventTable,
+                          DB::Condition("repeat_until",
+                                        DB::Condition::GREATER_EQUAL,
+                                        static_cast<int64_t>(from)));
+    if (snapshot) {
+        std::vector<std::unique_ptr<EventImpl>> series;
+        do {
+            std::unique_ptr<EventImpl> ev(new EventImpl(db));
+            if (ev->load(snapshot.get()) && ev->repeat_days()) {
+                series.push_back(std::move(ev));
             }
-            delete ev;
+        } while (snapshot->next());
+        // All stored occurrences at once, there are only the ones that have
+        // been changed and not expired
+        std::unordered_set<int64_t> stored;
+        snapshot = series.empty() ? nullptr :
+            db->select(kEventTable,
+                       DB::Condition("id", DB::Condition::LESS_THAN,
+                                     static_cast<int64_t>(0)));
+        if (snapshot) {
+            do {
+                int64_t id;
+                if (snapshot->get(0, &id)) stored.insert(id);
+            } while (snapshot->next());
+        }
+        auto const sorted = events.size();
+        for (const auto& ev : series) {
+            ev->expand(ev->occurrences(from, to, false), stored, false,
+                       &events);
+        }
+        if (events.size() > sorted) sort_events(&events);
+    }
+    std::vector<std::unique_ptr<Event>> ret;
+    ret.reserve(events.size());
+    for (auto& ev : events) ret.push_back(std::move(ev));
+    return ret;
+}
+
+// static
+std::vector<Event::Header> Event::headers(std::shared_ptr<DB> db,
+                                          size_t limit) {
+    std::vector<Header> ret;
+    if (limit == 0) return ret;
+    time_t now = time(nullptr);
+    std::vector<std::string> columns;
+    columns.push_back("id");
+    columns.push_back("name");
+    columns.push_back("start");
+    columns.push_back("going_count");
+    std::vector<DB::OrderBy> order_by;
+    order_by.push_back(DB::OrderBy("start"));
+    order_by.push_back(DB::OrderBy("name"));
+    // Leave out repeating events in the query so they don't use up the limit
+    auto snapshot = db->select_columns(
+            kEventTable, columns,
+            DB::Column("start") >= static_cast<int64_t>(now) &&
+            is_null(DB::Column("repeat_days")),
+            order_by, limit);
+    if (snapshot) {
+        do {
+            Header header;
+            int64_t tmp;
+            if (!snapshot->get(0, &header.id) ||
+                !snapshot->get(1, &header.name) ||
+                !snapshot->get(2, &tmp)) continue;
+            header.start = tmp;
+            if (!snapshot->get(3, &tmp)) tmp = 0;
+            header.going_count = tmp;
+            ret.push_back(std::move(header));
         } while (snapshot->next());
     }
-    return nullptr;
+    // There are few repeating events, load them as usual and add the
+    // occurrences that aren't stored
+    snapshot = db->select(kEventTable,
+                          DB::Condition("repeat_until",
+                                        DB::Condition::GREATER_EQUAL,
+                                        static_cast<int64_t>(now)));
+    if (!snapshot) return ret;
+    std::vector<std::unique_ptr<EventImpl>> occurrences;
+    do {
+        EventImpl series(db);
+        if (series.load(snapshot.get()) && series.repeat_days()) {
+            auto const numbers = series.occurrences(
+                    now, now + kRepeatWindow - 1, true);
+            series.expand(numbers, series.stored(numbers), false,
+                          &occurrences);
+        }
+    } while (snapshot->next());
+    if (occurrences.empty()) return ret;
+    for (const auto& ev : occurrences) {
+        ret.push_back(Header{ev->id(), ev->name(), ev->start(), 0});
+    }
+    std::stable_sort(ret.begin(), ret.end(),
+                     [](const Header& h1, const Header& h2) {
+                         if (h1.start != h2.start) return h1.start < h2.start;
+                         return h1.name < h2.name;
+                     });
+    if (ret.size() > limit) ret.resize(limit);
+    return ret;
 }
 
 // static
-std::vector<std::unique_ptr<Event>> Event::all(std::shared_ptr<DB> db) {
-    auto snapshot = open(db);
+std::vector<std::unique_ptr<Event>> Event::find(std::shared_ptr<DB> db,
+                                                const std::string& text,
+                                                size_t limit) {
+    std::vector<std::string> words;
+    std::string word;
+    for (auto c : text) {
+        if (isspace(static_cast<unsigned char>(c))) {
+            if (!word.empty()) words.push_back(word);
+            word.clear();
+        } else {
+            word.push_back(c);
+        }
+    }
+    if (!word.empty()) words.push_back(word);
     std::vector<std::unique_ptr<Event>> ret;
+    if (words.empty()) return ret;
+    auto snapshot = db->search(kEventTable, words, limit);
     if (snapshot) {
         do {
             auto ev = new EventImpl(db);
@@ -282,6 +1864,16 @@ std::vector<std::unique_ptr<Event>> Event::all(std::shared_ptr<DB> db) {
     return ret;
 }
 
+// static
+bool Event::remove(DB* db, const std::vector<Event*>& events) {
+    std::vector<EventImpl*> impls;
+    impls.reserve(events.size());
+    for (auto event : events) {
+        impls.push_back(static_cast<EventImpl*>(event));
+    }
+    return EventImpl::remove(db, impls);
+}
+
 // static
 std::unique_ptr<Event> Event::create(std::shared_ptr<DB> db,
                                      const std::string& name, time_t start) {
@@ -291,5 +1883,290 @@ std::unique_ptr<Event> Event::create(std::shared_ptr<DB> db,
     return ev;
 }
 
+// static
+bool Event::dump(DB* db, std::ostream* out) {
+    DB::ReadTransaction transaction(db);
+    std::vector<std::string> columns;
+    std::vector<DB::Type> types;
+    columns.push_back("id");
+    columns.push_back("name");
+    types.push_back(DB::Type::INT64);
+    types.push_back(DB::Type::STRING);
+    if (!dump_rows(db->select(kUserTable).get(), "user", columns, types,
+                   out)) return false;
+    // Same order as EventImpl::load() reads them
+    columns.push_back("start");
+    columns.push_back("text");
+    columns.push_back("going_count");
+    columns.push_back("not_going_count");
+    columns.push_back("repeat_days");
+    columns.push_back("repeat_until");
+    columns.push_back("capacity");
+    columns.push_back("waiting_count");
+    types.push_back(DB::Type::INT64);
+    types.push_back(DB::Type::STRING);
+    types.insert(types.end(), 6, DB::Type::INT64);
+    if (!dump_rows(db->select_columns(kEventTable, columns).get(), "event",
+                   columns, types, out)) return false;
+    columns.clear();
+    types.clear();
+    columns.push_back("event");
+    columns.push_back("user");
+    columns.push_back("is_going");
+    columns.push_back("note");
+    columns.push_back("added");
+    columns.push_back("waiting");
+    types.push_back(DB::Type::INT64);
+    types.push_back(DB::Type::INT64);
+    types.push_back(DB::Type::BOOL);
+    types.push_back(DB::Type::STRING);
+    types.push_back(DB::Type::INT64);
+    types.push_back(DB::Type::BOOL);
+    if (!dump_rows(db->select_columns(kEventGoingTable, columns).get(),
+                   "going", columns, types, out)) return false;
+    // The statistics also count expired events, so they can't be rebuilt
+    columns.clear();
+    types.clear();
+    columns.push_back("name");
+    columns.push_back("value");
+    types.push_back(DB::Type::STRING);
+    types.push_back(DB::Type::INT64);
+    if (!dump_rows(db->select_columns(kStatsTable, columns).get(), "stats",
+                   columns, types, out)) return false;
+    columns.clear();
+    types.clear();
+    columns.push_back("user");
+    columns.push_back("going");
+    columns.push_back("waiting");
+    columns.push_back("not_going");
+    types.insert(types.end(), 4, DB::Type::INT64);
+    return dump_rows(db->select_columns(kUserStatsTable, columns).get(),
+                     "user_stats", columns, types, out);
+}
+
+// static
+bool Event::restore(DB* db, std::istream* in, size_t batch,
+                    std::string* error) {
+    assert(batch > 0);
+    error->clear();
+    std::vector<std::string> id(1, "id");
+    if (db->select_columns(kEventTable, id, DB::Condition(),
+                           std::vector<DB::OrderBy>(), 1) ||
+        db->select_columns(kUserTable, id, DB::Condition(),
+                           std::vector<DB::OrderBy>(), 1)) {
+        error->assign("Database is not empty");
+        return false;
+    }
+    if (!db->remove_indexes(kEventTable) ||
+        !db->remove_indexes(kEventGoingTable)) {
+        error->assign("Unable to remove indexes: " + db->last_error());
+        return false;
+    }
+    // One editor per table, each row sets the same columns so the
+    // statement is reused
+    auto user = db->insert(kUserTable);
+    auto event = db->insert(kEventTable);
+    auto going = db->insert(kEventGoingTable);
+    auto stats = db->insert(kStatsTable);
+    auto user_stats = db->insert(kUserStatsTable);
+    // Dumps from before the statistics are counted once restored
+    bool has_stats = false;
+    std::unique_ptr<DB::Transaction> transaction(new DB::Transaction(db));
+    std::string line;
+    size_t number = 0, rows = 0;
+    bool ok = true;
+    while (ok && std::getline(*in, line)) {
+        number++;
+        if (line.empty()) continue;
+        auto obj = JsonObject::parse(line);
+        if (!obj) {
+            error->assign("Line " + std::to_string(number) + ": Bad JSON");
+            ok = false;
+            break;
+        }
+        auto const& type = obj->get("type", kMissing);
+        int64_t value;
+        bool b;
+        DB::Editor* editor = nullptr;
+        if (type == "user") {
+            editor = user.get();
+            ok = get_int64(*obj, "id", &value) &&
+                set_int64(editor, *obj, "id") &&
+                set_string(editor, *obj, "name");
+        } else if (type == "event") {
+            editor = event.get();
+            ok = get_int64(*obj, "id", &value) &&
+                set_int64(editor, *obj, "id") &&
+                set_string(editor, *obj, "name") &&
+                set_int64(editor, *obj, "start") &&
+                set_compressed(editor, *obj, "text") &&
+                set_int64(editor, *obj, "going_count") &&
+                set_int64(editor, *obj, "not_going_count") &&
+                set_int64(editor, *obj, "repeat_days") &&
+                set_int64(editor, *obj, "repeat_until") &&
+                set_int64(editor, *obj, "capacity") &&
+                set_int64(editor, *obj, "waiting_count");
+        } else if (type == "going") {
+            editor = going.get();
+            ok = get_bool(*obj, "is_going", &b) &&
+                set_int64(editor, *obj, "event") &&
+                set_int64(editor, *obj, "user") &&
+                set_compressed(editor, *obj, "note") &&
+                set_int64(editor, *obj, "added") &&
+                set_bool(editor, *obj, "waiting");
+            editor->set("is_going", b);
+        } else if (type == "stats") {
+            editor = stats.get();
+            has_stats = true;
+            ok = set_string(editor, *obj, "name") &&
+                set_int64(editor, *obj, "value");
+        } else if (type == "user_stats") {
+            editor = user_stats.get();
+            has_stats = true;
+            ok = get_int64(*obj, "user", &value) &&
+                set_int64(editor, *obj, "user") &&
+                set_int64(editor, *obj, "going") &&
+                set_int64(editor, *obj, "waiting") &&
+                set_int64(editor, *obj, "not_going");
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            error->assign("Line " + std::to_string(number) + ": Bad " +
+                          (type.empty() ? "type" : type));
+            break;
+        }
+        // Missing values that can't be NULL are caught here
+        if (!editor->commit()) {
+            error->assign("Line " + std::to_string(number) + ": " +
+                          db->last_error());
+            ok = false;
+            break;
+        }
+        if (++rows % batch == 0) {
+            ok = transaction->commit();
+            transaction.reset(new DB::Transaction(db));
+        }
+    }
+    if (ok && in->bad()) {
+        error->assign("Read error");
+        ok = false;
+    }
+    if (ok && !transaction->commit()) ok = false;
+    transaction.reset();
+    if (!ok && error->empty()) {
+        error->assign("Unable to commit: " + db->last_error());
+    }
+    // Creates the indexes again, also after an error so that what has been
+    // imported can be used
+    if (!setup(db)) {
+        if (ok) error->assign("Unable to create indexes: " +
+                              db->last_error());
+        return false;
+    }
+    if (ok && !has_stats && !rebuild_stats(db)) {
+        error->assign("Unable to count statistics: " + db->last_error());
+        return false;
+    }
+    return ok;
+}
+
+// static
+bool Event::stats(DB* db, size_t* events, std::vector<UserStats>* users) {
+    DB::ReadTransaction transaction(db);
+    *events = 0;
+    users->clear();
+    auto snapshot = db->select_columns(
+            kStatsTable, std::vector<std::string>(1, "value"),
+            DB::Condition("name", DB::Condition::EQUAL,
+                          DB::Value(std::string("events"))));
+    if (snapshot) {
+        int64_t value;
+        if (!snapshot->get(0, &value)) return false;
+        *events = std::max<int64_t>(value, 0);
+    }
+    snapshot = db->select(kUserStatsTable);
+    if (!snapshot) return true;
+    std::vector<int64_t> ids;
+    std::vector<DB::Value> values;
+    do {
+        int64_t user, going, waiting, not_going;
+        if (!snapshot->get(0, &user) || !snapshot->get(1, &going) ||
+            !snapshot->get(2, &waiting) || !snapshot->get(3, &not_going)) {
+            return false;
+        }
+        if (going <= 0 && waiting <= 0 && not_going <= 0) continue;
+        ids.push_back(user);
+        values.emplace_back(user);
+        users->push_back(UserStats{std::string(),
+                    static_cast<size_t>(std::max<int64_t>(going, 0)),
+                    static_cast<size_t>(std::max<int64_t>(waiting, 0)),
+                    static_cast<size_t>(std::max<int64_t>(not_going, 0))});
+    } while (snapshot->next());
+    if (snapshot->bad()) return false;
+    std::unordered_map<int64_t, Names::Ref> names;
+    if (!load_users(db, values, &names)) return false;
+    for (size_t i = 0; i < ids.size(); i++) {
+        (*users)[i].name = Names::get(names[ids[i]]);
+    }
+    return true;
+}
+
+// static
+bool Event::rebuild_stats(DB* db) {
+    DB::Transaction transaction(db, true);
+    if (db->remove(kStatsTable) < 0 || db->remove(kUserStatsTable) < 0) {
+        return false;
+    }
+    StatsChange stats;
+    // Repeating events only count through their stored occurrences
+    auto snapshot = db->select_columns(kEventTable,
+                                       std::vector<std::string>(1, "id"),
+                                       is_null(DB::Column("repeat_days")));
+    if (snapshot) {
+        do {
+            stats.count_event(1);
+        } while (snapshot->next());
+        if (snapshot->bad()) return false;
+    }
+    if (!stats.count(db->select_columns(kEventGoingTable,
+                                        stats_columns()).get(), 1) ||
+        !stats.store(db)) return false;
+    return transaction.commit();
+}
+
+// static
+int64_t Event::expire(DB* db, time_t before, size_t batch) {
+    std::vector<int64_t> ids;
+    {
+        auto snapshot = db->select(kEventTable,
+                                   DB::Condition("start",
+                                                 DB::Condition::LESS_THAN,
+                                                 static_cast<int64_t>(before)),
+                                   DB::OrderBy("start"));
+        if (!snapshot) return 0;
+        do {
+            int64_t id;
+            if (!snapshot->get(0, &id)) return -1;
+            // Repeating events stay until their last occurrence
+            int64_t until;
+            if (snapshot->get(7, &until) &&
+                until >= static_cast<int64_t>(before)) continue;
+            ids.push_back(id);
+        } while (ids.size() < batch && snapshot->next());
+        if (snapshot->bad()) return -1;
+    }
+    DB::Transaction transaction(db);
+    for (auto id : ids) {
+        if (db->remove(kEventTable,
+                       DB::Condition("id", DB::Condition::EQUAL, id)) < 0 ||
+            db->remove(kEventGoingTable,
+                       DB::Condition("event", DB::Condition::EQUAL, id)) < 0)
+            return -1;
+    }
+    if (!transaction.commit()) return -1;
+    return ids.size();
+}
+
 
 }  // namespace stuff
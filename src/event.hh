@@ -1,6 +1,8 @@
 #ifndef EVENT_HH
 #define EVENT_HH
 
+#include <cstdint>
+#include <iosfwd>
 #include <memory>
 #include <string>
 #include <vector>
@@ -11,18 +13,104 @@ class DB;
 
 class Event {
 public:
+    // User names are interned, each distinct name is stored once per process
+    // and events refer to it by id. A name is dropped when the last Ref to
+    // it is gone, and its id reused. Thread safe, copying and dropping a Ref
+    // only takes a lock when it is the last one.
+    class Names {
+    public:
+        // Counted reference to an interned name, converts to its id
+        class Ref {
+        public:
+            Ref()
+                : id_(kNone) {
+            }
+            // id must already have a reference held by someone else
+            explicit Ref(uint32_t id);
+            Ref(const Ref& ref);
+            Ref(Ref&& ref)
+                : id_(ref.id_) {
+                ref.id_ = kNone;
+            }
+            ~Ref() {
+                release();
+            }
+
+            Ref& operator=(const Ref& ref);
+            Ref& operator=(Ref&& ref);
+
+            operator uint32_t() const {
+                return id_;
+            }
+
+        private:
+            friend class Names;
+
+            static const uint32_t kNone = UINT32_MAX;
+
+            struct Adopt {};
+            Ref(uint32_t id, Adopt)
+                : id_(id) {
+            }
+
+            void release();
+
+            uint32_t id_;
+        };
+
+        static Ref intern(const std::string& name);
+        // Returns false if name isn't interned
+        static bool find(const std::string& name, uint32_t* id);
+        // Only valid while there is a Ref to id
+        static const std::string& get(uint32_t id);
+        // Number of names interned right now
+        static size_t size();
+
+    private:
+        Names() = delete;
+    };
+
     struct Going {
-        std::string name;
+        Names::Ref name_id;
         bool is_going;
         std::string note;
         time_t added;
+        // Wants to go but the event is full, only set with is_going
+        bool waiting;
 
         Going(const std::string& name, bool is_going, const std::string& note,
-              time_t added)
-            : name(name), is_going(is_going), note(note), added(added) {
+              time_t added, bool waiting = false)
+            : name_id(Names::intern(name)), is_going(is_going), note(note),
+              added(added), waiting(waiting) {
+        }
+
+        Going(uint32_t name_id, bool is_going, const std::string& note,
+              time_t added, bool waiting = false)
+            : name_id(name_id), is_going(is_going), note(note),
+              added(added), waiting(waiting) {
+        }
+
+        const std::string& name() const {
+            return Names::get(name_id);
         }
     };
 
+    // Answers from one user over the events counted by stats()
+    struct UserStats {
+        std::string name;
+        size_t going;
+        size_t waiting;
+        size_t not_going;
+    };
+
+    // What is needed to list an event
+    struct Header {
+        int64_t id;
+        std::string name;
+        time_t start;
+        size_t going_count;
+    };
+
     virtual ~Event() {}
 
     virtual int64_t id() const = 0;
@@ -36,23 +124,121 @@ public:
     virtual time_t start() const = 0;
     virtual void set_start(time_t start) = 0;
 
+    // A repeating event occurs every repeat_days days at the same local
+    // time as start, until repeat_until if not 0. It's only seen through
+    // its occurrences, which are expanded by next() and all() and only
+    // stored once changed. Set before the event is first stored.
+    virtual unsigned int repeat_days() const = 0;
+    virtual time_t repeat_until() const = 0;
+    virtual void set_repeat(unsigned int days, time_t until) = 0;
+    // Id of the repeating event this is an occurrence of, 0 if none
+    virtual int64_t series() const = 0;
+
+    // Occurrences get the capacity of their repeating event. 0 for no limit.
+    // Raising it gives the new seats to the waitlist when stored, lowering
+    // it doesn't take any seats away
+    virtual size_t capacity() const = 0;
+    virtual void set_capacity(size_t capacity) = 0;
+
+    // The ones going, then the waitlist and then the ones not going, each
+    // in the order they were added
     virtual void going(std::vector<Going>* going) const = 0;
+    // True if name has a seat, being on the waitlist isn't enough
     virtual bool is_going(const std::string& name) const = 0;
-
+    // Returns false if name isn't in the going list
+    virtual bool find_going(const std::string& name, Going* going) const = 0;
+
+    // Number of users going, waiting and not going, stored with the event
+    // so the going list doesn't need to be loaded
+    virtual size_t going_count() const = 0;
+    virtual size_t waiting_count() const = 0;
+    virtual size_t not_going_count() const = 0;
+
+    // For stored events only the change is kept until store(), which
+    // applies it to the stored list without reading all of it. Users that
+    // want to go get a seat if there is one left when stored, else they end
+    // up last on the waitlist. The first one waiting gets the seat when
+    // someone going stops going. Changing only the note keeps the place
     virtual void update_going(const std::string& name, bool is_going,
                               const std::string& note = std::string()) = 0;
 
     virtual bool store() = 0;
 
+    // Removing an occurrence removes the repeating event and all its
+    // occurrences
     virtual bool remove() = 0;
 
+    // Returns a copy of the event, must not have any changes that aren't
+    // stored yet
+    virtual std::unique_ptr<Event> clone() const = 0;
+
     static bool setup(DB* db);
+    // Returns true if db is already set up by this version, so it can be
+    // read without setup(). False if not or in case of error
+    static bool is_setup(DB* db);
 
     static std::unique_ptr<Event> next(std::shared_ptr<DB> db);
-    static std::vector<std::unique_ptr<Event>> all(std::shared_ptr<DB> db);
+    // With valid_until set it gets the last time the same events are
+    // returned if db doesn't change. That is until the first one starts or
+    // the next occurrence of a repeating event is expanded
+    static std::vector<std::unique_ptr<Event>> all(
+            std::shared_ptr<DB> db, time_t* valid_until = nullptr);
     static std::unique_ptr<Event> create(std::shared_ptr<DB> db,
                                          const std::string& name, time_t start);
 
+    // Events starting from from to to, inclusive, ordered by start and name
+    // and with the occurrences of repeating events expanded. Going lists
+    // are not loaded together, use all() for that
+    static std::vector<std::unique_ptr<Event>> between(std::shared_ptr<DB> db,
+                                                       time_t from,
+                                                       time_t to);
+
+    // The first limit upcoming events, in the same order as all(), only
+    // reading the columns in Header
+    static std::vector<Header> headers(std::shared_ptr<DB> db, size_t limit);
+
+    // Returns at most limit events, also the ones that have started, with
+    // all the words in text in their name or text. Best match first.
+    // Repeating events are returned as themselves, not their occurrences
+    static std::vector<std::unique_ptr<Event>> find(std::shared_ptr<DB> db,
+                                                    const std::string& text,
+                                                    size_t limit);
+
+    // Remove all events, stored by the same database, and their going lists
+    // in one transaction, like calling remove() on each of them.
+    // Returns false in case of error
+    static bool remove(DB* db, const std::vector<Event*>& events);
+
+    // Remove at most batch events that started before the given time,
+    // together with their going lists, in one transaction.
+    // Returns the number of events removed or -1 in case of error
+    static int64_t expire(DB* db, time_t before, size_t batch);
+
+    // Number of events and the answers of each user that has answered any
+    // of them. The counters are kept up to date as events and going lists
+    // are stored and removed, so only one row per user is read. Expired
+    // events are still counted, occurrences of repeating events are counted
+    // once they are stored. Returns false in case of error
+    static bool stats(DB* db, size_t* events, std::vector<UserStats>* users);
+
+    // Count the events and going lists in db again, replacing what stats()
+    // returns. Expired events are no longer there to be counted.
+    // Returns false in case of error
+    static bool rebuild_stats(DB* db);
+
+    // Write all users, events, going lists and statistics in db to out, one
+    // JSON object per line read straight from the tables. Returns false in
+    // case of error
+    static bool dump(DB* db, std::ostream* out);
+
+    // Read what dump() wrote into db, which must not have any events or
+    // users. Rows are inserted batch at a time, each batch in its own
+    // transaction, and the indexes are created once all rows are in.
+    // Returns false in case of error, with a description in error. The
+    // batches before the error are kept
+    static bool restore(DB* db, std::istream* in, size_t batch,
+                        std::string* error);
+
 protected:
     Event() { }
     Event(const Event&) = delete;
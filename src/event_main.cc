@@ -11,6 +11,7 @@
 #include "args.hh"
 #include "cgi.hh"
 #include "config.hh"
+#include "date.hh"
 #include "db.hh"
 #include "event.hh"
 #include "event_utils.hh"
@@ -30,40 +31,6 @@ bool parse(const std::string& text, std::vector<std::string>* args) {
     return false;
 }
 
-bool parse_time(const std::string& value, time_t* date) {
-    struct tm _t, _tmp;
-    time_t now = time(NULL);
-    localtime_r(&now, &_t);
-    _tmp = _t;
-    auto ptr = strptime(value.c_str(), "%H:%M", &_tmp);
-    if (ptr && !*ptr) goto done;
-    _tmp = _t;
-    ptr = strptime(value.c_str(), "%A %H:%M", &_tmp);
-    if (ptr && !*ptr) {
-        // Given the weekday, figure out distance to "now"
-        int days = _tmp.tm_wday - _t.tm_wday;
-        if (days <= 0) {
-            days += 7;
-        }
-        time_t tmp = mktime(&_tmp) + days * EventUtils::ONE_DAY_IN_SEC;
-        localtime_r(&tmp, &_tmp);
-        goto done;
-    }
-    _tmp = _t;
-    ptr = strptime(value.c_str(), "%d/%m %H:%M", &_tmp);
-    if (ptr && !*ptr) goto done;
-    _tmp = _t;
-    ptr = strptime(value.c_str(), "%A %d/%m %H:%M", &_tmp);
-    if (ptr && !*ptr) goto done;
-    _tmp = _t;
-    ptr = strptime(value.c_str(), "%Y-%m-%d %H:%M", &_tmp);
-    if (ptr && !*ptr) goto done;
-    return false;
- done:
-    *date = mktime(&_tmp);
-    return true;
-}
-
 bool create(EventUtils* utils,
             std::map<std::string, std::string>& data,
             std::vector<std::string>& args) {
@@ -80,7 +47,7 @@ bool create(EventUtils* utils,
     text = args.front();
     args.erase(args.begin());
     while (true) {
-        if (parse_time(text, &start)) break;
+        if (Date::parse(text, time(NULL), &start)) break;
         if (args.empty()) {
             Http::response(200, "Couldn't figure out when to start the event, try [DAY|DATE] HH:MM");
             return true;
@@ -158,8 +125,13 @@ bool cancel(EventUtils* utils,
         }
         return true;
     }
+    std::vector<Event*> canceled;
     for (const auto& index : indexes) {
-        utils->cancel(events[index].get(), index);
+        if (index < events.size()) canceled.push_back(events[index].get());
+    }
+    if (!utils->cancel(canceled)) {
+        Http::response(200, "Unable to remove events");
+        return true;
     }
     if (indexes.size() > 1) {
         Http::response(200, "Events removed");
@@ -176,8 +148,9 @@ bool update(EventUtils* utils,
     update.insert("name");
     update.insert("start");
     update.insert("text");
+    update.insert("capacity");
     if (args.empty()) {
-        Http::response(200, "Usage: update [INDEX] [name NAME] [start START] [text TEXT]");
+        Http::response(200, "Usage: update [INDEX] [name NAME] [start START] [text TEXT] [capacity SEATS|none]");
         return true;
     }
     std::unique_ptr<Event> event;
@@ -225,12 +198,12 @@ bool update(EventUtils* utils,
                 text.push_back(' ');
                 text.append(*it);
             }
-            time_t time;
-            if (!parse_time(text, &time)) {
+            time_t start;
+            if (!Date::parse(text, time(NULL), &start)) {
                 Http::response(200, "Bad argument to start: " + text);
                 return true;
             }
-            event->set_start(time);
+            event->set_start(start);
         } else if (*it == "text") {
             if (++it == args.end()) {
                 event->set_text("");
@@ -242,8 +215,26 @@ bool update(EventUtils* utils,
                 }
                 event->set_text(text);
             }
+        } else if (*it == "capacity") {
+            if (++it == args.end()) {
+                Http::response(200, "Missing argument to capacity");
+                return true;
+            }
+            unsigned long capacity = 0;
+            if (*it != "none") {
+                char* end = nullptr;
+                errno = 0;
+                capacity = strtoul(it->c_str(), &end, 10);
+                if (errno || !end || *end || capacity == 0) {
+                    Http::response(200, "Bad argument to capacity: " + *it);
+                    return true;
+                }
+            }
+            event->set_capacity(capacity);
+            ++it;
         } else {
-            Http::response(200, "Expected name/start/text, not: " + *it);
+            Http::response(200,
+                           "Expected name/start/text/capacity, not: " + *it);
             return true;
         }
     }
@@ -256,6 +247,103 @@ bool update(EventUtils* utils,
     return true;
 }
 
+bool repeat(EventUtils* utils,
+            std::map<std::string, std::string>& data,
+            std::vector<std::string>& args) {
+    static const char kUsage[] =
+        "Usage: repeat [INDEX] weekly|daily|every DAYS [until DATE]";
+    if (args.empty()) {
+        Http::response(200, kUsage);
+        return true;
+    }
+    std::unique_ptr<Event> event;
+    auto it = args.begin();
+    if (*it != "weekly" && *it != "daily" && *it != "every") {
+        std::vector<unsigned long> indexes;
+        if (!append_indexes(args.begin(), ++it, &indexes)) {
+            return true;
+        }
+        auto events = utils->all();
+        if (!utils->good()) return true;
+        if (indexes.front() >= events.size()) {
+            std::ostringstream ss;
+            ss << "No such event: " << indexes.front() << std::endl;
+            Http::response(200, ss.str());
+            return true;
+        }
+        event.swap(events[indexes.front()]);
+    } else {
+        event = utils->next();
+        if (!utils->good()) return true;
+        if (!event) {
+            Http::response(200, "No event to repeat");
+            return true;
+        }
+    }
+    if (event->series()) {
+        Http::response(200, "Event is already repeating");
+        return true;
+    }
+    unsigned long days = 0;
+    if (it == args.end()) {
+        Http::response(200, kUsage);
+        return true;
+    } else if (*it == "weekly") {
+        days = 7;
+    } else if (*it == "daily") {
+        days = 1;
+    } else if (*it == "every" && ++it != args.end()) {
+        char* end = nullptr;
+        errno = 0;
+        days = strtoul(it->c_str(), &end, 10);
+        if (errno || !end || *end || days == 0 || days > 366) {
+            Http::response(200, "Bad number of days: " + *it);
+            return true;
+        }
+    } else {
+        Http::response(200, kUsage);
+        return true;
+    }
+    time_t until = 0;
+    if (++it != args.end()) {
+        if (*it != "until" || ++it == args.end()) {
+            Http::response(200, kUsage);
+            return true;
+        }
+        std::string text(*it);
+        for (++it; it != args.end(); ++it) {
+            text.push_back(' ');
+            text.append(*it);
+        }
+        if (!Date::parse(text, time(NULL), &until)) {
+            Http::response(200, "Bad argument to until: " + text);
+            return true;
+        }
+    }
+    // The event itself stays as it is, the repeating event starts with the
+    // occurrence after it
+    struct tm tm;
+    auto start = event->start();
+    localtime_r(&start, &tm);
+    tm.tm_mday += days;
+    tm.tm_isdst = -1;
+    auto series = utils->create(event->name(), mktime(&tm));
+    if (!utils->good()) return true;
+    if (!series) {
+        Http::response(200, "Unable to create event");
+        return true;
+    }
+    series->set_text(event->text());
+    series->set_repeat(days, until);
+    if (!series->store()) {
+        Http::response(200, "Unable to store event");
+        return true;
+    }
+    Http::response(200, "Event repeats");
+    utils->created(series.get());
+    return true;
+}
+
 bool show(EventUtils* utils,
           std::map<std::string, std::string>& data,
           std::vector<std::string>& args) {
@@ -267,9 +355,13 @@ bool show(EventUtils* utils,
             return true;
         }
     }
+    // The going lists are loaded as they are needed, from the same state as
+    // the list of events
+    EventUtils::ReadTransaction transaction(utils);
     auto events = utils->all();
     if (!utils->good()) return true;
     std::ostringstream ss;
+    Date::Formatter formatter(time(NULL));
     for (const auto& index : indexes) {
         if (indexes.size() > 1) {
             ss << '(' << index << ") ";
@@ -282,25 +374,38 @@ bool show(EventUtils* utils,
             }
         } else {
             ss << events[index]->name() << " @ "
-               << EventUtils::format_date(events[index]->start()) << std::endl;
+               << formatter.format(events[index]->start()) << std::endl;
             const auto& text = events[index]->text();
             if (!text.empty()) {
                 ss << text << std::endl;
             }
             std::vector<Event::Going> going;
             events[index]->going(&going);
+            if (events[index]->capacity()) {
+                ss << events[index]->going_count() << " of "
+                   << events[index]->capacity() << " seats taken"
+                   << std::endl;
+            }
             auto it = going.begin();
             for (; it != going.end(); ++it) {
-                if (!it->is_going) break;
-                ss << it->name;
+                if (!it->is_going || it->waiting) break;
+                ss << it->name();
                 if (!it->note.empty()) {
                     ss << ": " << it->note;
                 }
                 ss << std::endl;
             }
             if (it != going.end()) ss << std::endl;
+            for (unsigned int number = 1;
+                 it != going.end() && it->waiting; ++it, ++number) {
+                ss << it->name() << ": waitlist #" << number;
+                if (!it->note.empty()) {
+                    ss << ", " << it->note;
+                }
+                ss << std::endl;
+            }
             for (; it != going.end(); ++it) {
-                ss << it->name << ": not going";
+                ss << it->name() << ": not going";
                 if (!it->note.empty()) {
                     ss << ", " << it->note;
                 }
@@ -312,6 +417,80 @@ bool show(EventUtils* utils,
     return true;
 }
 
+bool find(EventUtils* utils,
+          std::map<std::string, std::string>& data,
+          std::vector<std::string>& args) {
+    static const size_t kFindLimit = 10;
+    if (args.empty()) {
+        Http::response(200, "Usage: find WORDS...");
+        return true;
+    }
+    std::string text;
+    for (const auto& arg : args) {
+        if (!text.empty()) text.push_back(' ');
+        text.append(arg);
+    }
+    auto events = utils->find(text, kFindLimit);
+    if (!utils->good()) return true;
+    if (events.empty()) {
+        Http::response(200, "No events found");
+        return true;
+    }
+    std::ostringstream ss;
+    auto const now = time(NULL);
+    Date::Formatter formatter(now);
+    for (const auto& event : events) {
+        ss << event->name() << " @ " << formatter.format(event->start());
+        if (event->repeat_days()) {
+            ss << " (every " << event->repeat_days() << " days)";
+        } else if (event->start() < now) {
+            ss << " (past)";
+        }
+        ss << std::endl;
+    }
+    Http::response(200, ss.str());
+    return true;
+}
+
+bool stats(EventUtils* utils,
+           std::map<std::string, std::string>& data,
+           std::vector<std::string>& args) {
+    size_t events;
+    std::vector<Event::UserStats> users;
+    if (!utils->stats(&events, &users)) {
+        if (utils->good()) Http::response(200, "Unable to read statistics");
+        return true;
+    }
+    if (events == 0) {
+        Http::response(200, "There have been no events");
+        return true;
+    }
+    std::sort(users.begin(), users.end(),
+              [](const Event::UserStats& u1, const Event::UserStats& u2) {
+                  if (u1.going != u2.going) return u1.going > u2.going;
+                  return u1.name < u2.name;
+              });
+    size_t going = 0;
+    for (const auto& user : users) going += user.going;
+    // In tenths
+    auto const average = (going * 10 + events / 2) / events;
+    std::ostringstream ss;
+    ss << events << " events, on average " << average / 10 << '.'
+       << average % 10 << " going" << std::endl;
+    for (const auto& user : users) {
+        auto const answered = user.going + user.waiting + user.not_going;
+        ss << user.name << ": going " << user.going << " ("
+           << (user.going * 100 + events / 2) / events << "%)";
+        if (user.waiting) {
+            ss << ", waitlist " << user.waiting;
+        }
+        ss << ", not going " << user.not_going << ", no answer "
+           << (answered < events ? events - answered : 0) << std::endl;
+    }
+    Http::response(200, ss.str());
+    return true;
+}
+
 bool going(EventUtils* utils,
            std::map<std::string, std::string>& data,
            std::vector<std::string>& args,
@@ -332,53 +511,64 @@ bool going(EventUtils* utils,
         user = args[1];
         args.erase(args.begin(), args.begin() + 2);
     }
-    if (args.empty()) {
-        event = utils->next();
-        if (!utils->good()) return true;
-    } else {
-        if (args.size() == 1) {
-            char* end = nullptr;
-            errno = 0;
-            auto tmp = strtoul(args.front().c_str(), &end, 10);
-            if (errno == 0 && end && !*end) {
-                indexes.push_back(tmp);
-            }
+    {
+        // The index is resolved against one state of the channel, the
+        // event is stored after
+        EventUtils::ReadTransaction transaction(utils);
+        if (args.empty()) {
+            event = utils->next();
+            if (!utils->good()) return true;
+        } else {
+            if (args.size() == 1) {
+                char* end = nullptr;
+                errno = 0;
+                auto tmp = strtoul(args.front().c_str(), &end, 10);
+                if (errno == 0 && end && !*end) {
+                    indexes.push_back(tmp);
+                }
 
-            if (indexes.empty()) {
-                event = utils->next();
-                if (!utils->good()) return true;
-                note = args.front();
+                if (indexes.empty()) {
+                    event = utils->next();
+                    if (!utils->good()) return true;
+                    note = args.front();
+                }
+            } else {
+                auto it = args.begin() + 1;
+                if (!append_indexes(args.begin(), it, &indexes)) {
+                    return true;
+                }
+                note = *it;
+                for (++it; it != args.end(); ++it) {
+                    note.push_back(' ');
+                    note.append(*it);
+                }
             }
-        } else {
-            auto it = args.begin() + 1;
-            if (!append_indexes(args.begin(), it, &indexes)) {
+        }
+        if (!event) {
+            auto events = utils->all();
+            if (!utils->good()) return true;
+            if (events.empty()) {
+                Http::response(200, "There are no events to attend");
                 return true;
             }
-            note = *it;
-            for (++it; it != args.end(); ++it) {
-                note.push_back(' ');
-                note.append(*it);
+            if (indexes.front() >= events.size()) {
+                std::ostringstream ss;
+                ss << "There are no such event to attend: " << indexes.front();
+                Http::response(200, ss.str());
+                return true;
             }
+            event.swap(events[indexes.front()]);
         }
     }
-    if (!event) {
-        auto events = utils->all();
-        if (!utils->good()) return true;
-        if (events.empty()) {
-            Http::response(200, "There are no events to attend");
-            return true;
-        }
-        if (indexes.front() >= events.size()) {
-            std::ostringstream ss;
-            ss << "There are no such event to attend: " << indexes.front();
-            Http::response(200, ss.str());
-            return true;
-        }
-        event.swap(events[indexes.front()]);
-    }
     event->update_going(user, going, note);
     if (event->store()) {
-        Http::response(200, "Your wish have been recorded, if not granted");
+        Event::Going entry("", false, "", 0);
+        if (going && event->find_going(user, &entry) && entry.waiting) {
+            Http::response(200, "The event is full, you are on the waitlist");
+        } else {
+            Http::response(200,
+                           "Your wish have been recorded, if not granted");
+        }
         utils->going(event.get(), going, user, user_name);
     } else {
         Http::response(200, "Event store failed");
@@ -390,7 +580,7 @@ bool help(std::vector<std::string>& args) {
     std::ostringstream ss;
     if (args.empty()) {
         ss << "Usage: help COMMAND" << std::endl;
-        ss << "Known commands: create, update, cancel, show, going, !going, join, part";
+        ss << "Known commands: create, update, repeat, cancel, show, find, stats, going, !going, join, part";
     } else if (args.front() == "create") {
         ss << "Usage: create NAME START [TEXT]" << std::endl;
         ss << "Create a new event with the name NAME starting at START with"
@@ -398,10 +588,21 @@ bool help(std::vector<std::string>& args) {
         ss << "START can be of the format: [DATE|DAY] HH:MM";
     } else if (args.front() == "update") {
         ss << "Usage: update [INDEX] [name NAME] [start START] [text TEXT]"
-           << std::endl;
+           << " [capacity SEATS|none]" << std::endl;
         ss << "Update an event, specified by index (default is next event)"
            << std::endl;
-        ss << "See help for create for description of NAME, START and TEXT.";
+        ss << "See help for create for description of NAME, START and TEXT."
+           << std::endl;
+        ss << "With a capacity at most SEATS can join, the rest end up on a"
+           << " waitlist and get a seat when someone parts.";
+    } else if (args.front() == "repeat") {
+        ss << "Usage: repeat [INDEX] weekly|daily|every DAYS [until DATE]"
+           << std::endl;
+        ss << "Repeat an event, specified by index (default is next event),"
+           << " every DAYS days at the same time, optionally until DATE"
+           << std::endl;
+        ss << "Updating an occurrence only changes that one, canceling"
+           << " one cancels all of them.";
     } else if (args.front() == "cancel") {
         ss << "Usage: cancel [INDEX...]" << std::endl;
         ss << "Cancel one or more events given by index"
@@ -410,12 +611,22 @@ bool help(std::vector<std::string>& args) {
         ss << "Usage: show [INDEX...]" << std::endl;
         ss << "Show one or more events given by index"
            << " (default is next event)";
+    } else if (args.front() == "find") {
+        ss << "Usage: find WORDS..." << std::endl;
+        ss << "Find events, also past ones, with all WORDS in their name"
+           << " or description";
+    } else if (args.front() == "stats") {
+        ss << "Usage: stats" << std::endl;
+        ss << "Show how many events each user has been going to, not"
+           << " going to or not answered, and how many go on average";
     } else if (args.front() == "going" || args.front() == "join") {
         ss << "Usage: going [user USER] [INDEX] [NOTE]" << std::endl;
         ss << "Join an event specified by index (default is next event)"
            << " and add an optional NOTE" << std::endl;
         ss << "If USER is specified, you're saying that USER is joining"
            << " instead of yourself - use with caution" << std::endl;
+        ss << "If the event is full you are put on the waitlist"
+           << std::endl;
         ss << "join is an alias for going";
     } else if (args.front() == "!going" || args.front() == "part") {
         ss << "Usage: !going [user USER] [INDEX] [NOTE]" << std::endl;
@@ -480,9 +691,18 @@ bool handle_request(CGI* cgi) {
     if (command == "update") {
         return update(utils.get(), data, args);
     }
+    if (command == "repeat") {
+        return repeat(utils.get(), data, args);
+    }
     if (command == "show") {
         return show(utils.get(), data, args);
     }
+    if (command == "find") {
+        return find(utils.get(), data, args);
+    }
+    if (command == "stats") {
+        return stats(utils.get(), data, args);
+    }
     if (command == "going" || command == "join") {
         return going(utils.get(), data, args, true);
     }
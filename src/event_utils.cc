@@ -1,11 +1,17 @@
 #include "common.hh"
 
+#include <algorithm>
+#include <map>
+#include <set>
 #include <sstream>
+#include <unistd.h>
 
 #include "config.hh"
+#include "date.hh"
 #include "event.hh"
 #include "event_utils.hh"
 #include "fsutils.hh"
+#include "log_db.hh"
 #include "sender_client.hh"
 #include "sqlite3_db.hh"
 
@@ -13,13 +19,186 @@ namespace stuff {
 
 namespace {
 
+// Defaults for the db_* config values, see Connections
+const long kMemoryLimit = 16 * 1024 * 1024;
+const long kMaxConnections = 8;
+const long kIdleRelease = 60;
+
+// How long before an event starts the sender reminds the channel
+const time_t kReminderLead = 15 * 60;
+
+// Database connections are kept open between requests, in FastCGI mode the
+// same process handles requests for days. To keep memory use flat no matter
+// which channels have been used, SQLite has a process wide soft limit
+// (db_memory_limit bytes) that is split between the open connections as page
+// cache, at most db_max_connections are kept open and connections that
+// haven't been used for db_idle_release seconds release their caches.
+// Each connection also caches the list of upcoming events, it's reloaded
+// when DB::version() changes or when Event::all() would return something
+// else, because the first event has started or another occurrence of a
+// repeating event is due.
+class Connections {
+public:
+    Connections()
+        : limit_(-1) {
+    }
+
+    std::shared_ptr<DB> get(const std::string& path) {
+        auto it = connections_.find(path);
+        if (it == connections_.end()) return nullptr;
+        if (it->second.db->bad()) {
+            connections_.erase(it);
+            scale();
+            return nullptr;
+        }
+        it->second.last_used = time(NULL);
+        it->second.released = false;
+        return it->second.db;
+    }
+
+    void add(const std::string& path, std::shared_ptr<DB> db,
+             const Config* cfg) {
+        configure(cfg);
+        auto& entry = connections_[path];
+        entry.db = db;
+        entry.last_used = time(NULL);
+        entry.released = false;
+        entry.version = -1;
+        entry.valid_until = 0;
+        entry.events.clear();
+        while (connections_.size() > static_cast<size_t>(max_)) {
+            auto oldest = connections_.begin();
+            for (auto it = connections_.begin(); it != connections_.end();
+                 ++it) {
+                if (it->second.last_used < oldest->second.last_used) {
+                    oldest = it;
+                }
+            }
+            connections_.erase(oldest);
+        }
+        scale();
+    }
+
+    // Returns the upcoming events for the connection at path, same as
+    // Event::all(). Returns nullptr if path isn't open
+    const std::vector<std::unique_ptr<Event>>* events(
+            const std::string& path) {
+        auto it = connections_.find(path);
+        if (it == connections_.end()) return nullptr;
+        auto& entry = it->second;
+        // Read the version first so that a change while loading is noticed
+        // the next time
+        auto const version = entry.db->version();
+        if (version < 0) return nullptr;
+        if (version != entry.version || time(NULL) > entry.valid_until) {
+            entry.events = Event::all(entry.db, &entry.valid_until);
+            entry.version = version;
+        }
+        return &entry.events;
+    }
+
+    // Called when a request is done with its connection
+    void trim() {
+        auto const now = time(NULL);
+        for (auto& pair : connections_) {
+            auto& entry = pair.second;
+            if (!entry.released && now - entry.last_used >= idle_) {
+                entry.db->release_memory();
+                entry.released = true;
+            }
+        }
+    }
+
+    bool stats(DB::Stats* stats) const {
+        stats->cache_bytes = 0;
+        stats->other_bytes = 0;
+        for (const auto& pair : connections_) {
+            DB::Stats tmp;
+            if (!pair.second.db->stats(&tmp)) return false;
+            stats->cache_bytes += tmp.cache_bytes;
+            stats->other_bytes += tmp.other_bytes;
+        }
+        return true;
+    }
+
+    static Connections* instance() {
+        static Connections connections;
+        return &connections;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<DB> db;
+        time_t last_used;
+        bool released;
+        int64_t version;
+        // Last time events is the same as Event::all() without changes
+        time_t valid_until;
+        std::vector<std::unique_ptr<Event>> events;
+    };
+
+    void configure(const Config* cfg) {
+        auto limit = cfg ? cfg->get_long("db_memory_limit", kMemoryLimit)
+            : kMemoryLimit;
+        max_ = cfg ? cfg->get_long("db_max_connections", kMaxConnections)
+            : kMaxConnections;
+        if (max_ < 1) max_ = 1;
+        idle_ = cfg ? cfg->get_long("db_idle_release", kIdleRelease)
+            : kIdleRelease;
+        if (limit != limit_) {
+            limit_ = limit;
+            SQLite3::set_memory_limit(limit_ > 0 ? limit_ : 0);
+        }
+    }
+
+    // Give each connection an equal share of half the limit as cache, the
+    // rest is for schemas, statements and everything else
+    void scale() {
+        if (connections_.empty()) return;
+        int64_t cache = 0;
+        if (limit_ > 0) cache = limit_ / 2 / connections_.size();
+        for (auto& pair : connections_) {
+            pair.second.db->set_cache_size(cache);
+        }
+    }
+
+    std::map<std::string, Entry> connections_;
+    long limit_;
+    long max_;
+    long idle_;
+};
+
+// Database file for channel, log is set if it's a LogDB
+std::string db_file(const Config* cfg, const std::string& channel,
+                    bool* log) {
+    std::string tmp = channel;
+    for (auto it = tmp.begin(); it != tmp.end(); ++it) {
+        if (!((*it >= 'a' && *it <= 'z') ||
+              (*it >= 'A' && *it <= 'Z') ||
+              (*it >= '0' && *it <= '9') ||
+              *it == '-' || *it == '_' || *it == '.')) {
+            *it = '.';
+        }
+    }
+    *log = cfg && cfg->get("db_backend", "sqlite3") == "log";
+    return EventUtils::db_path(cfg) + "/" + tmp + (*log ? ".log" : ".db");
+}
+
 class EventUtilsImpl : public EventUtils {
 public:
     EventUtilsImpl(const std::string& channel,
                    std::function<void(const std::string&)> error_cb,
                    Config* config, SenderClient* sender)
         : channel_(channel), error_cb_(error_cb), cfg_(config),
-          sender_(sender) {
+          sender_(sender), failed_(false), view_loaded_(false) {
+    }
+
+    ~EventUtilsImpl() override {
+        view_.clear();
+        if (db_) {
+            db_.reset();
+            Connections::instance()->trim();
+        }
     }
 
     std::unique_ptr<Event> create(
@@ -30,39 +209,94 @@ public:
 
     void created(Event* event) override {
         if (!event) return;
-        auto next_event = Event::next(db_);
-        if (next_event->id() == event->id()) {
-            signal_event(next_event);
+        remind(event);
+        if (!apply(event)) return;
+        if (!view_.empty() && (view_.front()->id() == event->id() ||
+                               view_.front()->series() == event->id())) {
+            signal_event(view_.front());
         }
     }
 
     std::vector<std::unique_ptr<Event>> all() override {
-        if (!db_ && !open()) return std::vector<std::unique_ptr<Event>>();
-        return Event::all(db_);
+        std::vector<std::unique_ptr<Event>> ret;
+        if (!load_view()) return ret;
+        ret.reserve(view_.size());
+        for (const auto& event : view_) {
+            ret.push_back(event->clone());
+        }
+        return ret;
     }
 
     std::unique_ptr<Event> next() override {
-        if (!db_ && !open()) return nullptr;
-        return Event::next(db_);
+        if (!load_view() || view_.empty()) return nullptr;
+        return view_.front()->clone();
+    }
+
+    std::vector<std::unique_ptr<Event>> between(time_t from,
+                                                time_t to) override {
+        if (!db_ && !open()) return std::vector<std::unique_ptr<Event>>();
+        return Event::between(db_, from, to);
+    }
+
+    std::vector<std::unique_ptr<Event>> find(const std::string& text,
+                                             size_t limit) override {
+        if (!db_ && !open()) return std::vector<std::unique_ptr<Event>>();
+        return Event::find(db_, text, limit);
+    }
+
+    bool stats(size_t* events,
+               std::vector<Event::UserStats>* users) override {
+        if (!db_ && !open()) return false;
+        return Event::stats(db_.get(), events, users);
     }
 
     bool good() const override {
         return db_.get() != nullptr;
     }
 
-    void cancel(Event* event, size_t index) override {
-        if (!event) return;
-        event->remove();
-        if (index == 0) {
+    bool cancel(const std::vector<Event*>& events) override {
+        if (events.empty()) return true;
+        if (!db_ && !open()) return false;
+        std::set<int64_t> ids, series;
+        for (auto event : events) {
+            ids.insert(event->id());
+            if (event->series()) series.insert(event->series());
+        }
+        std::unique_ptr<Event> first;
+        if (load_view() && !view_.empty() &&
+            (ids.count(view_.front()->id()) ||
+             series.count(view_.front()->series()))) {
+            first = view_.front()->clone();
+        }
+        if (!Event::remove(db_.get(), events)) return false;
+        if (sender_) {
+            for (auto id : ids) {
+                if (id > 0) sender_->forget(channel_, id);
+            }
+            for (auto id : series) sender_->forget(channel_, id);
+        }
+        if (load_view()) {
+            // Canceling an occurrence cancels all of them
+            view_.erase(std::remove_if(view_.begin(), view_.end(),
+                                       [&](const std::unique_ptr<Event>& e) {
+                                           return ids.count(e->id()) ||
+                                               series.count(e->series());
+                                       }),
+                        view_.end());
+        }
+        if (first) {
             std::ostringstream ss;
-            ss << "Event canceled: " << event->name() << " @ "
-               << format_date(event->start());
+            ss << "Event canceled: " << first->name() << " @ "
+               << format_date(first->start());
             signal_channel(ss.str());
         }
+        return true;
     }
 
     void updated(Event* event, int64_t was_first) override {
-        auto next_event = Event::next(db_);
+        remind(event);
+        if (!apply(event) || view_.empty()) return;
+        auto const& next_event = view_.front();
         if (next_event->id() != was_first ||
             next_event->id() == event->id()) {
             signal_event(next_event);
@@ -71,13 +305,18 @@ public:
 
     void going(Event* event, bool going, const std::string& user,
                const std::string& owner) override {
-        auto next_event = Event::next(db_);
-        if (next_event->id() == event->id()) {
+        if (!apply(event)) return;
+        if (!view_.empty() && view_.front()->id() == event->id()) {
             std::string extra;
             if (user != owner) {
                 extra = " says " + owner;
             }
-            if (going) {
+            Event::Going entry("", false, "", 0);
+            if (going && event->capacity() &&
+                event->find_going(user, &entry) && entry.waiting) {
+                signal_channel(user + " is on the waitlist for " +
+                               event->name() + extra);
+            } else if (going) {
                 signal_channel(user + " will be attending " +
                                event->name() + extra);
             } else {
@@ -91,18 +330,99 @@ public:
         return channel_;
     }
 
+protected:
+    bool start_read() override {
+        if (!db_ && !open()) return false;
+        return db_->start_transaction();
+    }
+
+    void end_read() override {
+        if (!db_->commit_transaction()) db_->rollback_transaction();
+    }
+
 private:
+    // Load the upcoming events as this request sees them, the same list
+    // Event::all() returns
+    bool load_view() {
+        if (view_loaded_) return true;
+        if (!db_ && !open()) return false;
+        auto events = Connections::instance()->events(file_);
+        if (events) {
+            view_.clear();
+            view_.reserve(events->size());
+            for (const auto& event : *events) {
+                view_.push_back(event->clone());
+            }
+        } else {
+            view_ = Event::all(db_);
+        }
+        view_loaded_ = true;
+        return true;
+    }
+
+    // Update the view with an event this request has stored, so that the
+    // checks after a change don't need to load the events again
+    bool apply(Event* event) {
+        if (event->repeat_days()) {
+            // Let Event::all() expand the occurrences
+            view_loaded_ = false;
+            return load_view();
+        }
+        if (!load_view()) return false;
+        for (auto it = view_.begin(); it != view_.end(); ++it) {
+            if ((*it)->id() == event->id()) {
+                view_.erase(it);
+                break;
+            }
+        }
+        // Same order as Event::all()
+        if (event->start() >= time(NULL)) {
+            auto it = view_.begin();
+            while (it != view_.end() &&
+                   ((*it)->start() < event->start() ||
+                    ((*it)->start() == event->start() &&
+                     (*it)->name() <= event->name()))) {
+                ++it;
+            }
+            view_.insert(it, event->clone());
+        }
+        return true;
+    }
+
     void signal_event(const std::unique_ptr<Event>& event) {
         std::ostringstream ss;
         ss << event->name() << " @ " << format_date(event->start()) << std::endl;
         if (!event->text().empty()) {
             ss << event->text() << std::endl;
         }
+        if (event->going_count() > 0 || event->not_going_count() > 0) {
+            ss << event->going_count() << " going, "
+               << event->not_going_count() << " not going" << std::endl;
+        }
         ss << std::endl;
         ss << "Use /event going to join the event" << std::endl;
         signal_channel(ss.str());
     }
 
+    // Have the sender remind the channel before the event starts. A
+    // repeating event has one reminder that follows the occurrences, so
+    // occurrences are left alone
+    void remind(const Event* event) {
+        if (!sender_ || event->series()) return;
+        auto const at = event->start() - kReminderLead;
+        if (!event->repeat_days() && at <= time(NULL)) {
+            sender_->forget(channel_, event->id());
+            return;
+        }
+        std::ostringstream ss;
+        ss << event->name() << " starts in " << kReminderLead / 60
+           << " minutes";
+        sender_->remind(channel_, event->id(), at, event->repeat_days(),
+                        event->repeat_until()
+                        ? event->repeat_until() - kReminderLead : 0,
+                        ss.str());
+    }
+
     void signal_channel(const std::string& str) {
         if (!sender_) return;
         sender_->send(channel_, str);
@@ -115,39 +435,52 @@ private:
     }
 
     bool open() {
-        std::string tmp = channel_;
-        for (auto it = tmp.begin(); it != tmp.end(); ++it) {
-            if (!((*it >= 'a' && *it <= 'z') ||
-                  (*it >= 'A' && *it <= 'Z') ||
-                  (*it >= '0' && *it <= '9') ||
-                  *it == '-' || *it == '_' || *it == '.')) {
-                *it = '.';
-            }
-        }
-        std::string path;
-        if (cfg_) path = cfg_->get("db_path", LOCALSTATEDIR);
-        if (path.empty()) path = ".";
-        if (!mkdir_p(path)) {
+        // Only report the error once
+        if (failed_) return false;
+        failed_ = true;
+        if (!mkdir_p(db_path(cfg_))) {
             error("Unable to create database directory");
             return false;
         }
-        auto db = SQLite3::open(path + "/" + tmp + ".db");
+        auto connections = Connections::instance();
+        bool log;
+        auto const file = db_file(cfg_, channel_, &log);
+        auto db = connections->get(file);
+        bool const reused = db != nullptr;
+        if (!reused) {
+            if (log) {
+                db = LogDB::open(file);
+            } else {
+                db = SQLite3::open(file);
+            }
+        }
         if (!db || db->bad()) {
             error("Unable to open database");
             return false;
-        } else if (!Event::setup(db.get())) {
-            error("Unable to setup database");
-            return false;
+        } else if (!reused) {
+            if (!Event::setup(db.get())) {
+                error("Unable to setup database");
+                return false;
+            }
+            connections->add(file, db, cfg_);
         }
-        db_ = std::move(db);
+        db_ = db;
+        file_ = file;
+        failed_ = false;
         return true;
     }
 
     std::string channel_;
     std::function<void(const std::string&)> error_cb_;
     std::shared_ptr<DB> db_;
+    // Key for db_ in Connections
+    std::string file_;
     Config* cfg_;
     SenderClient* sender_;
+    bool failed_;
+    // Upcoming events including the changes done by this request
+    std::vector<std::unique_ptr<Event>> view_;
+    bool view_loaded_;
 };
 
 }  // namespace
@@ -173,25 +506,65 @@ const double EventUtils::ONE_WEEK_IN_SEC = ONE_DAY_IN_SEC * 7.0;
 // It's OK that we ignore leap years here
 const double EventUtils::ONE_YEAR_IN_SEC = 365 * ONE_DAY_IN_SEC;
 
-std::string EventUtils::format_date(time_t date) {
-    time_t now = time(NULL);
-    struct tm _t;
-    struct tm* t = localtime_r(&date, &_t);
-    double diff = difftime(date, now);
-    char tmp[100];
-    if (diff <= ONE_DAY_IN_SEC) {
-        // Same day, just show time
-        strftime(tmp, sizeof(tmp), "%H:%M", t);
-    } else if (diff <= ONE_WEEK_IN_SEC) {
-        // Inside a week, show day and time
-        strftime(tmp, sizeof(tmp), "%A %H:%M", t);
-    } else if (diff <= ONE_YEAR_IN_SEC / 2.0) {
-        // Inside a year, show date, day and time
-        strftime(tmp, sizeof(tmp), "%A %d/%m %H:%M", t);
+bool EventUtils::db_stats(DB::Stats* stats) {
+    return Connections::instance()->stats(stats);
+}
+
+std::shared_ptr<DB> EventUtils::open_db(const std::string& channel,
+                                        const Config* config) {
+    if (!mkdir_p(db_path(config))) return nullptr;
+    bool log;
+    auto const file = db_file(config, channel, &log);
+    std::shared_ptr<DB> db;
+    if (log) {
+        db = LogDB::open(file);
     } else {
-        strftime(tmp, sizeof(tmp), "%Y-%m-%d %H:%M", t);
+        db = SQLite3::open(file);
     }
-    return tmp;
+    if (!db || db->bad() || !Event::setup(db.get())) return nullptr;
+    return db;
+}
+
+std::shared_ptr<DB> EventUtils::open_db_to_read(const std::string& channel,
+                                                const Config* config) {
+    bool log;
+    auto const file = db_file(config, channel, &log);
+    if (access(file.c_str(), F_OK)) return nullptr;
+    std::shared_ptr<DB> db;
+    if (log) {
+        db = LogDB::open(file);
+    } else {
+        db = SQLite3::open(file);
+    }
+    if (!db || db->bad() || !Event::is_setup(db.get())) return nullptr;
+    return db;
+}
+
+bool EventUtils::headers(const std::string& channel, const Config* config,
+                         size_t limit, std::vector<Event::Header>* headers) {
+    bool log;
+    auto const file = db_file(config, channel, &log);
+    // Nothing to read if the channel has never been used
+    if (access(file.c_str(), F_OK)) {
+        headers->clear();
+        return true;
+    }
+    auto db = open_db_to_read(channel, config);
+    if (!db) return false;
+    DB::ReadTransaction transaction(db);
+    *headers = Event::headers(db, limit);
+    return !db->bad();
+}
+
+std::string EventUtils::db_path(const Config* config) {
+    std::string path;
+    if (config) path = config->get("db_path", LOCALSTATEDIR);
+    if (path.empty()) path = ".";
+    return path;
+}
+
+std::string EventUtils::format_date(time_t date) {
+    return Date::Formatter(time(NULL)).format(date);
 }
 
 }  // namespace stuff
@@ -5,14 +5,34 @@
 #include <memory>
 #include <string>
 
+#include "db.hh"
+#include "event.hh"
+
 namespace stuff {
 
 class Config;
-class Event;
 class SenderClient;
 
 class EventUtils {
 public:
+    // All reads done through EventUtils while a ReadTransaction is alive see
+    // the same state of the channel. Don't modify events inside one.
+    class ReadTransaction {
+    public:
+        explicit ReadTransaction(EventUtils* utils)
+            : utils_(utils), good_(utils->start_read()) {
+        }
+        ~ReadTransaction() {
+            if (good_) utils_->end_read();
+        }
+    private:
+        ReadTransaction(const ReadTransaction&) = delete;
+        ReadTransaction& operator=(const ReadTransaction&) = delete;
+
+        EventUtils* const utils_;
+        bool const good_;
+    };
+
     virtual ~EventUtils();
 
     virtual std::unique_ptr<Event> create(
@@ -22,9 +42,24 @@ public:
     virtual std::vector<std::unique_ptr<Event>> all() = 0;
     virtual std::unique_ptr<Event> next() = 0;
 
+    // Events starting from from to to, see Event::between()
+    virtual std::vector<std::unique_ptr<Event>> between(time_t from,
+                                                        time_t to) = 0;
+
+    // Events, also past ones, with all words in text. Best match first
+    virtual std::vector<std::unique_ptr<Event>> find(const std::string& text,
+                                                     size_t limit) = 0;
+
+    // Attendance in the channel, see Event::stats().
+    // Returns false in case of error
+    virtual bool stats(size_t* events,
+                       std::vector<Event::UserStats>* users) = 0;
+
     virtual bool good() const = 0;
 
-    virtual void cancel(Event* event, size_t index) = 0;
+    // Remove the events in one transaction and tell the channel if the next
+    // event was one of them. Returns false in case of error
+    virtual bool cancel(const std::vector<Event*>& events) = 0;
 
     virtual void updated(Event* event, int64_t was_first) = 0;
 
@@ -43,11 +78,42 @@ public:
     static const double ONE_WEEK_IN_SEC;
     static const double ONE_YEAR_IN_SEC;
 
+    // Format one date relative to now, use a Date::Formatter for many
     static std::string format_date(time_t date);
 
+    // Directory containing the channel databases
+    static std::string db_path(const Config* config);
+
+    // Open and setup the database for channel, creating it if needed.
+    // The connection is not one of the ones kept between requests, so it's
+    // safe to use from any thread. Returns nullptr in case of error
+    static std::shared_ptr<DB> open_db(const std::string& channel,
+                                       const Config* config);
+
+    // Open the existing database for channel only to read it, without
+    // Event::setup(). Like open_db() it's safe to use from any thread.
+    // Returns nullptr if it's missing, not set up by this version or in case
+    // of error
+    static std::shared_ptr<DB> open_db_to_read(const std::string& channel,
+                                               const Config* config);
+
+    // The first limit upcoming events in channel, see Event::headers().
+    // Uses open_db_to_read(), so it's safe to call from any thread.
+    // Returns false in case of error, or if the database needs a setup that
+    // only a request to the channel does
+    static bool headers(const std::string& channel, const Config* config,
+                        size_t limit, std::vector<Event::Header>* headers);
+
+    // Memory used by the database connections kept open by this process.
+    // Returns false in case of error
+    static bool db_stats(DB::Stats* stats);
+
 protected:
     EventUtils();
 
+    virtual bool start_read() = 0;
+    virtual void end_read() = 0;
+
 private:
     EventUtils(const EventUtils&) = delete;
     EventUtils& operator=(const EventUtils&) = delete;
@@ -0,0 +1,40 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "config.hh"
+#include "db.hh"
+#include "event.hh"
+#include "event_utils.hh"
+
+using namespace stuff;
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: `export-events CHANNEL [CONFIG]`" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto cfg = Config::create();
+    if (argc == 3) {
+        if (!cfg->load(argv[2])) {
+            std::cerr << "Error loading config: " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!cfg->load("./event.config")) {
+        cfg->load(SYSCONFDIR "/event.config");
+    }
+    auto db = EventUtils::open_db(argv[1], cfg.get());
+    if (!db) {
+        std::cerr << argv[1] << ": Unable to open database" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // Rows are written as they are read, only buffered by the stream
+    std::ios::sync_with_stdio(false);
+    if (!Event::dump(db.get(), &std::cout) || !std::cout.flush()) {
+        std::cerr << argv[1] << ": Export failed: " << db->last_error()
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
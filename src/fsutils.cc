@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <cerrno>
 #include <cstring>
+#include <dirent.h>
 #include <libgen.h>
 
 #include "fsutils.hh"
@@ -31,4 +32,20 @@ bool mkdir_p(const std::string& path) {
     return true;
 }
 
+bool list_dir(const std::string& path, std::vector<std::string>* out) {
+    auto dir = opendir(path.c_str());
+    if (!dir) return false;
+    while (true) {
+        errno = 0;
+        auto entry = readdir(dir);
+        if (!entry) break;
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) continue;
+        out->push_back(entry->d_name);
+    }
+    bool const ok = errno == 0;
+    closedir(dir);
+    return ok;
+}
+
 }  // namespace
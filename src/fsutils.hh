@@ -2,6 +2,7 @@
 #define FSUTILS_HH
 
 #include <string>
+#include <vector>
 
 namespace stuff {
 
@@ -9,6 +10,10 @@ bool isdir(const std::string& path);
 
 bool mkdir_p(const std::string& path);
 
+// Append the names of all entries in path, except . and .., to out.
+// Returns false in case of error
+bool list_dir(const std::string& path, std::vector<std::string>* out);
+
 }  // namespace stuff
 
 #endif /* FSUTILS_HH */
@@ -0,0 +1,45 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "config.hh"
+#include "db.hh"
+#include "event.hh"
+#include "event_utils.hh"
+
+using namespace stuff;
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: `import-events CHANNEL [CONFIG]`" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto cfg = Config::create();
+    if (argc == 3) {
+        if (!cfg->load(argv[2])) {
+            std::cerr << "Error loading config: " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!cfg->load("./event.config")) {
+        cfg->load(SYSCONFDIR "/event.config");
+    }
+    // Rows per transaction, memory use doesn't grow with the input
+    auto const batch = cfg->get_long("import_batch", 10000);
+    if (batch <= 0) {
+        std::cerr << "import_batch must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto db = EventUtils::open_db(argv[1], cfg.get());
+    if (!db) {
+        std::cerr << argv[1] << ": Unable to open database" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ios::sync_with_stdio(false);
+    std::string error;
+    if (!Event::restore(db.get(), &std::cin, batch, &error)) {
+        std::cerr << argv[1] << ": Import failed: " << error << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,8 @@
 #include "common.hh"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <unordered_map>
 #include <vector>
@@ -331,6 +334,15 @@ std::ostream& quoted(std::ostream& os, const std::string& str) {
             }
             last = i + 1;
             break;
+        default:
+            // Other control characters aren't allowed as is either
+            if (static_cast<unsigned char>(str[i]) < 0x20) {
+                static const char kHex[] = "0123456789abcdef";
+                os << str.substr(last, i - last) << "\\u00"
+                   << kHex[str[i] >> 4] << kHex[str[i] & 0xf];
+                last = i + 1;
+            }
+            break;
         }
     }
     os << str.substr(last);
@@ -394,6 +406,271 @@ std::ostream& write(std::ostream& os, const JsonValue* value) {
     return os << "null";
 }
 
+// Recursive descent parser for RFC 8259 JSON. Numbers without fraction or
+// exponent that fit are INT64, the rest DOUBLE
+class Parser {
+public:
+    explicit Parser(const std::string& str)
+        : str_(str), pos_(0), depth_(0) {
+    }
+
+    std::shared_ptr<JsonObject> parse() {
+        skip_space();
+        if (!consume('{')) return nullptr;
+        auto obj = std::make_shared<JsonObjectImpl>();
+        if (!object(obj.get())) return nullptr;
+        skip_space();
+        if (pos_ != str_.size()) return nullptr;
+        return obj;
+    }
+
+private:
+    // Deeper than this is most likely an attack on the stack
+    static const unsigned int kMaxDepth = 64;
+
+    // After the '{'
+    bool object(JsonObjectImpl* obj) {
+        if (++depth_ > kMaxDepth) return false;
+        skip_space();
+        if (!consume('}')) {
+            while (true) {
+                std::string name;
+                skip_space();
+                if (!consume('"') || !string(&name)) return false;
+                skip_space();
+                if (!consume(':')) return false;
+                JsonValue* ptr;
+                if (!value(&ptr)) return false;
+                obj->store(name, ptr);
+                skip_space();
+                if (consume('}')) break;
+                if (!consume(',')) return false;
+            }
+        }
+        depth_--;
+        return true;
+    }
+
+    // After the '['
+    bool array(JsonArrayImpl* array) {
+        if (++depth_ > kMaxDepth) return false;
+        skip_space();
+        if (!consume(']')) {
+            while (true) {
+                JsonValue* ptr;
+                if (!value(&ptr)) return false;
+                array->store(array->size(), ptr);
+                skip_space();
+                if (consume(']')) break;
+                if (!consume(',')) return false;
+            }
+        }
+        depth_--;
+        return true;
+    }
+
+    // null is returned as nullptr, like JsonObjectImpl stores it
+    bool value(JsonValue** ptr) {
+        skip_space();
+        if (pos_ == str_.size()) return false;
+        switch (str_[pos_]) {
+        case '{': {
+            pos_++;
+            auto obj = std::make_shared<JsonObjectImpl>();
+            if (!object(obj.get())) return false;
+            *ptr = new ObjectJsonValue(obj);
+            return true;
+        }
+        case '[': {
+            pos_++;
+            auto arr = std::make_shared<JsonArrayImpl>();
+            if (!array(arr.get())) return false;
+            *ptr = new ArrayJsonValue(arr);
+            return true;
+        }
+        case '"': {
+            pos_++;
+            std::string str;
+            if (!string(&str)) return false;
+            *ptr = new StringJsonValue(str);
+            return true;
+        }
+        case 't':
+            if (!literal("true")) return false;
+            *ptr = new BasicJsonValue(true);
+            return true;
+        case 'f':
+            if (!literal("false")) return false;
+            *ptr = new BasicJsonValue(false);
+            return true;
+        case 'n':
+            if (!literal("null")) return false;
+            *ptr = nullptr;
+            return true;
+        default:
+            return number(ptr);
+        }
+    }
+
+    bool number(JsonValue** ptr) {
+        auto const start = pos_;
+        bool integer = true;
+        consume('-');
+        if (!consume('0') && !digits()) return false;
+        if (consume('.')) {
+            integer = false;
+            if (!digits()) return false;
+        }
+        if (consume('e') || consume('E')) {
+            integer = false;
+            if (!consume('+')) consume('-');
+            if (!digits()) return false;
+        }
+        // Only valid numbers get here, so strto* stop at the same place
+        auto const str = str_.c_str() + start;
+        if (integer) {
+            errno = 0;
+            auto const i = strtoll(str, nullptr, 10);
+            if (errno == 0) {
+                *ptr = new BasicJsonValue(static_cast<int64_t>(i));
+                return true;
+            }
+        }
+        *ptr = new BasicJsonValue(strtod(str, nullptr));
+        return true;
+    }
+
+    bool digits() {
+        auto const start = pos_;
+        while (pos_ < str_.size() && str_[pos_] >= '0' && str_[pos_] <= '9') {
+            pos_++;
+        }
+        return pos_ > start;
+    }
+
+    // After the '"'
+    bool string(std::string* out) {
+        while (true) {
+            auto const start = pos_;
+            while (pos_ < str_.size() && str_[pos_] != '"' &&
+                   str_[pos_] != '\\') {
+                pos_++;
+            }
+            out->append(str_, start, pos_ - start);
+            if (pos_ == str_.size()) return false;
+            if (str_[pos_++] == '"') return true;
+            if (pos_ == str_.size()) return false;
+            switch (str_[pos_++]) {
+            case '"':
+                out->push_back('"');
+                break;
+            case '\\':
+                out->push_back('\\');
+                break;
+            case '/':
+                out->push_back('/');
+                break;
+            case 'b':
+                out->push_back('\b');
+                break;
+            case 'f':
+                out->push_back('\f');
+                break;
+            case 'n':
+                out->push_back('\n');
+                break;
+            case 'r':
+                out->push_back('\r');
+                break;
+            case 't':
+                out->push_back('\t');
+                break;
+            case 'u': {
+                uint32_t c;
+                if (!hex4(&c)) return false;
+                if (c >= 0xd800 && c < 0xdc00) {
+                    // Surrogate pair
+                    uint32_t low;
+                    if (!consume('\\') || !consume('u') || !hex4(&low) ||
+                        low < 0xdc00 || low >= 0xe000) return false;
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                } else if (c >= 0xdc00 && c < 0xe000) {
+                    return false;
+                }
+                utf8(c, out);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+    }
+
+    bool hex4(uint32_t* value) {
+        if (str_.size() - pos_ < 4) return false;
+        *value = 0;
+        for (int i = 0; i < 4; i++) {
+            auto const c = str_[pos_++];
+            *value <<= 4;
+            if (c >= '0' && c <= '9') {
+                *value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                *value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                *value |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void utf8(uint32_t c, std::string* out) {
+        if (c < 0x80) {
+            out->push_back(c);
+        } else if (c < 0x800) {
+            out->push_back(0xc0 | (c >> 6));
+            out->push_back(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            out->push_back(0xe0 | (c >> 12));
+            out->push_back(0x80 | ((c >> 6) & 0x3f));
+            out->push_back(0x80 | (c & 0x3f));
+        } else {
+            out->push_back(0xf0 | (c >> 18));
+            out->push_back(0x80 | ((c >> 12) & 0x3f));
+            out->push_back(0x80 | ((c >> 6) & 0x3f));
+            out->push_back(0x80 | (c & 0x3f));
+        }
+    }
+
+    bool literal(const char* word) {
+        auto const len = strlen(word);
+        if (str_.compare(pos_, len, word) != 0) return false;
+        pos_ += len;
+        return true;
+    }
+
+    bool consume(char c) {
+        if (pos_ < str_.size() && str_[pos_] == c) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+
+    void skip_space() {
+        while (pos_ < str_.size() &&
+               (str_[pos_] == ' ' || str_[pos_] == '\t' ||
+                str_[pos_] == '\n' || str_[pos_] == '\r')) {
+            pos_++;
+        }
+    }
+
+    const std::string& str_;
+    size_t pos_;
+    unsigned int depth_;
+};
+
 }  // namespace
 
 // static
@@ -401,6 +678,11 @@ std::shared_ptr<JsonObject> JsonObject::create() {
     return std::make_shared<JsonObjectImpl>();
 }
 
+// static
+std::shared_ptr<JsonObject> JsonObject::parse(const std::string& str) {
+    return Parser(str).parse();
+}
+
 void JsonObject::put(const std::string& name, const char* value) {
     if (value) {
         put(name, std::string(value));
@@ -45,6 +45,9 @@ public:
     virtual std::string str() const = 0;
 
     static std::shared_ptr<JsonObject> create();
+    // Returns nullptr if str isn't a JSON object, possibly with whitespace
+    // around it
+    static std::shared_ptr<JsonObject> parse(const std::string& str);
 
 protected:
     JsonObject() {}
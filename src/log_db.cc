@@ -0,0 +1,1992 @@
+#include "common.hh"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <unistd.h>
+
+#include "log_db.hh"
+
+namespace stuff {
+
+namespace {
+
+// Log and snapshot files start with a magic followed by the generation.
+// The generation is increased every time the log is compacted into a new
+// snapshot, a log is only valid together with a snapshot of the same
+// generation.
+const char kLogMagic[8] = { 'S', 'T', 'U', 'F', 'L', 'O', 'G', '1' };
+const char kSnapshotMagic[8] = { 'S', 'T', 'U', 'F', 'S', 'N', 'P', '1' };
+const size_t kHeaderSize = 16;
+// Each record is a u32 payload size, u32 checksum and then the payload
+const size_t kRecordHeaderSize = 8;
+
+// Compact when the log is larger than this and larger than the snapshot
+const off_t kCompactMinSize = 1024 * 1024;
+
+// The changes file, path + ".changes", only holds a counter that every
+// writer increases when it takes the write lock. It's mapped shared so
+// readers can check for changes without a syscall.
+typedef std::atomic<uint64_t> Changes;
+static_assert(Changes::is_always_lock_free, "Changes must be lock free");
+
+enum Op : uint8_t {
+    OP_CREATE = 1,
+    OP_DROP = 2,
+    OP_PUT = 3,
+    OP_DELETE = 4,
+    OP_INDEX = 5,
+    OP_RENAME = 6,
+    OP_COLUMN = 7,
+    OP_TEXT = 8,
+};
+
+enum CellType : uint8_t {
+    CELL_NULL = 0,
+    CELL_INT = 1,
+    CELL_REAL = 2,
+    CELL_TEXT = 3,
+    CELL_BLOB = 4,
+};
+
+struct Cell {
+    CellType type;
+    int64_t i;
+    double d;
+    std::string s;
+
+    Cell()
+        : type(CELL_NULL), i(0), d(0.0) {
+    }
+};
+
+typedef std::vector<Cell> Row;
+
+uint32_t checksum(const char* data, size_t size) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void put_u8(std::string* out, uint8_t value) {
+    out->push_back(static_cast<char>(value));
+}
+
+void put_u32(std::string* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back(static_cast<char>(value & 0xff));
+        value >>= 8;
+    }
+}
+
+void put_u64(std::string* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out->push_back(static_cast<char>(value & 0xff));
+        value >>= 8;
+    }
+}
+
+void put_str(std::string* out, const std::string& str) {
+    put_u32(out, str.size());
+    out->append(str);
+}
+
+void put_cell(std::string* out, const Cell& cell) {
+    put_u8(out, cell.type);
+    switch (cell.type) {
+    case CELL_NULL:
+        break;
+    case CELL_INT:
+        put_u64(out, static_cast<uint64_t>(cell.i));
+        break;
+    case CELL_REAL: {
+        uint64_t tmp;
+        memcpy(&tmp, &cell.d, sizeof(tmp));
+        put_u64(out, tmp);
+        break;
+    }
+    case CELL_TEXT:
+    case CELL_BLOB:
+        put_str(out, cell.s);
+        break;
+    }
+}
+
+class Reader {
+public:
+    Reader(const char* data, size_t size)
+        : data_(data), size_(size), pos_(0), bad_(false) {
+    }
+
+    bool eof() const {
+        return pos_ >= size_;
+    }
+
+    bool bad() const {
+        return bad_;
+    }
+
+    uint8_t u8() {
+        if (!need(1)) return 0;
+        return static_cast<uint8_t>(data_[pos_++]);
+    }
+
+    uint32_t u32() {
+        if (!need(4)) return 0;
+        uint32_t ret = 0;
+        for (int i = 3; i >= 0; i--) {
+            ret = (ret << 8) | static_cast<uint8_t>(data_[pos_ + i]);
+        }
+        pos_ += 4;
+        return ret;
+    }
+
+    uint64_t u64() {
+        if (!need(8)) return 0;
+        uint64_t ret = 0;
+        for (int i = 7; i >= 0; i--) {
+            ret = (ret << 8) | static_cast<uint8_t>(data_[pos_ + i]);
+        }
+        pos_ += 8;
+        return ret;
+    }
+
+    std::string str() {
+        auto size = u32();
+        if (!need(size)) return std::string();
+        std::string ret(data_ + pos_, size);
+        pos_ += size;
+        return ret;
+    }
+
+    Cell cell() {
+        Cell ret;
+        ret.type = static_cast<CellType>(u8());
+        switch (ret.type) {
+        case CELL_NULL:
+            break;
+        case CELL_INT:
+            ret.i = static_cast<int64_t>(u64());
+            break;
+        case CELL_REAL: {
+            auto tmp = u64();
+            memcpy(&ret.d, &tmp, sizeof(tmp));
+            break;
+        }
+        case CELL_TEXT:
+        case CELL_BLOB:
+            ret.s = str();
+            break;
+        default:
+            bad_ = true;
+            break;
+        }
+        return ret;
+    }
+
+private:
+    bool need(size_t size) {
+        if (bad_ || size_ - pos_ < size) {
+            bad_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    const char* const data_;
+    size_t const size_;
+    size_t pos_;
+    bool bad_;
+};
+
+// SQLite compatible ordering, NULL < numbers < text < blob
+int compare(const Cell& c1, const Cell& c2) {
+    auto rank = [](CellType type) {
+        switch (type) {
+        case CELL_NULL: return 0;
+        case CELL_INT:
+        case CELL_REAL: return 1;
+        case CELL_TEXT: return 2;
+        case CELL_BLOB: return 3;
+        }
+        return 4;
+    };
+    auto r1 = rank(c1.type), r2 = rank(c2.type);
+    if (r1 != r2) return r1 < r2 ? -1 : 1;
+    switch (r1) {
+    case 0:
+        return 0;
+    case 1:
+        if (c1.type == CELL_INT && c2.type == CELL_INT) {
+            return c1.i < c2.i ? -1 : (c1.i > c2.i ? 1 : 0);
+        } else {
+            double d1 = c1.type == CELL_INT ? c1.i : c1.d;
+            double d2 = c2.type == CELL_INT ? c2.i : c2.d;
+            return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+        }
+    default:
+        return c1.s.compare(c2.s);
+    }
+}
+
+Cell to_cell(const DB::Value& value) {
+    Cell ret;
+    switch (value.type()) {
+    case DB::Type::STRING:
+        ret.type = CELL_TEXT;
+        ret.s = value.string();
+        break;
+    case DB::Type::BOOL:
+        ret.type = CELL_INT;
+        ret.i = value.b() ? 1 : 0;
+        break;
+    case DB::Type::DOUBLE:
+        ret.type = CELL_REAL;
+        ret.d = value.d();
+        break;
+    case DB::Type::INT32:
+        ret.type = CELL_INT;
+        ret.i = value.i32();
+        break;
+    case DB::Type::INT64:
+        ret.type = CELL_INT;
+        ret.i = value.i64();
+        break;
+    case DB::Type::RAW:
+        break;
+    }
+    return ret;
+}
+
+struct ColumnInfo {
+    std::string name;
+    DB::Type type;
+    bool primary_key;
+    bool unique;
+    bool not_null;
+};
+
+struct CellLess {
+    bool operator()(const Cell& c1, const Cell& c2) const {
+        return compare(c1, c2) < 0;
+    }
+};
+
+typedef std::multimap<Cell, int64_t, CellLess> Index;
+
+struct Table {
+    std::vector<ColumnInfo> columns;
+    std::map<int64_t, std::shared_ptr<const Row>> rows;
+    // Column that is an alias for the rowid, -1 if none
+    int rowid_column;
+    int64_t last_rowid;
+    // Only the first column of each declared index is indexed, the rest
+    // is filtered and sorted in memory
+    std::map<int, Index> indexes;
+    // Columns searched by search(), empty if none
+    std::vector<int> text_columns;
+
+    Table()
+        : rowid_column(-1), last_rowid(0) {
+    }
+
+    void index(int64_t rowid, const Row& row) {
+        for (auto& pair : indexes) {
+            pair.second.emplace(row[pair.first], rowid);
+        }
+    }
+
+    void unindex(int64_t rowid, const Row& row) {
+        for (auto& pair : indexes) {
+            auto range = pair.second.equal_range(row[pair.first]);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == rowid) {
+                    pair.second.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+
+    int find_column(const std::string& name) const {
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (columns[i].name == name) return i;
+        }
+        return -1;
+    }
+};
+
+// Split text into lower case words, like the default FTS5 tokenizer does
+// for ASCII
+void tokenize(const std::string& text, std::vector<std::string>* tokens) {
+    std::string token;
+    for (auto c : text) {
+        if (isalnum(static_cast<unsigned char>(c)) ||
+            static_cast<unsigned char>(c) >= 0x80) {
+            token.push_back(tolower(static_cast<unsigned char>(c)));
+        } else if (!token.empty()) {
+            tokens->push_back(token);
+            token.clear();
+        }
+    }
+    if (!token.empty()) tokens->push_back(token);
+}
+
+bool pread_all(int fd, char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        auto ret = pread(fd, data, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (ret == 0) return false;
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, const char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        auto ret = pwrite(fd, data, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+// Copy the open file fd to a temporary file and rename it to target when
+// done so that target is never a partial copy
+bool copy_file(int fd, const std::string& target) {
+    struct stat buf;
+    if (fstat(fd, &buf)) return false;
+    std::string data(buf.st_size, '\0');
+    if (!pread_all(fd, &data[0], data.size(), 0)) return false;
+    auto const tmp = target + ".tmp";
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0666);
+    if (out < 0) return false;
+    if (!pwrite_all(out, data.data(), data.size(), 0) || fsync(out)) {
+        ::close(out);
+        unlink(tmp.c_str());
+        return false;
+    }
+    ::close(out);
+    if (rename(tmp.c_str(), target.c_str())) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+class DBImpl : public DB {
+public:
+    DBImpl()
+        : fd_(-1), bad_(true), changes_(nullptr), seen_changes_(0),
+          generation_(0), offset_(0), snapshot_size_(0), transaction_depth_(0),
+          transaction_failed_(false), locked_(false), last_insert_rowid_(0),
+          version_(0) {
+    }
+
+    ~DBImpl() {
+        close();
+    }
+
+    void open(const std::string& path) {
+        close();
+        path_ = path;
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd_ < 0) {
+            error("Unable to open " + path + ": " + strerror(errno));
+            return;
+        }
+        if (!open_changes()) return;
+        bad_ = false;
+        bad_ = !reload();
+    }
+
+    void close() {
+        if (changes_) {
+            munmap(changes_, sizeof(Changes));
+            changes_ = nullptr;
+        }
+        if (fd_ < 0) return;
+        if (locked_) unlock();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    bool insert_table(const std::string& table,
+                      const Declaration& declaration) override {
+        if (!begin_write()) return false;
+        if (tables_.count(table)) return end_write(true);
+        std::string op;
+        put_u8(&op, OP_CREATE);
+        put_str(&op, table);
+        put_u32(&op, declaration.size());
+        for (const auto& pair : declaration) {
+            put_str(&op, pair.first);
+            put_u8(&op, static_cast<uint8_t>(pair.second.type()));
+            put_u8(&op, (pair.second.primary_key() ? 1 : 0) |
+                   (pair.second.unique() ? 2 : 0) |
+                   (pair.second.not_null() ? 4 : 0));
+        }
+        return end_write(apply(op));
+    }
+
+    bool remove_table(const std::string& table) override {
+        if (!begin_write()) return false;
+        if (!tables_.count(table)) return end_write(true);
+        std::string op;
+        put_u8(&op, OP_DROP);
+        put_str(&op, table);
+        return end_write(apply(op));
+    }
+
+    bool rename_table(const std::string& table,
+                      const std::string& new_name) override {
+        if (!begin_write()) return false;
+        if (!tables_.count(table)) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        if (tables_.count(new_name)) {
+            error("There is already another table named " + new_name);
+            return end_write(false);
+        }
+        std::string op;
+        put_u8(&op, OP_RENAME);
+        put_str(&op, table);
+        put_str(&op, new_name);
+        return end_write(apply(op));
+    }
+
+    bool insert_column(const std::string& table, const std::string& name,
+                       const Constraint& constraint) override {
+        if (!begin_write()) return false;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        if (it->second.find_column(name) >= 0) {
+            error("Duplicate column name: " + name);
+            return end_write(false);
+        }
+        if (constraint.unique() || constraint.not_null()) {
+            error("Cannot add a UNIQUE or NOT NULL column");
+            return end_write(false);
+        }
+        std::string op;
+        put_u8(&op, OP_COLUMN);
+        put_str(&op, table);
+        put_str(&op, name);
+        put_u8(&op, static_cast<uint8_t>(constraint.type()));
+        return end_write(apply(op));
+    }
+
+    bool insert_index(const std::string& table, const std::string& name,
+                      const std::vector<OrderBy>& columns) override {
+        if (columns.empty()) return false;
+        if (!begin_write()) return false;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        auto column = it->second.find_column(columns.front().name());
+        if (column < 0) {
+            error("No such column: " + columns.front().name());
+            return end_write(false);
+        }
+        if (it->second.indexes.count(column)) return end_write(true);
+        std::string op;
+        put_u8(&op, OP_INDEX);
+        put_str(&op, table);
+        put_str(&op, columns.front().name());
+        return end_write(apply(op));
+    }
+
+    bool insert_text_index(const std::string& table,
+                           const std::vector<std::string>& columns) override {
+        if (columns.empty()) return false;
+        if (!begin_write()) return false;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        for (const auto& column : columns) {
+            if (it->second.find_column(column) < 0) {
+                error("No such column: " + column);
+                return end_write(false);
+            }
+        }
+        if (!it->second.text_columns.empty()) return end_write(true);
+        std::string op;
+        put_u8(&op, OP_TEXT);
+        put_str(&op, table);
+        put_u32(&op, columns.size());
+        for (const auto& column : columns) put_str(&op, column);
+        return end_write(apply(op));
+    }
+
+    // Indexes are in memory and cheap to keep up to date, and search()
+    // scans the rows anyway
+    bool remove_indexes(const std::string& table) override {
+        catch_up();
+        if (!tables_.count(table)) {
+            error("No such table: " + table);
+            return false;
+        }
+        return true;
+    }
+
+    std::shared_ptr<Editor> insert(const std::string& table) override {
+        return std::shared_ptr<Editor>(new EditorImpl(this, table, nullptr));
+    }
+
+    std::shared_ptr<Editor> update(const std::string& table,
+                                   const Condition& condition) override {
+        return std::shared_ptr<Editor>(
+                new EditorImpl(this, table, &condition));
+    }
+
+    std::shared_ptr<Snapshot> select(
+            const std::string& table, const Condition& condition,
+            const std::vector<OrderBy>& order_by) override {
+        const Table* t;
+        std::vector<std::shared_ptr<const Row>> rows;
+        if (!select_rows(table, condition, order_by, &t, &rows)) {
+            return nullptr;
+        }
+        if (rows.empty()) return nullptr;
+        return std::shared_ptr<Snapshot>(new SnapshotImpl(t->columns, rows));
+    }
+
+    // Rows are shared with the table, so the projected rows are copies but
+    // only of the rows left after limit
+    std::shared_ptr<Snapshot> select_columns(
+            const std::string& table, const std::vector<std::string>& columns,
+            const Condition& condition, const std::vector<OrderBy>& order_by,
+            size_t limit) override {
+        const Table* t;
+        std::vector<std::shared_ptr<const Row>> rows;
+        if (!select_rows(table, condition, order_by, &t, &rows)) {
+            return nullptr;
+        }
+        std::vector<int> index;
+        std::vector<ColumnInfo> info;
+        for (const auto& name : columns) {
+            auto column = t->find_column(name);
+            if (column < 0) {
+                error("No such column: " + name);
+                return nullptr;
+            }
+            index.push_back(column);
+            info.push_back(t->columns[column]);
+        }
+        if (limit > 0 && rows.size() > limit) rows.resize(limit);
+        if (rows.empty() || index.empty()) return nullptr;
+        for (auto& row : rows) {
+            auto projected = std::make_shared<Row>();
+            projected->reserve(index.size());
+            for (auto column : index) projected->push_back((*row)[column]);
+            row = projected;
+        }
+        return std::shared_ptr<Snapshot>(new SnapshotImpl(info, rows));
+    }
+
+    // Everything is in memory so there is no index, the rows are scanned.
+    // Rows are ranked by how many times the words occur
+    std::shared_ptr<Snapshot> search(const std::string& table,
+                                     const std::vector<std::string>& words,
+                                     size_t limit) override {
+        catch_up();
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return nullptr;
+        }
+        const auto& t = it->second;
+        if (t.text_columns.empty()) {
+            error("No text index: " + table);
+            return nullptr;
+        }
+        std::vector<std::string> query;
+        for (const auto& word : words) tokenize(word, &query);
+        if (query.empty() || limit == 0) return nullptr;
+        std::vector<std::pair<size_t, std::shared_ptr<const Row>>> matches;
+        std::vector<std::string> tokens;
+        std::string text;
+        for (const auto& pair : t.rows) {
+            tokens.clear();
+            for (auto column : t.text_columns) {
+                const auto& cell = (*pair.second)[column];
+                if (cell.type == CELL_TEXT) {
+                    tokenize(cell.s, &tokens);
+                } else if (cell.type == CELL_BLOB &&
+                           uncompress_text(cell.s.data(), cell.s.size(),
+                                           &text)) {
+                    tokenize(text, &tokens);
+                }
+            }
+            size_t score = 0;
+            for (const auto& word : query) {
+                auto count = std::count(tokens.begin(), tokens.end(), word);
+                if (count == 0) {
+                    score = 0;
+                    break;
+                }
+                score += count;
+            }
+            if (score) matches.emplace_back(score, pair.second);
+        }
+        if (matches.empty()) return nullptr;
+        std::stable_sort(matches.begin(), matches.end(),
+                         [](const std::pair<size_t,
+                                            std::shared_ptr<const Row>>& m1,
+                            const std::pair<size_t,
+                                            std::shared_ptr<const Row>>& m2) {
+                             return m1.first > m2.first;
+                         });
+        if (matches.size() > limit) matches.resize(limit);
+        std::vector<std::shared_ptr<const Row>> rows;
+        rows.reserve(matches.size());
+        for (auto& match : matches) rows.push_back(std::move(match.second));
+        return std::shared_ptr<Snapshot>(new SnapshotImpl(t.columns, rows));
+    }
+
+    int64_t remove(const std::string& table,
+                   const Condition& condition) override {
+        if (!begin_write()) return -1;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            end_write(false);
+            return -1;
+        }
+        std::vector<int64_t> rowids;
+        if (!find(it->second, condition,
+                  [&rowids](int64_t rowid, const std::shared_ptr<const Row>&) {
+                      rowids.push_back(rowid);
+                  })) {
+            end_write(false);
+            return -1;
+        }
+        for (auto rowid : rowids) {
+            std::string op;
+            put_u8(&op, OP_DELETE);
+            put_str(&op, table);
+            put_u64(&op, rowid);
+            if (!apply(op)) {
+                end_write(false);
+                return -1;
+            }
+        }
+        if (!end_write(true)) return -1;
+        return rowids.size();
+    }
+
+    bool incremental_vacuum(int64_t pages) override {
+        // Compacting is the closest thing, and it's not bounded by pages
+        return compact();
+    }
+
+    int64_t version() override {
+        if (bad_) return -1;
+        catch_up();
+        return version_;
+    }
+
+    // All rows are always in memory so there is no cache to size or
+    // release, the rows are reported as cache to make the numbers comparable
+    bool stats(Stats* stats) override {
+        if (bad_) return false;
+        stats->cache_bytes = 0;
+        stats->other_bytes = 0;
+        for (const auto& pair : tables_) {
+            const auto& table = pair.second;
+            for (const auto& row : table.rows) {
+                stats->cache_bytes += sizeof(*row.second) +
+                    row.second->capacity() * sizeof(Cell);
+                for (const auto& cell : *row.second) {
+                    if (cell.s.capacity() > sizeof(Cell::s)) {
+                        stats->cache_bytes += cell.s.capacity();
+                    }
+                }
+            }
+            for (const auto& index : table.indexes) {
+                stats->other_bytes += index.second.size() *
+                    (sizeof(Cell) + sizeof(int64_t));
+            }
+        }
+        return true;
+    }
+
+    bool set_cache_size(int64_t bytes) override {
+        return !bad_;
+    }
+
+    void release_memory() override {
+    }
+
+    bool start_transaction() override {
+        if (bad_) return false;
+        if (transaction_depth_ == 0) {
+            catch_up();
+            transaction_failed_ = false;
+        }
+        transaction_depth_++;
+        return true;
+    }
+
+    bool start_write_transaction() override {
+        if (transaction_depth_ > 0) return start_transaction();
+        if (!begin_write()) return false;
+        transaction_failed_ = false;
+        transaction_depth_ = 1;
+        return true;
+    }
+
+    bool commit_transaction() override {
+        if (transaction_depth_ == 0) return false;
+        if (transaction_depth_ > 1) {
+            transaction_depth_--;
+            return true;
+        }
+        // Either way the transaction is over, a failed one is rolled back
+        transaction_depth_ = 0;
+        if (transaction_failed_) {
+            if (pending_.empty()) {
+                if (locked_) unlock();
+            } else {
+                rollback_auto();
+            }
+            return false;
+        }
+        return flush();
+    }
+
+    bool rollback_transaction() override {
+        if (transaction_depth_ == 0) return false;
+        if (transaction_depth_ > 1) {
+            transaction_depth_--;
+            transaction_failed_ = true;
+            return true;
+        }
+        transaction_depth_ = 0;
+        if (pending_.empty()) {
+            if (locked_) unlock();
+            return true;
+        }
+        // Memory has already been modified, throw it all away and start
+        // over from the files
+        pending_.clear();
+        if (locked_) unlock();
+        if (!reload()) {
+            bad_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool bad() override {
+        return bad_;
+    }
+
+    std::string last_error() override {
+        return last_error_;
+    }
+
+private:
+    class EditorImpl : public Editor {
+    public:
+        EditorImpl(DBImpl* db, const std::string& table,
+                   const Condition* condition)
+            : db_(db), table_(table), update_(condition != nullptr),
+              condition_(condition ? *condition : Condition()) {
+        }
+
+        void set(const std::string& name, const std::string& value) override {
+            data_[name] = to_cell(Value(value));
+        }
+
+        void set(const std::string& name, bool value) override {
+            data_[name] = to_cell(Value(value));
+        }
+
+        void set(const std::string& name, double value) override {
+            data_[name] = to_cell(Value(value));
+        }
+
+        void set(const std::string& name, int32_t value) override {
+            data_[name] = to_cell(Value(value));
+        }
+
+        void set(const std::string& name, int64_t value) override {
+            data_[name] = to_cell(Value(value));
+        }
+
+        void set_null(const std::string& name) override {
+            data_[name] = Cell();
+        }
+
+        void set(const std::string& name, const void* data,
+                 size_t size) override {
+            if (!data) {
+                set_null(name);
+            } else {
+                Cell cell;
+                cell.type = CELL_BLOB;
+                cell.s.assign(reinterpret_cast<const char*>(data), size);
+                data_[name] = cell;
+            }
+        }
+
+        bool commit() override {
+            if (data_.empty()) return false;
+            if (update_) {
+                return db_->update_rows(table_, condition_, data_);
+            }
+            return db_->insert_row(table_, data_, &rowid_);
+        }
+
+        int64_t last_insert_rowid() override {
+            assert(!update_);
+            return rowid_;
+        }
+
+    private:
+        DBImpl* const db_;
+        const std::string table_;
+        bool const update_;
+        const Condition condition_;
+        std::map<std::string, Cell> data_;
+        int64_t rowid_;
+    };
+
+    class SnapshotImpl : public Snapshot {
+    public:
+        SnapshotImpl(const std::vector<ColumnInfo>& columns,
+                     std::vector<std::shared_ptr<const Row>>& rows)
+            : columns_(columns), pos_(0) {
+            rows_.swap(rows);
+        }
+
+        bool get(const std::string& name, std::string* value) override {
+            return get(find_column(name), value);
+        }
+        bool get(const std::string& name, bool* value) override {
+            return get(find_column(name), value);
+        }
+        bool get(const std::string& name, double* value) override {
+            return get(find_column(name), value);
+        }
+        bool get(const std::string& name, int32_t* value) override {
+            return get(find_column(name), value);
+        }
+        bool get(const std::string& name, int64_t* value) override {
+            return get(find_column(name), value);
+        }
+        bool get(const std::string& name,
+                 std::vector<uint8_t>* value) override {
+            return get(find_column(name), value);
+        }
+        bool is_null(const std::string& name, bool* value) override {
+            return is_null(find_column(name), value);
+        }
+
+        bool get(uint32_t column, std::string* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_TEXT);
+            if (!cell) return false;
+            value->assign(cell->s);
+            return true;
+        }
+        bool get(uint32_t column, bool* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_INT);
+            if (!cell) return false;
+            *value = cell->i != 0;
+            return true;
+        }
+        bool get(uint32_t column, double* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_REAL);
+            if (!cell) return false;
+            *value = cell->d;
+            return true;
+        }
+        bool get(uint32_t column, int32_t* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_INT);
+            if (!cell) return false;
+            *value = cell->i;
+            return true;
+        }
+        bool get(uint32_t column, int64_t* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_INT);
+            if (!cell) return false;
+            *value = cell->i;
+            return true;
+        }
+        bool get(uint32_t column, std::vector<uint8_t>* value) override {
+            if (!value) { assert(false); return false; }
+            auto cell = get(column, CELL_BLOB);
+            if (!cell) return false;
+            value->assign(cell->s.begin(), cell->s.end());
+            return true;
+        }
+        bool is_null(uint32_t column, bool* value) override {
+            if (!value) { assert(false); return false; }
+            if (pos_ >= rows_.size() || column >= columns_.size()) {
+                return false;
+            }
+            *value = (*rows_[pos_])[column].type == CELL_NULL;
+            return true;
+        }
+
+        bool next() override {
+            if (pos_ >= rows_.size()) return false;
+            return ++pos_ < rows_.size();
+        }
+
+        bool bad() override {
+            return false;
+        }
+
+    private:
+        const Cell* get(uint32_t column, CellType type) const {
+            if (pos_ >= rows_.size() || column >= columns_.size()) {
+                return nullptr;
+            }
+            const auto& cell = (*rows_[pos_])[column];
+            return cell.type == type ? &cell : nullptr;
+        }
+
+        uint32_t find_column(const std::string& name) const {
+            for (size_t i = 0; i < columns_.size(); i++) {
+                if (columns_[i].name == name) return i;
+            }
+            return 0xfffffffful;
+        }
+
+        const std::vector<ColumnInfo> columns_;
+        std::vector<std::shared_ptr<const Row>> rows_;
+        size_t pos_;
+    };
+
+    // Fill rows with the rows in table matching condition, sorted by
+    // order_by. Returns false in case of error
+    bool select_rows(const std::string& table, const Condition& condition,
+                     const std::vector<OrderBy>& order_by,
+                     const Table** table_ptr,
+                     std::vector<std::shared_ptr<const Row>>* rows) {
+        catch_up();
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return false;
+        }
+        const auto& t = it->second;
+        *table_ptr = &t;
+        std::vector<std::pair<int,bool>> order;
+        for (const auto& entry : order_by) {
+            auto column = t.find_column(entry.name());
+            if (column < 0) {
+                error("No such column: " + entry.name());
+                return false;
+            }
+            order.emplace_back(column, entry.ascending());
+        }
+        if (!find(t, condition, [rows](int64_t,
+                                       const std::shared_ptr<const Row>& row) {
+                    rows->push_back(row);
+                })) {
+            return false;
+        }
+        if (!order.empty()) {
+            std::stable_sort(rows->begin(), rows->end(),
+                             [&order](const std::shared_ptr<const Row>& r1,
+                                      const std::shared_ptr<const Row>& r2) {
+                                 for (const auto& o : order) {
+                                     auto ret = compare((*r1)[o.first],
+                                                        (*r2)[o.first]);
+                                     if (ret != 0) {
+                                         return o.second ? ret < 0 : ret > 0;
+                                     }
+                                 }
+                                 return false;
+                             });
+        }
+        return true;
+    }
+
+    typedef std::function<void(int64_t rowid,
+                               const std::shared_ptr<const Row>& row)>
+        FindCallback;
+
+    // Call callback for all rows in table matching condition, in rowid
+    // order. Returns false in case of error
+    bool find(const Table& table, const Condition& condition,
+              const FindCallback& callback) {
+        std::vector<int64_t> rowids;
+        if (!candidates(table, condition, &rowids)) {
+            for (const auto& pair : table.rows) {
+                int match = matches(table, *pair.second, condition);
+                if (match < 0) return false;
+                if (match) callback(pair.first, pair.second);
+            }
+            return true;
+        }
+        std::sort(rowids.begin(), rowids.end());
+        rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+        for (auto rowid : rowids) {
+            const auto& row = table.rows.at(rowid);
+            int match = matches(table, *row, condition);
+            if (match < 0) return false;
+            if (match) callback(rowid, row);
+        }
+        return true;
+    }
+
+    // Use an index to find rows that might match condition. Returns false
+    // if no index can be used
+    bool candidates(const Table& table, const Condition& condition,
+                    std::vector<int64_t>* rowids) {
+        switch (condition.mode()) {
+        case Condition::BOOL_BINARY:
+            if (condition.bool_binary_op() != Condition::AND) return false;
+            return candidates(table, condition.c1(), rowids) ||
+                candidates(table, condition.c2(), rowids);
+        case Condition::COMP_BINARY: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) return false;
+            auto value = to_cell(condition.value());
+            if (column == table.rowid_column &&
+                condition.binary_op() == Condition::EQUAL) {
+                if (value.type == CELL_INT && table.rows.count(value.i)) {
+                    rowids->push_back(value.i);
+                }
+                return true;
+            }
+            auto it = table.indexes.find(column);
+            if (it == table.indexes.end()) return false;
+            const auto& index = it->second;
+            Index::const_iterator begin, end;
+            switch (condition.binary_op()) {
+            case Condition::EQUAL:
+                begin = index.lower_bound(value);
+                end = index.upper_bound(value);
+                break;
+            case Condition::NOT_EQUAL:
+                return false;
+            case Condition::GREATER_THAN:
+                begin = index.upper_bound(value);
+                end = index.end();
+                break;
+            case Condition::GREATER_EQUAL:
+                begin = index.lower_bound(value);
+                end = index.end();
+                break;
+            case Condition::LESS_THAN:
+                begin = index.begin();
+                end = index.lower_bound(value);
+                break;
+            case Condition::LESS_EQUAL:
+                begin = index.begin();
+                end = index.upper_bound(value);
+                break;
+            }
+            for (auto i = begin; i != end; ++i) {
+                rowids->push_back(i->second);
+            }
+            return true;
+        }
+        case Condition::COMP_SET: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) return false;
+            if (column == table.rowid_column) {
+                for (const auto& v : condition.values()) {
+                    auto value = to_cell(v);
+                    if (value.type == CELL_INT && table.rows.count(value.i)) {
+                        rowids->push_back(value.i);
+                    }
+                }
+                return true;
+            }
+            auto it = table.indexes.find(column);
+            if (it == table.indexes.end()) return false;
+            for (const auto& v : condition.values()) {
+                auto range = it->second.equal_range(to_cell(v));
+                for (auto i = range.first; i != range.second; ++i) {
+                    rowids->push_back(i->second);
+                }
+            }
+            return true;
+        }
+        case Condition::COMP_RANGE: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) return false;
+            auto it = table.indexes.find(column);
+            if (it == table.indexes.end()) return false;
+            auto low = to_cell(condition.low());
+            auto high = to_cell(condition.high());
+            if (compare(low, high) > 0) return true;
+            auto end = it->second.upper_bound(high);
+            for (auto i = it->second.lower_bound(low); i != end; ++i) {
+                rowids->push_back(i->second);
+            }
+            return true;
+        }
+        case Condition::NOOP:
+        case Condition::BOOL_UNARY:
+        case Condition::COMP_UNARY:
+            return false;
+        }
+        return false;
+    }
+
+    // Returns 1 if row matches condition, 0 if not and -1 in case of error
+    int matches(const Table& table, const Row& row,
+                const Condition& condition) {
+        switch (condition.mode()) {
+        case Condition::NOOP:
+            return 1;
+        case Condition::BOOL_BINARY: {
+            auto ret = matches(table, row, condition.c1());
+            if (ret < 0) return ret;
+            switch (condition.bool_binary_op()) {
+            case Condition::AND:
+                if (!ret) return 0;
+                break;
+            case Condition::OR:
+                if (ret) return 1;
+                break;
+            }
+            return matches(table, row, condition.c2());
+        }
+        case Condition::BOOL_UNARY: {
+            auto ret = matches(table, row, condition.c1());
+            if (ret < 0) return ret;
+            return ret ? 0 : 1;
+        }
+        case Condition::COMP_BINARY: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) {
+                error("No such column: " + condition.column().name());
+                return -1;
+            }
+            const auto& cell = row[column];
+            auto value = to_cell(condition.value());
+            if (cell.type == CELL_NULL || value.type == CELL_NULL) return 0;
+            auto ret = compare(cell, value);
+            switch (condition.binary_op()) {
+            case Condition::EQUAL:
+                return ret == 0;
+            case Condition::NOT_EQUAL:
+                return ret != 0;
+            case Condition::GREATER_THAN:
+                return ret > 0;
+            case Condition::LESS_THAN:
+                return ret < 0;
+            case Condition::GREATER_EQUAL:
+                return ret >= 0;
+            case Condition::LESS_EQUAL:
+                return ret <= 0;
+            }
+            break;
+        }
+        case Condition::COMP_UNARY: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) {
+                error("No such column: " + condition.column().name());
+                return -1;
+            }
+            const auto& cell = row[column];
+            switch (condition.unary_op()) {
+            case Condition::NEGATIVE:
+                return (cell.type == CELL_INT && cell.i != 0) ||
+                    (cell.type == CELL_REAL && cell.d != 0.0);
+            case Condition::IS_NULL:
+                return cell.type == CELL_NULL;
+            }
+            break;
+        }
+        case Condition::COMP_SET: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) {
+                error("No such column: " + condition.column().name());
+                return -1;
+            }
+            const auto& cell = row[column];
+            if (cell.type == CELL_NULL) return 0;
+            for (const auto& value : condition.values()) {
+                if (compare(cell, to_cell(value)) == 0) return 1;
+            }
+            return 0;
+        }
+        case Condition::COMP_RANGE: {
+            auto column = table.find_column(condition.column().name());
+            if (column < 0) {
+                error("No such column: " + condition.column().name());
+                return -1;
+            }
+            const auto& cell = row[column];
+            auto low = to_cell(condition.low());
+            auto high = to_cell(condition.high());
+            if (cell.type == CELL_NULL || low.type == CELL_NULL ||
+                high.type == CELL_NULL) return 0;
+            return compare(cell, low) >= 0 && compare(cell, high) <= 0;
+        }
+        }
+        assert(false);
+        return -1;
+    }
+
+    bool check_row(const Table& table, const Row& row, int64_t rowid) {
+        for (size_t i = 0; i < table.columns.size(); i++) {
+            const auto& column = table.columns[i];
+            if (column.not_null && row[i].type == CELL_NULL) {
+                error("NOT NULL constraint failed: " + column.name);
+                return false;
+            }
+            if (column.unique && row[i].type != CELL_NULL) {
+                auto index = table.indexes.find(i);
+                if (index != table.indexes.end()) {
+                    auto range = index->second.equal_range(row[i]);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second != rowid) {
+                            error("UNIQUE constraint failed: " + column.name);
+                            return false;
+                        }
+                    }
+                    continue;
+                }
+                for (const auto& pair : table.rows) {
+                    if (pair.first == rowid) continue;
+                    const auto& other = (*pair.second)[i];
+                    if (other.type != CELL_NULL &&
+                        compare(other, row[i]) == 0) {
+                        error("UNIQUE constraint failed: " + column.name);
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    bool insert_row(const std::string& table,
+                    const std::map<std::string, Cell>& data,
+                    int64_t* rowid) {
+        if (!begin_write()) return false;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        const auto& t = it->second;
+        Row row(t.columns.size());
+        for (const auto& pair : data) {
+            auto column = t.find_column(pair.first);
+            if (column < 0) {
+                error("No such column: " + pair.first);
+                return end_write(false);
+            }
+            row[column] = pair.second;
+        }
+        if (t.rowid_column >= 0 && row[t.rowid_column].type == CELL_INT) {
+            *rowid = row[t.rowid_column].i;
+            if (t.rows.count(*rowid)) {
+                error("UNIQUE constraint failed: " +
+                      t.columns[t.rowid_column].name);
+                return end_write(false);
+            }
+        } else {
+            *rowid = t.last_rowid + 1;
+            if (t.rowid_column >= 0) {
+                row[t.rowid_column].type = CELL_INT;
+                row[t.rowid_column].i = *rowid;
+            }
+        }
+        if (!check_row(t, row, *rowid)) return end_write(false);
+        if (!apply(put(table, *rowid, row))) return end_write(false);
+        last_insert_rowid_ = *rowid;
+        return end_write(true);
+    }
+
+    bool update_rows(const std::string& table, const Condition& condition,
+                     const std::map<std::string, Cell>& data) {
+        if (!begin_write()) return false;
+        auto it = tables_.find(table);
+        if (it == tables_.end()) {
+            error("No such table: " + table);
+            return end_write(false);
+        }
+        const auto& t = it->second;
+        std::vector<std::pair<int, const Cell*>> changes;
+        for (const auto& pair : data) {
+            auto column = t.find_column(pair.first);
+            if (column < 0) {
+                error("No such column: " + pair.first);
+                return end_write(false);
+            }
+            if (column == t.rowid_column) {
+                error("Changing rowid is not supported");
+                return end_write(false);
+            }
+            changes.emplace_back(column, &pair.second);
+        }
+        std::vector<std::pair<int64_t, Row>> rows;
+        if (!find(t, condition,
+                  [&rows, &changes](int64_t rowid,
+                                    const std::shared_ptr<const Row>& match) {
+                      Row row(*match);
+                      for (const auto& change : changes) {
+                          row[change.first] = *change.second;
+                      }
+                      rows.emplace_back(rowid, std::move(row));
+                  })) {
+            return end_write(false);
+        }
+        for (const auto& pair : rows) {
+            if (!check_row(t, pair.second, pair.first)) {
+                return end_write(false);
+            }
+        }
+        for (const auto& pair : rows) {
+            if (!apply(put(table, pair.first, pair.second))) {
+                return end_write(false);
+            }
+        }
+        return end_write(true);
+    }
+
+    static std::string put(const std::string& table, int64_t rowid,
+                           const Row& row) {
+        std::string op;
+        put_u8(&op, OP_PUT);
+        put_str(&op, table);
+        put_u64(&op, rowid);
+        put_u32(&op, row.size());
+        for (const auto& cell : row) {
+            put_cell(&op, cell);
+        }
+        return op;
+    }
+
+    // Apply op to memory and queue it for the log
+    bool apply(const std::string& op) {
+        Reader reader(op.data(), op.size());
+        if (!apply(&reader)) return false;
+        pending_.append(op);
+        return true;
+    }
+
+    bool apply(Reader* reader) {
+        version_++;
+        auto const type = reader->u8();
+        auto const table = reader->str();
+        if (reader->bad()) return false;
+        switch (type) {
+        case OP_CREATE: {
+            Table t;
+            auto count = reader->u32();
+            for (uint32_t i = 0; !reader->bad() && i < count; i++) {
+                ColumnInfo column;
+                column.name = reader->str();
+                column.type = static_cast<Type>(reader->u8());
+                auto flags = reader->u8();
+                column.primary_key = flags & 1;
+                column.unique = flags & 2;
+                column.not_null = flags & 4;
+                t.columns.push_back(column);
+            }
+            int primary = -1;
+            for (size_t i = 0; i < t.columns.size(); i++) {
+                if (t.columns[i].primary_key) {
+                    // Only a single integer primary key is a rowid alias
+                    primary = primary == -1 &&
+                        (t.columns[i].type == Type::INT64 ||
+                         t.columns[i].type == Type::INT32) ? i : -2;
+                }
+            }
+            if (primary >= 0) {
+                t.rowid_column = primary;
+                // Uniqueness is given by the rowid
+                t.columns[primary].unique = false;
+                t.columns[primary].not_null = false;
+            }
+            // Like SQLite, unique columns are implicitly indexed
+            for (size_t i = 0; i < t.columns.size(); i++) {
+                if (t.columns[i].unique) t.indexes[i];
+            }
+            if (reader->bad()) return false;
+            tables_[table] = std::move(t);
+            return true;
+        }
+        case OP_DROP:
+            tables_.erase(table);
+            return true;
+        case OP_PUT: {
+            auto rowid = static_cast<int64_t>(reader->u64());
+            auto count = reader->u32();
+            auto it = tables_.find(table);
+            if (it == tables_.end() ||
+                count != it->second.columns.size()) return false;
+            auto row = std::make_shared<Row>();
+            row->reserve(count);
+            for (uint32_t i = 0; !reader->bad() && i < count; i++) {
+                row->push_back(reader->cell());
+            }
+            if (reader->bad()) return false;
+            auto& t = it->second;
+            auto old = t.rows.find(rowid);
+            if (old != t.rows.end()) {
+                t.unindex(rowid, *old->second);
+                old->second = row;
+            } else {
+                t.rows.emplace(rowid, row);
+            }
+            t.index(rowid, *row);
+            t.last_rowid = std::max(t.last_rowid, rowid);
+            return true;
+        }
+        case OP_DELETE: {
+            auto rowid = static_cast<int64_t>(reader->u64());
+            auto it = tables_.find(table);
+            if (it == tables_.end()) return false;
+            auto row = it->second.rows.find(rowid);
+            if (row != it->second.rows.end()) {
+                it->second.unindex(rowid, *row->second);
+                it->second.rows.erase(row);
+            }
+            return !reader->bad();
+        }
+        case OP_RENAME: {
+            auto name = reader->str();
+            auto it = tables_.find(table);
+            if (reader->bad() || it == tables_.end() || tables_.count(name)) {
+                return false;
+            }
+            tables_[name] = std::move(it->second);
+            tables_.erase(table);
+            return true;
+        }
+        case OP_COLUMN: {
+            ColumnInfo column;
+            column.name = reader->str();
+            column.type = static_cast<Type>(reader->u8());
+            column.primary_key = false;
+            column.unique = false;
+            column.not_null = false;
+            auto it = tables_.find(table);
+            if (reader->bad() || it == tables_.end()) return false;
+            auto& t = it->second;
+            t.columns.push_back(column);
+            // Rows are shared with open snapshots, replace instead of modify
+            for (auto& pair : t.rows) {
+                auto row = std::make_shared<Row>(*pair.second);
+                row->emplace_back();
+                pair.second = row;
+            }
+            return true;
+        }
+        case OP_TEXT: {
+            auto it = tables_.find(table);
+            if (it == tables_.end()) return false;
+            auto& t = it->second;
+            t.text_columns.clear();
+            auto count = reader->u32();
+            for (uint32_t i = 0; !reader->bad() && i < count; i++) {
+                auto column = t.find_column(reader->str());
+                if (column < 0) return false;
+                t.text_columns.push_back(column);
+            }
+            return !reader->bad();
+        }
+        case OP_INDEX: {
+            auto name = reader->str();
+            auto it = tables_.find(table);
+            if (reader->bad() || it == tables_.end()) return false;
+            auto& t = it->second;
+            auto column = t.find_column(name);
+            if (column < 0) return false;
+            auto& index = t.indexes[column];
+            index.clear();
+            for (const auto& pair : t.rows) {
+                index.emplace((*pair.second)[column], pair.first);
+            }
+            return true;
+        }
+        }
+        return false;
+    }
+
+    // Apply all complete records in data. Returns number of bytes used
+    size_t apply_records(const char* data, size_t size) {
+        size_t pos = 0;
+        while (size - pos >= kRecordHeaderSize) {
+            Reader header(data + pos, kRecordHeaderSize);
+            auto const len = header.u32();
+            auto const sum = header.u32();
+            if (size - pos - kRecordHeaderSize < len) break;
+            auto const payload = data + pos + kRecordHeaderSize;
+            if (checksum(payload, len) != sum) break;
+            Reader reader(payload, len);
+            while (!reader.eof()) {
+                if (!apply(&reader)) {
+                    bad_ = true;
+                    error("Corrupt record in " + path_);
+                    return pos;
+                }
+            }
+            pos += kRecordHeaderSize + len;
+        }
+        return pos;
+    }
+
+    static void record(std::string* out, const std::string& payload) {
+        put_u32(out, payload.size());
+        put_u32(out, checksum(payload.data(), payload.size()));
+        out->append(payload);
+    }
+
+    static bool read_header(const char* data, const char* magic,
+                            uint64_t* generation) {
+        if (memcmp(data, magic, 8)) return false;
+        Reader reader(data + 8, 8);
+        *generation = reader.u64();
+        return true;
+    }
+
+    static void header(std::string* out, const char* magic,
+                       uint64_t generation) {
+        out->append(magic, 8);
+        put_u64(out, generation);
+    }
+
+    bool lock(int operation) {
+        while (flock(fd_, operation)) {
+            if (errno == EINTR) continue;
+            error("Unable to lock " + path_ + ": " + strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void unlock() {
+        flock(fd_, LOCK_UN);
+        locked_ = false;
+    }
+
+    bool open_changes() {
+        auto const path = path_ + ".changes";
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            error("Unable to open " + path + ": " + strerror(errno));
+            return false;
+        }
+        // Growing the file is safe to race, the new bytes are zero
+        struct stat buf;
+        if (fstat(fd, &buf) ||
+            (buf.st_size < static_cast<off_t>(sizeof(Changes)) &&
+             ftruncate(fd, sizeof(Changes)))) {
+            error("Unable to size " + path + ": " + strerror(errno));
+            ::close(fd);
+            return false;
+        }
+        auto data = mmap(nullptr, sizeof(Changes), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error("Unable to map " + path + ": " + strerror(errno));
+            return false;
+        }
+        changes_ = reinterpret_cast<Changes*>(data);
+        return true;
+    }
+
+    // Throw away everything in memory and read snapshot and log again
+    bool reload() {
+        tables_.clear();
+        offset_ = 0;
+        generation_ = 0;
+        snapshot_size_ = 0;
+        if (fd_ < 0) return false;
+        bool const was_locked = locked_;
+        if (!was_locked && !lock(LOCK_SH)) return false;
+        bool ret = load();
+        if (!was_locked) flock(fd_, LOCK_UN);
+        if (ret && offset_ == 0) {
+            // Empty log, write a header for it
+            if (!was_locked && !lock(LOCK_EX)) return false;
+            ret = load();
+            if (ret && offset_ == 0) {
+                std::string tmp;
+                header(&tmp, kLogMagic, generation_);
+                ret = pwrite_all(fd_, tmp.data(), tmp.size(), 0);
+                if (ret) offset_ = tmp.size();
+            }
+            if (!was_locked) flock(fd_, LOCK_UN);
+        }
+        return ret;
+    }
+
+    // Must hold a lock
+    bool load() {
+        version_++;
+        tables_.clear();
+        offset_ = 0;
+        seen_changes_ = changes_->load();
+        struct stat buf;
+        if (fstat(fd_, &buf)) return false;
+        uint64_t log_generation = 0;
+        if (buf.st_size > 0) {
+            char tmp[kHeaderSize];
+            if (buf.st_size < static_cast<off_t>(kHeaderSize) ||
+                !pread_all(fd_, tmp, kHeaderSize, 0) ||
+                !read_header(tmp, kLogMagic, &log_generation)) {
+                error("Not a log: " + path_);
+                return false;
+            }
+        }
+        generation_ = log_generation;
+        if (!load_snapshot()) return false;
+        if (buf.st_size == 0) return true;
+        if (generation_ != log_generation) {
+            // Compaction was interrupted, everything in the log is in the
+            // snapshot already. Only fixed if we're the writer.
+            offset_ = buf.st_size;
+            return true;
+        }
+        offset_ = kHeaderSize;
+        return read_log(buf.st_size);
+    }
+
+    bool load_snapshot() {
+        snapshot_size_ = 0;
+        int fd = ::open((path_ + ".snap").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT) return true;
+            error("Unable to open snapshot: " + std::string(strerror(errno)));
+            return false;
+        }
+        struct stat buf;
+        if (fstat(fd, &buf) || buf.st_size < static_cast<off_t>(kHeaderSize)) {
+            ::close(fd);
+            error("Bad snapshot for " + path_);
+            return false;
+        }
+        auto data = mmap(nullptr, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            error("Unable to map snapshot: " + std::string(strerror(errno)));
+            return false;
+        }
+        auto ptr = reinterpret_cast<const char*>(data);
+        uint64_t generation;
+        bool ok = read_header(ptr, kSnapshotMagic, &generation) &&
+            generation >= generation_;
+        if (ok) {
+            size_t const size = buf.st_size - kHeaderSize;
+            ok = apply_records(ptr + kHeaderSize, size) == size && !bad_;
+            generation_ = generation;
+            snapshot_size_ = buf.st_size;
+        }
+        munmap(data, buf.st_size);
+        if (!ok) error("Bad snapshot for " + path_);
+        return ok;
+    }
+
+    bool read_log(off_t size) {
+        if (size <= offset_) return true;
+        std::string data(size - offset_, '\0');
+        if (!pread_all(fd_, &data[0], data.size(), offset_)) return false;
+        offset_ += apply_records(data.data(), data.size());
+        return !bad_;
+    }
+
+    // Read records written by others since last time. Without changes this
+    // is only a read of the mapped counter, and it's skipped inside
+    // transactions.
+    void catch_up() {
+        if (bad_ || transaction_depth_ > 0 || locked_) return;
+        if (changes_->load() == seen_changes_) return;
+        if (!lock(LOCK_SH)) return;
+        update();
+        flock(fd_, LOCK_UN);
+    }
+
+    // Must hold a lock
+    bool update() {
+        auto const changes = changes_->load();
+        struct stat buf;
+        if (fstat(fd_, &buf)) return false;
+        char tmp[kHeaderSize];
+        uint64_t generation;
+        if (buf.st_size < static_cast<off_t>(kHeaderSize) ||
+            !pread_all(fd_, tmp, kHeaderSize, 0) ||
+            !read_header(tmp, kLogMagic, &generation)) {
+            return false;
+        }
+        if (generation == generation_ && buf.st_size >= offset_) {
+            if (!read_log(buf.st_size)) return false;
+            seen_changes_ = changes;
+            return true;
+        }
+        // Log was compacted
+        if (!load()) {
+            bad_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool begin_write() {
+        if (bad_) return false;
+        if (locked_) return true;
+        if (!lock(LOCK_EX)) return false;
+        locked_ = true;
+        struct stat buf;
+        if (!update() || fstat(fd_, &buf)) {
+            unlock();
+            return false;
+        }
+        // Tell readers before anything is written, they wait for the lock
+        // and then read whatever was written. Also covers a writer that
+        // crashes after writing.
+        seen_changes_ = changes_->fetch_add(1) + 1;
+        if (generation_ != log_generation()) {
+            // Finish an interrupted compaction
+            std::string tmp;
+            header(&tmp, kLogMagic, generation_);
+            if (ftruncate(fd_, 0) ||
+                !pwrite_all(fd_, tmp.data(), tmp.size(), 0)) {
+                unlock();
+                return false;
+            }
+            offset_ = tmp.size();
+        } else if (buf.st_size > offset_) {
+            // Remove any partial record left by a crash
+            if (ftruncate(fd_, offset_)) {
+                unlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t log_generation() {
+        char tmp[kHeaderSize];
+        uint64_t generation;
+        if (!pread_all(fd_, tmp, kHeaderSize, 0) ||
+            !read_header(tmp, kLogMagic, &generation)) {
+            return generation_;
+        }
+        return generation;
+    }
+
+    bool end_write(bool ok) {
+        if (!ok) {
+            if (transaction_depth_ > 0) {
+                transaction_failed_ = true;
+            } else {
+                rollback_auto();
+            }
+            return false;
+        }
+        if (transaction_depth_ > 0) return true;
+        return flush();
+    }
+
+    void rollback_auto() {
+        pending_.clear();
+        if (locked_) unlock();
+        if (!reload()) bad_ = true;
+    }
+
+    // Write pending changes to the log and release the write lock
+    bool flush() {
+        if (!locked_) return true;
+        if (!pending_.empty()) {
+            std::string data;
+            record(&data, pending_);
+            if (!pwrite_all(fd_, data.data(), data.size(), offset_) ||
+                fdatasync(fd_)) {
+                error("Unable to write to " + path_ + ": " + strerror(errno));
+                // Remove partial record
+                if (ftruncate(fd_, offset_)) bad_ = true;
+                rollback_auto();
+                return false;
+            }
+            pending_.clear();
+            offset_ += data.size();
+            if (offset_ > kCompactMinSize && offset_ > snapshot_size_) {
+                compact_locked();
+            }
+        }
+        unlock();
+        return true;
+    }
+
+    bool compact() {
+        if (transaction_depth_ > 0) return false;
+        if (!begin_write()) return false;
+        bool ret = compact_locked();
+        unlock();
+        return ret;
+    }
+
+    // Write all tables to a new snapshot and empty the log
+    bool compact_locked() {
+        assert(locked_ && pending_.empty());
+        std::string payload;
+        for (const auto& table : tables_) {
+            put_u8(&payload, OP_CREATE);
+            put_str(&payload, table.first);
+            put_u32(&payload, table.second.columns.size());
+            for (const auto& column : table.second.columns) {
+                put_str(&payload, column.name);
+                put_u8(&payload, static_cast<uint8_t>(column.type));
+                put_u8(&payload, (column.primary_key ? 1 : 0) |
+                       (column.unique ? 2 : 0) |
+                       (column.not_null ? 4 : 0));
+            }
+            if (!table.second.text_columns.empty()) {
+                put_u8(&payload, OP_TEXT);
+                put_str(&payload, table.first);
+                put_u32(&payload, table.second.text_columns.size());
+                for (auto column : table.second.text_columns) {
+                    put_str(&payload, table.second.columns[column].name);
+                }
+            }
+            for (const auto& index : table.second.indexes) {
+                put_u8(&payload, OP_INDEX);
+                put_str(&payload, table.first);
+                put_str(&payload, table.second.columns[index.first].name);
+            }
+            for (const auto& row : table.second.rows) {
+                payload.append(put(table.first, row.first, *row.second));
+            }
+        }
+        std::string data;
+        header(&data, kSnapshotMagic, generation_ + 1);
+        record(&data, payload);
+        auto const tmp = path_ + ".snap.tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0666);
+        if (fd < 0) return false;
+        if (!pwrite_all(fd, data.data(), data.size(), 0) || fsync(fd)) {
+            ::close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        ::close(fd);
+        if (rename(tmp.c_str(), (path_ + ".snap").c_str())) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        generation_++;
+        snapshot_size_ = data.size();
+        // If this fails the next writer will fix it
+        std::string head;
+        header(&head, kLogMagic, generation_);
+        if (ftruncate(fd_, 0) ||
+            !pwrite_all(fd_, head.data(), head.size(), 0) || fdatasync(fd_)) {
+            return false;
+        }
+        offset_ = head.size();
+        return true;
+    }
+
+    void error(const std::string& message) {
+        last_error_ = message;
+    }
+
+    std::string path_;
+    int fd_;
+    bool bad_;
+    std::string last_error_;
+    Changes* changes_;
+    // Value of *changes_ when the log was last read
+    uint64_t seen_changes_;
+    std::map<std::string, Table> tables_;
+    uint64_t generation_;
+    // How far into the log we have read
+    off_t offset_;
+    off_t snapshot_size_;
+    unsigned int transaction_depth_;
+    bool transaction_failed_;
+    // True while holding the write lock
+    bool locked_;
+    // Changes done since the write lock was taken
+    std::string pending_;
+    int64_t last_insert_rowid_;
+    // Incremented for every change applied to tables_
+    int64_t version_;
+};
+
+}  // namespace
+
+// static
+std::unique_ptr<DB> LogDB::open(const std::string& path) {
+    std::unique_ptr<DB> db(new DBImpl());
+    static_cast<DBImpl*>(db.get())->open(path);
+    return db;
+}
+
+// static
+bool LogDB::backup(const std::string& path, const std::string& target) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    // Writers, and so compaction, hold an exclusive lock, so log and
+    // snapshot are consistent while the shared lock is held
+    while (flock(fd, LOCK_SH)) {
+        if (errno != EINTR) {
+            ::close(fd);
+            return false;
+        }
+    }
+    bool ret = true;
+    int snap = ::open((path + ".snap").c_str(), O_RDONLY | O_CLOEXEC);
+    if (snap >= 0) {
+        ret = copy_file(snap, target + ".snap");
+        ::close(snap);
+    } else if (errno == ENOENT) {
+        unlink((target + ".snap").c_str());
+    } else {
+        ret = false;
+    }
+    // The snapshot is written first, a log from an older generation is
+    // ignored when the target is opened
+    if (ret) ret = copy_file(fd, target);
+    flock(fd, LOCK_UN);
+    ::close(fd);
+    return ret;
+}
+
+}  // namespace stuff
@@ -0,0 +1,31 @@
+#ifndef LOG_DB_HH
+#define LOG_DB_HH
+
+#include "db.hh"
+
+#include <memory>
+#include <string>
+
+namespace stuff {
+
+// Append-only storage. Every committed transaction is appended to the log
+// file at path as one checksummed record and all live rows are kept in
+// memory, so reads never touch the disk. The log is compacted into a snapshot
+// file, path + ".snap", that is mmap:ed on open and copied into memory, rows
+// are not served from the mapping.
+// Several processes can share the same files, writers are serialized with
+// flock() and bump a counter in the shared mapped file path + ".changes",
+// readers catch up with new records when the counter changes.
+class LogDB {
+public:
+    static std::unique_ptr<DB> open(const std::string& path);
+
+    // Write a consistent copy of the log at path, and its snapshot, to
+    // target. Writers are blocked while the files are copied.
+    // Returns false in case of error
+    static bool backup(const std::string& path, const std::string& target);
+};
+
+}  // namespace stuff
+
+#endif /* LOG_DB_HH */
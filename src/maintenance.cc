@@ -0,0 +1,123 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "config.hh"
+#include "db.hh"
+#include "event.hh"
+#include "event_utils.hh"
+#include "fsutils.hh"
+#include "log_db.hh"
+#include "sqlite3_db.hh"
+#include "strutils.hh"
+
+using namespace stuff;
+
+namespace {
+
+// Pause between batches so that requests waiting for the lock get a chance
+useconds_t const BATCH_PAUSE_USEC = 10000;
+
+bool maintain(const std::string& path, long retention_days, size_t batch,
+              int64_t vacuum_pages, bool rebuild_stats) {
+    std::unique_ptr<DB> db;
+    if (ends_with(path, ".log")) {
+        db = LogDB::open(path);
+    } else {
+        db = SQLite3::open(path);
+    }
+    if (!db || db->bad()) {
+        std::cerr << path << ": Unable to open database" << std::endl;
+        return false;
+    }
+    if (!Event::setup(db.get())) {
+        std::cerr << path << ": Unable to setup database: "
+                  << db->last_error() << std::endl;
+        return false;
+    }
+    if (rebuild_stats && !Event::rebuild_stats(db.get())) {
+        std::cerr << path << ": Unable to rebuild statistics: "
+                  << db->last_error() << std::endl;
+        return false;
+    }
+    if (retention_days >= 0) {
+        time_t before = time(NULL) -
+            retention_days * EventUtils::ONE_DAY_IN_SEC;
+        while (true) {
+            auto removed = Event::expire(db.get(), before, batch);
+            if (removed < 0) {
+                std::cerr << path << ": Unable to expire events: "
+                          << db->last_error() << std::endl;
+                return false;
+            }
+            if (removed > 0 && !db->incremental_vacuum(vacuum_pages)) {
+                std::cerr << path << ": Vacuum failed: "
+                          << db->last_error() << std::endl;
+                return false;
+            }
+            if (static_cast<size_t>(removed) < batch) break;
+            usleep(BATCH_PAUSE_USEC);
+        }
+    }
+    if (!db->incremental_vacuum(vacuum_pages)) {
+        std::cerr << path << ": Vacuum failed: " << db->last_error()
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // Count the statistics again from the events that are left, before
+    // any are expired
+    bool rebuild_stats = false;
+    if (argc > 1 && std::string(argv[1]) == "--rebuild-stats") {
+        rebuild_stats = true;
+        argc--;
+        argv++;
+    }
+    if (argc > 2) {
+        std::cerr << "Usage: `maintenance [--rebuild-stats] [CONFIG]`"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto cfg = Config::create();
+    if (argc == 2) {
+        if (!cfg->load(argv[1])) {
+            std::cerr << "Error loading config: " << argv[1] << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!cfg->load("./event.config")) {
+        cfg->load(SYSCONFDIR "/event.config");
+    }
+    // Number of days to keep events after they started, negative to keep
+    // them forever
+    auto const retention_days = cfg->get_long("retention_days", -1);
+    auto const batch = cfg->get_long("retention_batch", 100);
+    auto const vacuum_pages = cfg->get_long("vacuum_pages", 256);
+    if (batch <= 0 || vacuum_pages <= 0) {
+        std::cerr << "retention_batch and vacuum_pages must be positive"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto const path = EventUtils::db_path(cfg.get());
+    std::vector<std::string> files;
+    if (!list_dir(path, &files)) {
+        std::cerr << "Unable to list " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    int ret = EXIT_SUCCESS;
+    for (const auto& file : files) {
+        if (!ends_with(file, ".db") && !ends_with(file, ".log")) continue;
+        if (!maintain(path + "/" + file, retention_days, batch,
+                      vacuum_pages, rebuild_stats)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    return ret;
+}
@@ -1,14 +1,18 @@
 #include "common.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <cinttypes>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include "auth.hh"
 #include "cgi.hh"
 #include "config.hh"
+#include "date.hh"
 #include "db.hh"
 #include "event.hh"
 #include "event_utils.hh"
@@ -113,6 +117,129 @@ private:
     std::string content_;
 };
 
+// iCalendar (RFC 5545) feed, everything is written straight into the
+// response
+class Feed {
+public:
+    Feed(const std::string& channel)
+        : channel_(channel), column_(0) {
+        content_.reserve(8192);
+        line("BEGIN", "VCALENDAR");
+        line("VERSION", "2.0");
+        begin("PRODID");
+        text("-//stuff//event ");
+        text(channel_);
+        text("//EN");
+        end();
+        line("CALSCALE", "GREGORIAN");
+        begin("X-WR-CALNAME");
+        text(channel_);
+        end();
+    }
+
+    void event(const Event& event, time_t stamp) {
+        char tmp[100];
+        line("BEGIN", "VEVENT");
+        begin("UID");
+        snprintf(tmp, sizeof(tmp), "%" PRId64 ".", event.id());
+        text(tmp);
+        text(channel_);
+        text("@stuff");
+        end();
+        begin("DTSTAMP");
+        date(stamp);
+        end();
+        begin("DTSTART");
+        date(event.start());
+        end();
+        begin("SUMMARY");
+        text(event.name());
+        end();
+        if (!event.text().empty()) {
+            begin("DESCRIPTION");
+            text(event.text());
+            end();
+        }
+        line("END", "VEVENT");
+    }
+
+    // Ends the calendar and sends it, nothing is sent without it
+    void send() {
+        line("END", "VCALENDAR");
+        std::map<std::string, std::string> headers;
+        headers.insert(
+                std::make_pair("Content-Type", "text/calendar; charset=utf-8"));
+        Http::response(200, headers, content_);
+    }
+
+private:
+    void line(const char* name, const char* value) {
+        begin(name);
+        text(value);
+        end();
+    }
+
+    void begin(const char* name) {
+        content_.append(name);
+        content_.push_back(':');
+        column_ = strlen(name) + 1;
+    }
+
+    void end() {
+        content_.append("\r\n");
+    }
+
+    void text(const char* str) {
+        for (; *str; ++str) escape(*str);
+    }
+
+    void text(const std::string& str) {
+        for (auto c : str) escape(c);
+    }
+
+    void date(time_t date) {
+        struct tm tm;
+        char tmp[20];
+        gmtime_r(&date, &tm);
+        auto len = strftime(tmp, sizeof(tmp), "%Y%m%dT%H%M%SZ", &tm);
+        for (size_t i = 0; i < len; i++) put(tmp[i]);
+    }
+
+    void escape(char c) {
+        switch (c) {
+        case '\\':
+        case ';':
+        case ',':
+            put('\\');
+            put(c);
+            break;
+        case '\n':
+            put('\\');
+            put('n');
+            break;
+        case '\r':
+            break;
+        default:
+            put(c);
+            break;
+        }
+    }
+
+    // Lines are folded at 75 octets, but not inside an UTF-8 sequence
+    void put(char c) {
+        if (column_ >= 75 && (c & 0xc0) != 0x80) {
+            content_.append("\r\n ");
+            column_ = 1;
+        }
+        content_.push_back(c);
+        column_++;
+    }
+
+    std::string const channel_;
+    std::string content_;
+    size_t column_;
+};
+
 void error_response(const std::string& message) {
     g_page->write("<h2>Error</h2>");
     g_page->write("<p>");
@@ -120,6 +247,15 @@ void error_response(const std::string& message) {
     g_page->write("</p>");
 }
 
+// The feed has no Page to write errors to, the first error is the response
+bool g_feed_failed;
+
+void feed_error_response(const std::string& message) {
+    if (g_feed_failed) return;
+    g_feed_failed = true;
+    Http::response(500, message);
+}
+
 std::string get_channel(CGI* cgi) {
     auto path = cgi->request_path();
     if (path.empty()) return path;
@@ -132,6 +268,7 @@ std::string get_channel(CGI* cgi) {
 
 bool show(CGI* cgi, EventUtils* utils, const std::string& user) {
     Page page(utils->channel());
+    EventUtils::ReadTransaction transaction(utils);
     auto event = utils->next();
     if (!utils->good()) return true;
     if (!event) {
@@ -146,23 +283,31 @@ bool show(CGI* cgi, EventUtils* utils, const std::string& user) {
     page.write("<p>");
     page.write_safe(event->text());
     page.write("</p>");
+    if (event->capacity()) {
+        page.write("<p>");
+        page.write(std::to_string(event->going_count()));
+        page.write(" of ");
+        page.write(std::to_string(event->capacity()));
+        page.write(" seats taken</p>");
+    }
     std::vector<Event::Going> going;
     event->going(&going);
     int8_t state = 0;
     std::string note;
+    Event::Going mine("", false, "", 0);
+    if (event->find_going(user, &mine)) {
+        state = mine.is_going ? 1 : -1;
+        note = mine.note;
+    }
     if (going.empty()) {
         page.write("<p>Expect no-one</p>");
     } else {
         page.write("<p id=\"going\">");
         auto it = going.begin();
         for (; it != going.end(); ++it) {
-            if (!it->is_going) break;
-            if (it->name == user) {
-                state = 1;
-                note = it->note;
-            }
+            if (!it->is_going || it->waiting) break;
             page.write("<span class=\"name\">");
-            page.write_safe(it->name);
+            page.write_safe(it->name());
             page.write("</span>");
             if (!it->note.empty()) {
                 page.write("&nbsp;<span class=\"note\">");
@@ -171,15 +316,25 @@ bool show(CGI* cgi, EventUtils* utils, const std::string& user) {
             }
             page.write("<br>");
         }
+        if (it != going.end() && it->waiting) {
+            page.write("</p><h3>Waitlist</h3><p id=\"waiting\">");
+            for (; it != going.end() && it->waiting; ++it) {
+                page.write("<span class=\"name\">");
+                page.write_safe(it->name());
+                page.write("</span>");
+                if (!it->note.empty()) {
+                    page.write("&nbsp;<span class=\"note\">");
+                    page.write_safe(it->note);
+                    page.write("</span>");
+                }
+                page.write("<br>");
+            }
+        }
         if (it != going.end()) {
             page.write("</p><h3>Not going</h3><p id=\"not_going\">");
             for (; it != going.end(); ++it) {
-                if (it->name == user) {
-                    state = -1;
-                    note = it->note;
-                }
                 page.write("<span class=\"name\">");
-                page.write_safe(it->name);
+                page.write_safe(it->name());
                 page.write("</span>");
                 if (!it->note.empty()) {
                     page.write("&nbsp;<span class=\"note\">");
@@ -223,6 +378,109 @@ bool show(CGI* cgi, EventUtils* utils, const std::string& user) {
     return true;
 }
 
+bool feed(EventUtils* utils) {
+    static const time_t kFeedPast = 30 * 24 * 60 * 60;
+    static const time_t kFeedAhead = 180 * 24 * 60 * 60;
+    auto const now = time(NULL);
+    EventUtils::ReadTransaction transaction(utils);
+    auto events = utils->between(now - kFeedPast, now + kFeedAhead);
+    if (!utils->good()) {
+        feed_error_response("Unable to read events");
+        return true;
+    }
+    Feed feed(utils->channel());
+    for (const auto& event : events) {
+        feed.event(*event, now);
+    }
+    feed.send();
+    return true;
+}
+
+// Upcoming events from several channels merged by start. The channels are
+// read in parallel, so the page takes about as long as the slowest channel
+bool dashboard(const std::vector<std::string>& channels) {
+    // Events shown, also the most read from each channel
+    static const size_t kDashboardEvents = 20;
+    auto const jobs = g_cfg ? g_cfg->get_long("dashboard_jobs", 4) : 4;
+    struct Result {
+        std::vector<Event::Header> headers;
+        bool good;
+    };
+    std::vector<Result> results(channels.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        while (true) {
+            auto const index = next++;
+            if (index >= channels.size()) break;
+            results[index].good = EventUtils::headers(
+                    channels[index], g_cfg.get(), kDashboardEvents,
+                    &results[index].headers);
+        }
+    };
+    std::vector<std::thread> threads;
+    auto const count = std::min(static_cast<size_t>(std::max(jobs, 1l)),
+                                channels.size());
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Channel index and event, same start and name are shown in the order
+    // the channels were given
+    std::vector<std::pair<size_t, const Event::Header*>> events;
+    for (size_t i = 0; i < results.size(); i++) {
+        for (const auto& header : results[i].headers) {
+            events.emplace_back(i, &header);
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const std::pair<size_t, const Event::Header*>& e1,
+                        const std::pair<size_t, const Event::Header*>& e2) {
+                         if (e1.second->start != e2.second->start) {
+                             return e1.second->start < e2.second->start;
+                         }
+                         return e1.second->name < e2.second->name;
+                     });
+    if (events.size() > kDashboardEvents) events.resize(kDashboardEvents);
+
+    std::string title;
+    for (const auto& channel : channels) {
+        if (!title.empty()) title.append(", ");
+        title.append(channel);
+    }
+    Page page(title);
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].good) continue;
+        page.write("<p class=\"error\">Unable to read ");
+        page.write_safe(channels[i]);
+        page.write("</p>");
+    }
+    if (events.empty()) {
+        page.write("<h2>No event scheduled</h2>");
+        return true;
+    }
+    Date::Formatter formatter(time(NULL));
+    page.write("<table id=\"upcoming\">");
+    for (const auto& event : events) {
+        page.write("<tr><td class=\"date\">");
+        page.write_safe(formatter.format(event.second->start));
+        page.write("</td><td class=\"name\"><a href=\"");
+        page.write_safe(channels[event.first]);
+        page.write("\">");
+        page.write_safe(event.second->name);
+        page.write("</a></td><td class=\"channel\">");
+        page.write_safe(channels[event.first]);
+        page.write("</td><td class=\"going\">");
+        page.write(std::to_string(event.second->going_count));
+        page.write("</td></tr>");
+    }
+    page.write("</table>");
+    return true;
+}
+
 bool going(CGI* cgi, EventUtils* utils, const std::string& user,
            const std::map<std::string, std::string>& data) {
     bool const is_going = !data.at("going").empty();
@@ -258,6 +516,15 @@ bool going(CGI* cgi, EventUtils* utils, const std::string& user,
     return true;
 }
 
+// Returns false if channel isn't configured
+bool get_passwd(const std::string& channel, std::string* passwd) {
+    if (!g_cfg) return false;
+    *passwd = g_cfg->get(channel, "bad");
+    if (*passwd != "bad") return true;
+    *passwd = g_cfg->get(channel, "bad2");
+    return *passwd != "bad2";
+}
+
 bool handle_request(CGI* cgi) {
     switch (cgi->request_type()) {
     case CGI::GET:
@@ -268,22 +535,36 @@ bool handle_request(CGI* cgi) {
         return true;
     }
     auto channel = get_channel(cgi);
-    if (channel.empty()) {
+    // channel.ics is the calendar feed
+    static const std::string kFeedSuffix = ".ics";
+    bool const is_feed = channel.size() > kFeedSuffix.size() &&
+        channel.compare(channel.size() - kFeedSuffix.size(),
+                        kFeedSuffix.size(), kFeedSuffix) == 0;
+    if (is_feed) channel.resize(channel.size() - kFeedSuffix.size());
+    // channel1+channel2+... shows the upcoming events in all of them
+    std::vector<std::string> channels;
+    if (!is_feed) {
+        size_t start = 0;
+        while (true) {
+            auto const end = channel.find('+', start);
+            channels.push_back(channel.substr(start, end - start));
+            if (end == std::string::npos) break;
+            start = end + 1;
+        }
+    }
+    if (channel.empty() ||
+        std::find(channels.begin(), channels.end(), "") != channels.end()) {
         Http::response(500, "Bad channel");
         return true;
     }
     std::string passwd;
-    bool ok_passwd = false;
-    if (g_cfg) {
-        passwd = g_cfg->get(channel, "bad");
-        if (passwd != "bad") {
-            ok_passwd = true;
-        } else {
-            passwd = g_cfg->get(channel, "bad2");
-            if (passwd != "bad2") {
-                ok_passwd = true;
-            }
-        }
+    bool ok_passwd = get_passwd(is_feed ? channel : channels.front(),
+                                &passwd);
+    // Several channels only if they all have the same password, anyone that
+    // knows it can see each of them anyway
+    for (size_t i = 1; ok_passwd && i < channels.size(); i++) {
+        std::string tmp;
+        ok_passwd = get_passwd(channels[i], &tmp) && tmp == passwd;
     }
     if (!ok_passwd) {
         Http::response(500, "Bad channel");
@@ -293,6 +574,13 @@ bool handle_request(CGI* cgi) {
     if (!Auth::auth(cgi, "Event for " + channel, passwd, &user)) {
         return true;
     }
+    if (channels.size() > 1) return dashboard(channels);
+    if (is_feed) {
+        g_feed_failed = false;
+        auto utils = EventUtils::create(channel, feed_error_response,
+                                        g_cfg.get(), g_sender.get());
+        return feed(utils.get());
+    }
     auto utils = EventUtils::create(channel, error_response, g_cfg.get(),
                                     g_sender.get());
     std::map<std::string, std::string> data;
@@ -0,0 +1,316 @@
+#include "common.hh"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "reminders.hh"
+#include "timer_wheel.hh"
+
+namespace stuff {
+
+namespace {
+
+// Reminders read back on open that are later than this are dropped
+const time_t kLate = 5 * 60;
+// Journal records allowed on top of two per reminder before compacting
+const size_t kCompactSlack = 1024;
+
+void put32(std::string* out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out->push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+}
+
+void put64(std::string* out, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out->push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+}
+
+uint64_t get(const std::string& data, size_t pos, size_t bytes) {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        ret = (ret << 8) | static_cast<uint8_t>(data[pos + i]);
+    }
+    return ret;
+}
+
+// The same local time days days later
+time_t repeat(time_t at, uint32_t days) {
+    struct tm tm;
+    localtime_r(&at, &tm);
+    tm.tm_mday += days;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Skip repeats that are already gone, unless it's the last one
+void skip(Reminders::Reminder* reminder, time_t now) {
+    if (!reminder->days) return;
+    while (reminder->at < now) {
+        auto const next = repeat(reminder->at, reminder->days);
+        if (reminder->until && next > reminder->until) break;
+        reminder->at = next;
+    }
+}
+
+bool write_all(int fd, const std::string& data) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        auto ret = write(fd, data.data() + pos, data.size() - pos);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        pos += ret;
+    }
+    return true;
+}
+
+class RemindersImpl : public Reminders {
+public:
+    RemindersImpl(const std::string& path, time_t now)
+        : path_(path), wheel_(now), fd_(-1), records_(0), loading_(false) {
+    }
+
+    ~RemindersImpl() override {
+        if (fd_ != -1) close(fd_);
+    }
+
+    bool open() {
+        if (path_.empty()) return true;
+        int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            std::string data;
+            char buf[8192];
+            while (true) {
+                auto ret = read(fd, buf, sizeof(buf));
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    close(fd);
+                    return false;
+                }
+                if (ret == 0) break;
+                data.append(buf, ret);
+            }
+            close(fd);
+            load(data);
+        } else if (errno != ENOENT) {
+            return false;
+        }
+        return compact();
+    }
+
+    bool update(const std::string& channel,
+                const Reminder& reminder) override {
+        auto const key = make_key(channel, reminder.id);
+        auto it = index_.find(key);
+        if (reminder.at == 0) {
+            if (it == index_.end()) return true;
+            auto const index = it->second;
+            wheel_.remove(index);
+            release(index);
+        } else {
+            uint32_t index;
+            if (it == index_.end()) {
+                if (free_.empty()) {
+                    index = entries_.size();
+                    entries_.emplace_back();
+                } else {
+                    index = free_.back();
+                    free_.pop_back();
+                }
+                index_.emplace(key, index);
+            } else {
+                index = it->second;
+            }
+            auto& entry = entries_[index];
+            entry.channel = channel;
+            entry.reminder = reminder;
+            skip(&entry.reminder, wheel_.now());
+            wheel_.add(index, entry.reminder.at);
+        }
+        return journal(channel, reminder);
+    }
+
+    void advance(
+            time_t now,
+            const std::function<void(const std::string& channel,
+                                     const std::string& message)>& send)
+        override {
+        wheel_.advance(now, [&](uint32_t index) {
+                auto const channel = entries_[index].channel;
+                auto reminder = entries_[index].reminder;
+                send(channel, reminder.message);
+                if (reminder.days) {
+                    reminder.at = repeat(reminder.at, reminder.days);
+                    if (reminder.until && reminder.at > reminder.until) {
+                        reminder.at = 0;
+                    }
+                } else {
+                    reminder.at = 0;
+                }
+                update(channel, reminder);
+            });
+    }
+
+    long timeout() const override {
+        return wheel_.timeout();
+    }
+
+    size_t size() const override {
+        return index_.size();
+    }
+
+private:
+    struct Entry {
+        std::string channel;
+        Reminder reminder;
+    };
+
+    static std::string make_key(const std::string& channel, int64_t id) {
+        std::string key;
+        key.reserve(8 + channel.size());
+        put64(&key, id);
+        key.append(channel);
+        return key;
+    }
+
+    void release(uint32_t index) {
+        auto& entry = entries_[index];
+        index_.erase(make_key(entry.channel, entry.reminder.id));
+        entry.channel.clear();
+        entry.reminder = Reminder();
+        free_.push_back(index);
+    }
+
+    // Journal records are the channel and the encoded reminder, each with
+    // the size in front. The same as the frames SenderClient sends.
+    static void record(const std::string& channel, const Reminder& reminder,
+                       std::string* out) {
+        std::string data;
+        encode(reminder, &data);
+        put32(out, channel.size());
+        out->append(channel);
+        put32(out, data.size());
+        out->append(data);
+    }
+
+    void load(const std::string& data) {
+        auto const now = wheel_.now();
+        loading_ = true;
+        size_t pos = 0;
+        // A record cut short at the end is what a crash while writing it
+        // leaves, ignore it
+        while (data.size() - pos >= 4) {
+            auto const channel_size = get(data, pos, 4);
+            if (data.size() - pos - 4 < channel_size + 4) break;
+            auto const channel = data.substr(pos + 4, channel_size);
+            pos += 4 + channel_size;
+            auto const size = get(data, pos, 4);
+            if (data.size() - pos - 4 < size) break;
+            Reminder reminder;
+            if (decode(data.substr(pos + 4, size), &reminder)) {
+                skip(&reminder, now);
+                if (reminder.at && reminder.at < now - kLate) {
+                    reminder.at = 0;
+                }
+                update(channel, reminder);
+            }
+            pos += 4 + size;
+        }
+        loading_ = false;
+    }
+
+    bool journal(const std::string& channel, const Reminder& reminder) {
+        if (loading_ || path_.empty()) return true;
+        if (records_ > index_.size() * 2 + kCompactSlack) return compact();
+        std::string data;
+        record(channel, reminder, &data);
+        if (fd_ == -1 || !write_all(fd_, data)) return false;
+        records_++;
+        return true;
+    }
+
+    // Write the live reminders to a new file and replace the old one
+    bool compact() {
+        std::string data;
+        for (const auto& pair : index_) {
+            const auto& entry = entries_[pair.second];
+            record(entry.channel, entry.reminder, &data);
+        }
+        auto const tmp = path_ + ".new";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0600);
+        if (fd == -1) return false;
+        if (!write_all(fd, data) || fsync(fd)) {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        close(fd);
+        if (rename(tmp.c_str(), path_.c_str())) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        if (fd_ != -1) close(fd_);
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd_ == -1) return false;
+        records_ = index_.size();
+        return true;
+    }
+
+    std::string const path_;
+    TimerWheel wheel_;
+    // Indexed by the timer ids in wheel_
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> free_;
+    std::unordered_map<std::string, uint32_t> index_;
+    int fd_;
+    size_t records_;
+    bool loading_;
+};
+
+}  // namespace
+
+// static
+std::unique_ptr<Reminders> Reminders::open(const std::string& path,
+                                           time_t now) {
+    std::unique_ptr<RemindersImpl> ret(new RemindersImpl(path, now));
+    if (!ret->open()) return nullptr;
+    return ret;
+}
+
+// static
+void Reminders::encode(const Reminder& reminder, std::string* out) {
+    put64(out, reminder.id);
+    put64(out, reminder.at);
+    if (reminder.at == 0) return;
+    put32(out, reminder.days);
+    put64(out, reminder.until);
+    out->append(reminder.message);
+}
+
+// static
+bool Reminders::decode(const std::string& data, Reminder* reminder) {
+    if (data.size() < 16) return false;
+    reminder->id = get(data, 0, 8);
+    reminder->at = get(data, 8, 8);
+    if (reminder->at == 0) {
+        reminder->days = 0;
+        reminder->until = 0;
+        reminder->message.clear();
+        return data.size() == 16;
+    }
+    if (data.size() < 28) return false;
+    reminder->days = get(data, 16, 4);
+    reminder->until = get(data, 20, 8);
+    reminder->message = data.substr(28);
+    return true;
+}
+
+}  // namespace stuff
@@ -0,0 +1,72 @@
+#ifndef REMINDERS_HH
+#define REMINDERS_HH
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace stuff {
+
+// Messages to send to a channel at a given time, kept by the sender.
+// Reminders are identified by channel and id, adding one with the same
+// channel and id replaces it.
+class Reminders {
+public:
+    struct Reminder {
+        int64_t id;
+        // Time to send message, 0 to remove the reminder
+        time_t at;
+        // Repeat every days days, at the same local time, until until.
+        // 0 days for only once, 0 until for forever
+        uint32_t days;
+        time_t until;
+        std::string message;
+
+        Reminder()
+            : id(0), at(0), days(0), until(0) {
+        }
+    };
+
+    virtual ~Reminders() {}
+
+    // Add, replace or, if at is 0, remove a reminder
+    virtual bool update(const std::string& channel,
+                        const Reminder& reminder) = 0;
+
+    // Send the reminders due at now
+    virtual void advance(
+            time_t now,
+            const std::function<void(const std::string& channel,
+                                     const std::string& message)>& send) = 0;
+
+    // Seconds until advance() needs to be called again, -1 if there are no
+    // reminders
+    virtual long timeout() const = 0;
+
+    virtual size_t size() const = 0;
+
+    // Reminders are kept in memory and journaled in the file at path, which
+    // is compacted now and then. Reminders are read back from it on open,
+    // the ones that are more than a few minutes late are dropped.
+    // Empty path to only keep them in memory. Returns nullptr in case of
+    // error
+    static std::unique_ptr<Reminders> open(const std::string& path,
+                                           time_t now);
+
+    // Reminders are sent from SenderClient using this encoding
+    static void encode(const Reminder& reminder, std::string* out);
+    static bool decode(const std::string& data, Reminder* reminder);
+
+protected:
+    Reminders() {}
+
+private:
+    Reminders(const Reminders&) = delete;
+    Reminders& operator=(const Reminders&) = delete;
+};
+
+}  // namespace stuff
+
+#endif /* REMINDERS_HH */
@@ -11,6 +11,7 @@
 #include <netdb.h>
 #include <syslog.h>
 #include <time.h>
+#include <memory>
 #include <unistd.h>
 #include <vector>
 
@@ -18,6 +19,8 @@
 
 #include "config.hh"
 #include "json.hh"
+#include "reminders.hh"
+#include "sender_reader.hh"
 #include "sockutils.hh"
 
 /*
@@ -38,107 +41,6 @@ using namespace stuff;
 
 namespace {
 
-void queue_message(const std::string& channel, const std::string& message);
-
-class Client {
-public:
-    Client(int sock)
-        : sock_(sock), fill_(0), have_channel_(false), size_(0) {
-    }
-
-    int sock() const {
-        return sock_.get();
-    }
-
-    bool read() {
-        while (true) {
-            char buf[1024];
-            auto ret = ::read(sock_.get(), buf, sizeof(buf));
-            if (ret < 0) {
-                if (errno == EINTR) continue;
-                return errno == EWOULDBLOCK || errno == EAGAIN;
-            }
-            if (ret == 0) {
-                return false;
-            }
-            size_t pos = 0;
-            auto const fill = static_cast<size_t>(ret);
-            while (pos < fill) {
-                if (!have_channel_) {
-                    if (size_ == 0) {
-                        auto const avail = std::min(fill - pos,
-                                                    static_cast<size_t>(4));
-                        memcpy(buf_ + fill_, buf + pos, avail);
-                        fill_ += avail;
-                        pos += avail;
-                        if (fill_ == 4) {
-                            fill_ = 0;
-                            memcpy(&size_, buf_, 4);
-                            size_ = ntohl(size_);
-                            if (size_ == 0) {
-                                have_channel_ = true;
-                            }
-                        }
-                    } else {
-                        auto const avail = std::min(fill - pos,
-                                                    size_ - channel_.size());
-                        channel_.append(buf + pos, buf + pos + avail);
-                        pos += avail;
-                        if (channel_.size() == size_) {
-                            have_channel_ = true;
-                            size_ = 0;
-                        }
-                    }
-                } else {
-                    if (size_ == 0) {
-                        auto const avail = std::min(fill - pos,
-                                                    static_cast<size_t>(4));
-                        memcpy(buf_ + fill_, buf + pos, avail);
-                        fill_ += avail;
-                        pos += avail;
-                        if (fill_ == 4) {
-                            fill_ = 0;
-                            memcpy(&size_, buf_, 4);
-                            size_ = ntohl(size_);
-                            if (size_ == 0) {
-                                send_message();
-                            }
-                        }
-                    } else {
-                        auto const avail = std::min(fill - pos,
-                                                    size_ - message_.size());
-                        message_.append(buf + pos, buf + pos + avail);
-                        pos += avail;
-                        if (message_.size() == size_) {
-                            send_message();
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-private:
-    void send_message() {
-        assert(have_channel_);
-        queue_message(channel_, message_);
-        have_channel_ = false;
-        size_ = 0;
-        channel_.clear();
-        message_.clear();
-    }
-
-    sockguard sock_;
-
-    char buf_[4];
-    size_t fill_;
-
-    bool have_channel_;
-    uint32_t size_;
-    std::string channel_;
-    std::string message_;
-};
-
 size_t ignore_all(char* ptr, size_t size, size_t nmemb, void* userdata) {
     return size * nmemb;
 }
@@ -195,9 +97,12 @@ struct Info {
     std::string icon_emoji;
 
     std::string url;
+    std::string reminders_path;
 
     CURLM* multi;
 
+    std::unique_ptr<Reminders> reminders;
+
     std::vector<Request> requests;
 };
 
@@ -217,6 +122,17 @@ void queue_message(const std::string& channel, const std::string& message) {
     g_info.requests.emplace_back(g_info.multi, g_info.url, obj->str());
 }
 
+void queue_reminder(const std::string& channel, const std::string& data) {
+    Reminders::Reminder reminder;
+    if (!Reminders::decode(data, &reminder)) {
+        syslog(LOG_WARNING, "Invalid reminder for: %s", channel.c_str());
+        return;
+    }
+    if (!g_info.reminders->update(channel, reminder)) {
+        syslog(LOG_WARNING, "Unable to save reminders: %s", strerror(errno));
+    }
+}
+
 int run(const std::string& listener, int* fd) {
     openlog("sender", LOG_PID, LOG_DAEMON);
 
@@ -230,7 +146,14 @@ int run(const std::string& listener, int* fd) {
         return EXIT_FAILURE;
     }
 
-    std::vector<Client> clients;
+    g_info.reminders = Reminders::open(g_info.reminders_path, time(NULL));
+    if (!g_info.reminders) {
+        syslog(LOG_WARNING, "Unable to open reminders, %s: %s",
+               g_info.reminders_path.c_str(), strerror(errno));
+        g_info.reminders = Reminders::open("", time(NULL));
+    }
+
+    std::vector<SenderReader> clients;
     int still_running;
     int exitvalue;
     sockguard sock_;
@@ -330,6 +253,9 @@ int run(const std::string& listener, int* fd) {
             }
         }
 
+        // No need to look for reminders, the wheel knows when the next is due
+        g_info.reminders->advance(time(NULL), queue_message);
+
         fd_set read_set;
         fd_set write_set;
         fd_set err_set;
@@ -342,6 +268,10 @@ int run(const std::string& listener, int* fd) {
         struct timeval *to = nullptr;
         struct timeval _to;
         curl_multi_timeout(g_info.multi, &timeout);
+        auto const reminder = g_info.reminders->timeout();
+        if (reminder >= 0 && (timeout < 0 || reminder * 1000 < timeout)) {
+            timeout = reminder * 1000;
+        }
         if (timeout >= 0) {
             _to.tv_sec = timeout / 1000;
             _to.tv_usec = (timeout % 1000) * 1000;
@@ -373,7 +303,7 @@ int run(const std::string& listener, int* fd) {
         for (auto it = clients.begin(); ret > 0 && it != clients.end();) {
             if (FD_ISSET(it->sock(), &read_set)) {
                 ret--;
-                if (!it->read()) {
+                if (!it->read(queue_message, queue_reminder)) {
                     it = clients.erase(it);
                 } else {
                     ++it;
@@ -407,6 +337,7 @@ int run(const std::string& listener, int* fd) {
  end:
     clients.clear();
     g_info.requests.clear();
+    g_info.reminders.reset();
     curl_multi_cleanup(g_info.multi);
     curl_global_cleanup();
     unlink(listener.c_str());
@@ -429,6 +360,8 @@ int main() {
     }
     g_info.icon_url = cfg->get("icon_url", "");
     g_info.icon_emoji = cfg->get("icon_emoji", "");
+    g_info.reminders_path = cfg->get("reminders",
+                                     LOCALSTATEDIR "/sender.reminders");
     auto const& listener = cfg->get("listener", "");
     if (listener.empty()) {
         std::cerr << "No listener configured" << std::endl;
@@ -12,6 +12,7 @@
 #include <unistd.h>
 
 #include "config.hh"
+#include "reminders.hh"
 #include "sender_client.hh"
 #include "sockutils.hh"
 
@@ -40,23 +41,57 @@ public:
     }
 
     void send(const std::string& channel, const std::string& message) override {
+        send_frame(channel, message, 0);
+    }
+
+    void remind(const std::string& channel, int64_t id, time_t at,
+                unsigned int days, time_t until,
+                const std::string& message) override {
+        Reminders::Reminder reminder;
+        reminder.id = id;
+        reminder.at = at;
+        reminder.days = days;
+        reminder.until = until;
+        reminder.message = message;
+        send_reminder(channel, reminder);
+    }
+
+    void forget(const std::string& channel, int64_t id) override {
+        Reminders::Reminder reminder;
+        reminder.id = id;
+        send_reminder(channel, reminder);
+    }
+
+private:
+    void send_reminder(const std::string& channel,
+                       const Reminders::Reminder& reminder) {
+        std::string data;
+        Reminders::encode(reminder, &data);
+        send_frame(channel, data, kReminderFrame);
+    }
+
+    void send_frame(const std::string& channel, const std::string& message,
+                    uint32_t flags) {
         struct timeval target;
         gettimeofday(&target, NULL);
         target.tv_sec += WRITE_TIMEOUT;
 
-        send(channel, message, &target);
+        send_frame(channel, message, flags, &target, true);
     }
 
-private:
-    void send(const std::string& channel, const std::string& message,
-              const struct timeval* target) {
+    // On error the connection is opened again and the frame sent once more
+    // if retry is set
+    void send_frame(const std::string& channel, const std::string& message,
+                    uint32_t flags, const struct timeval* target,
+                    bool retry) {
         if (!sock_) {
             if (!setup()) return;
         }
 
-        uint32_t size1 = channel.size();
+        // flags are only in the size sent, not in the bytes to send
+        size_t pos = 0, len = 8 + channel.size() + message.size();
+        uint32_t size1 = channel.size() | flags;
         uint32_t size2 = message.size();
-        size_t pos = 0, len = 8 + size1 + size2;
         size1 = htonl(size1);
         size2 = htonl(size2);
         while (pos < len) {
@@ -99,7 +134,10 @@ private:
                 if (errno == EINTR) continue;
                 if (errno != EAGAIN && errno != EWOULDBLOCK) {
                     sock_.reset();
-                    return send(channel, message);
+                    if (retry) {
+                        send_frame(channel, message, flags, target, false);
+                    }
+                    return;
                 }
             }
 
@@ -118,7 +156,10 @@ private:
                 if (ret <= 0) {
                     // Timeout or error
                     sock_.reset();
-                    return send(channel, message);
+                    if (retry) {
+                        send_frame(channel, message, flags, target, false);
+                    }
+                    return;
                 }
                 break;
             }
@@ -1,6 +1,8 @@
 #ifndef SENDER_CLIENT_HH
 #define SENDER_CLIENT_HH
 
+#include <cstdint>
+#include <ctime>
 #include <memory>
 #include <string>
 
@@ -26,6 +28,18 @@ public:
     virtual void send(const std::string& channel,
                       const std::string& message) = 0;
 
+    // Have the sender send message to channel at time at, replacing any
+    // earlier reminder with the same id for the channel. If days isn't 0
+    // the reminder repeats every days days until until, or forever if 0
+    virtual void remind(const std::string& channel, int64_t id, time_t at,
+                        unsigned int days, time_t until,
+                        const std::string& message) = 0;
+    // Remove the reminder with id for the channel, if any
+    virtual void forget(const std::string& channel, int64_t id) = 0;
+
+    // Set in the channel size of the frames carrying reminders
+    static const uint32_t kReminderFrame = 0x80000000;
+
     static std::unique_ptr<SenderClient> create(
             const Config* config, std::shared_ptr<Error> error = nullptr);
 
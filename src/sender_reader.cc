@@ -0,0 +1,103 @@
+#include "common.hh"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "sender_client.hh"
+#include "sender_reader.hh"
+
+namespace stuff {
+
+SenderReader::SenderReader(int sock)
+    : sock_(sock), fill_(0), have_channel_(false), reminder_(false),
+      size_(0) {
+}
+
+bool SenderReader::read(const Handler& message, const Handler& reminder) {
+    while (true) {
+        char buf[1024];
+        auto ret = ::read(sock_.get(), buf, sizeof(buf));
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno == EWOULDBLOCK || errno == EAGAIN;
+        }
+        if (ret == 0) {
+            return false;
+        }
+        size_t pos = 0;
+        auto const fill = static_cast<size_t>(ret);
+        while (pos < fill) {
+            if (!have_channel_) {
+                if (size_ == 0) {
+                    auto const avail = std::min(fill - pos,
+                                                4 - fill_);
+                    memcpy(buf_ + fill_, buf + pos, avail);
+                    fill_ += avail;
+                    pos += avail;
+                    if (fill_ == 4) {
+                        fill_ = 0;
+                        memcpy(&size_, buf_, 4);
+                        size_ = ntohl(size_);
+                        reminder_ = size_ & SenderClient::kReminderFrame;
+                        size_ &= ~SenderClient::kReminderFrame;
+                        if (size_ == 0) {
+                            have_channel_ = true;
+                        }
+                    }
+                } else {
+                    auto const avail = std::min(fill - pos,
+                                                size_ - channel_.size());
+                    channel_.append(buf + pos, buf + pos + avail);
+                    pos += avail;
+                    if (channel_.size() == size_) {
+                        have_channel_ = true;
+                        size_ = 0;
+                    }
+                }
+            } else {
+                if (size_ == 0) {
+                    auto const avail = std::min(fill - pos,
+                                                4 - fill_);
+                    memcpy(buf_ + fill_, buf + pos, avail);
+                    fill_ += avail;
+                    pos += avail;
+                    if (fill_ == 4) {
+                        fill_ = 0;
+                        memcpy(&size_, buf_, 4);
+                        size_ = ntohl(size_);
+                        if (size_ == 0) {
+                            done(message, reminder);
+                        }
+                    }
+                } else {
+                    auto const avail = std::min(fill - pos,
+                                                size_ - message_.size());
+                    message_.append(buf + pos, buf + pos + avail);
+                    pos += avail;
+                    if (message_.size() == size_) {
+                        done(message, reminder);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SenderReader::done(const Handler& message, const Handler& reminder) {
+    assert(have_channel_);
+    if (reminder_) {
+        reminder(channel_, message_);
+    } else {
+        message(channel_, message_);
+    }
+    have_channel_ = false;
+    reminder_ = false;
+    size_ = 0;
+    channel_.clear();
+    message_.clear();
+}
+
+}  // namespace stuff
@@ -0,0 +1,47 @@
+#ifndef SENDER_READER_HH
+#define SENDER_READER_HH
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "sockutils.hh"
+
+namespace stuff {
+
+// The sender end of a SenderClient connection, reads the frames written
+// by it from a non-blocking socket
+class SenderReader {
+public:
+    typedef std::function<void(const std::string& channel,
+                               const std::string& data)> Handler;
+
+    // Takes ownership of sock
+    explicit SenderReader(int sock);
+
+    int sock() const {
+        return sock_.get();
+    }
+
+    // Read what is available, calling message or reminder for each complete
+    // frame. Returns false when the connection is closed or failed
+    bool read(const Handler& message, const Handler& reminder);
+
+private:
+    void done(const Handler& message, const Handler& reminder);
+
+    sockguard sock_;
+
+    char buf_[4];
+    size_t fill_;
+
+    bool have_channel_;
+    bool reminder_;
+    uint32_t size_;
+    std::string channel_;
+    std::string message_;
+};
+
+}  // namespace stuff
+
+#endif /* SENDER_READER_HH */
@@ -16,13 +16,13 @@ public:
         : sock_(sock) {
     }
     sockguard(sockguard&& sock)
-        : sock_(sock.sock_) {
+        : sock_(sock.release()) {
     }
     ~sockguard() {
         reset();
     }
     sockguard& operator=(sockguard&& sock) {
-        reset(sock.sock_);
+        reset(sock.release());
         return *this;
     }
     void reset() {
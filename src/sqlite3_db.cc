@@ -2,13 +2,35 @@
 
 #include "sqlite3_db.hh"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <map>
 #include <sqlite3.h>
 
+// json_each() is always built in since 3.38.0, before that IN uses one
+// parameter per value instead
+#define HAVE_JSON_EACH (SQLITE_VERSION_NUMBER >= 3038000)
+
 namespace stuff {
 
 namespace {
 
+// SQLite default, 2000 KiB
+const int64_t kDefaultCacheKiB = 2000;
+// Steps that get SQLITE_BUSY are retried, let SQLite sleep between the
+// tries instead of spinning
+const int kBusyTimeoutMs = 1000;
+// PRAGMA auto_vacuum value for INCREMENTAL
+const int kAutoVacuumIncremental = 2;
+// A backup restarts from the beginning every time another connection
+// writes. Give up after this many restarts rather than block the writers.
+const int kBackupMaxRestarts = 10;
+// Give up a backup after the source has been busy this many times in a row,
+// each after waiting kBusyTimeoutMs
+const int kBackupMaxBusy = 10;
+
 class DeleteStmt {
 public:
     void operator()(sqlite3_stmt* stmt) const {
@@ -18,10 +40,27 @@ public:
 
 typedef std::unique_ptr<sqlite3_stmt,DeleteStmt> unique_stmt;
 
+class CloseDB {
+public:
+    void operator()(sqlite3* db) const {
+        sqlite3_close(db);
+    }
+};
+
+typedef std::unique_ptr<sqlite3,CloseDB> unique_db;
+
 class DBImpl : public DB {
 public:
     DBImpl()
-        : db_(nullptr), bad_(true) {
+        : db_(nullptr), bad_(true), transaction_depth_(0),
+          transaction_failed_(false), data_version_(-1), total_changes_(0),
+          version_(0) {
+    }
+
+    explicit DBImpl(SQLite3::PlanCallback plan_cb)
+        : db_(nullptr), bad_(true), plan_cb_(plan_cb), transaction_depth_(0),
+          transaction_failed_(false), data_version_(-1), total_changes_(0),
+          version_(0) {
     }
 
     ~DBImpl() {
@@ -33,6 +72,7 @@ public:
         int err = sqlite3_open(path.c_str(), &db_);
         if (err == SQLITE_OK) {
             bad_ = false;
+            sqlite3_busy_timeout(db_, kBusyTimeoutMs);
             prepare();
         } else {
             bad_ = true;
@@ -44,6 +84,7 @@ public:
         unprepare();
         sqlite3_close(db_);
         db_ = nullptr;
+        text_columns_.clear();
     }
 
     bool insert_table(const std::string& table,
@@ -59,22 +100,7 @@ public:
                 if (!pk_first) primary_key += ','; else pk_first = false;
                 primary_key += safe(pair.first);
             }
-            switch (pair.second.type()) {
-            case Type::STRING:
-                sql += " TEXT";
-                break;
-            case Type::INT32:
-            case Type::INT64:
-            case Type::BOOL:
-                sql += " INTEGER";
-                break;
-            case Type::DOUBLE:
-                sql += " REAL";
-                break;
-            case Type::RAW:
-                sql += " BLOB";
-                break;
-            }
+            sql += type_name(pair.second.type());
             if (!pair.second.primary_key()) {
                 if (pair.second.unique()) {
                     sql += " UNIQUE";
@@ -97,10 +123,118 @@ public:
         if (!db_) return false;
         std::string sql = "DROP TABLE IF EXISTS " + safe(table);
         unique_stmt stmt;
+        if (!prepare(sql, &stmt) || !exec(stmt)) return false;
+        // And the text index, if any
+        text_columns_.erase(table);
+        sql = "DROP TABLE IF EXISTS " + safe(table) + "_text";
+        if (!prepare(sql, &stmt)) return false;
+        return exec(stmt);
+    }
+
+    bool rename_table(const std::string& table,
+                      const std::string& new_name) override {
+        if (!db_) return false;
+        std::string sql = "ALTER TABLE " + safe(table) + " RENAME TO " +
+            safe(new_name);
+        text_columns_.erase(table);
+        text_columns_.erase(new_name);
+        unique_stmt stmt;
+        if (!prepare(sql, &stmt)) return false;
+        return exec(stmt);
+    }
+
+    bool insert_column(const std::string& table, const std::string& name,
+                       const Constraint& constraint) override {
+        if (!db_) return false;
+        std::string sql = "ALTER TABLE " + safe(table) + " ADD COLUMN " +
+            safe(name) + type_name(constraint.type());
+        // Let SQLite refuse the constraints an added column can't have
+        if (constraint.unique()) sql += " UNIQUE";
+        if (constraint.not_null()) sql += " NOT NULL";
+        unique_stmt stmt;
         if (!prepare(sql, &stmt)) return false;
         return exec(stmt);
     }
 
+    bool insert_index(const std::string& table, const std::string& name,
+                      const std::vector<OrderBy>& columns) override {
+        if (!db_ || columns.empty()) return false;
+        std::string sql = "CREATE INDEX IF NOT EXISTS " + safe(name) +
+            " ON " + safe(table) + " (";
+        compile(sql, columns);
+        sql += ")";
+        unique_stmt stmt;
+        if (!prepare(sql, &stmt)) return false;
+        return exec(stmt);
+    }
+
+    bool insert_text_index(const std::string& table,
+                           const std::vector<std::string>& columns) override {
+        if (!db_ || columns.empty()) return false;
+        auto const index = safe(table) + "_text";
+        unique_stmt stmt;
+        if (!prepare("SELECT 1 FROM sqlite_master WHERE type='table' AND "
+                     "name=?", &stmt) ||
+            !bind(stmt, 1, index)) return false;
+        switch (sqlite3_step(stmt.get())) {
+        case SQLITE_ROW:
+            return true;
+        case SQLITE_DONE:
+            break;
+        default:
+            return false;
+        }
+        std::string names;
+        for (const auto& column : columns) {
+            names += "," + safe(column);
+        }
+        // External content table, only the index is stored. There are no
+        // triggers, they would need to uncompress columns and the schema
+        // can't depend on a function only this code has. The editors and
+        // remove() keep it in sync instead, see index_text().
+        // See https://sqlite.org/fts5.html
+        if (!prepare("CREATE VIRTUAL TABLE " + index + " USING fts5(" +
+                     names.substr(1) + ",content='" + safe(table) +
+                     "',content_rowid='rowid')", &stmt) ||
+            !exec(stmt)) return false;
+        text_columns_.erase(table);
+        std::vector<int64_t> rowids;
+        return select_rowids(table, Condition(), &rowids) &&
+            index_text(table, columns, rowids, false);
+    }
+
+    bool remove_indexes(const std::string& table) override {
+        if (!db_) return false;
+        // Indexes made for constraints have no sql and can't be dropped
+        unique_stmt stmt;
+        if (!prepare("SELECT name FROM sqlite_master WHERE type='index' AND "
+                     "tbl_name=? AND sql IS NOT NULL", &stmt) ||
+            !bind(stmt, 1, table)) return false;
+        std::vector<std::string> names;
+        while (true) {
+            auto ret = sqlite3_step(stmt.get());
+            if (ret == SQLITE_DONE) break;
+            if (ret != SQLITE_ROW) return false;
+            names.emplace_back(reinterpret_cast<const char*>(
+                    sqlite3_column_text(stmt.get(), 0)));
+        }
+        std::vector<std::string> sqls;
+        for (const auto& name : names) {
+            sqls.push_back("DROP INDEX " + safe(name));
+        }
+        // Older versions kept the text index in sync with triggers
+        auto const index = safe(table) + "_text";
+        text_columns_.erase(table);
+        for (const auto& trigger : {"_insert", "_delete", "_update"}) {
+            sqls.push_back("DROP TRIGGER IF EXISTS " + index + trigger);
+        }
+        sqls.push_back("DROP TABLE IF EXISTS " + index);
+        for (const auto& sql : sqls) {
+            if (!prepare(sql, &stmt) || !exec(stmt)) return false;
+        }
+        return true;
+    }
+
     std::shared_ptr<Editor> insert(const std::string& table) override {
         return std::shared_ptr<Editor>(new InsertEditorImpl(this, table));
     }
@@ -122,7 +256,64 @@ public:
         int index = 1;
         if (!bind(stmt, condition, &index)) return nullptr;
         std::shared_ptr<Snapshot> ret(new SnapshotImpl(stmt));
-        if (!ret->next()) return nullptr;
+        // A failed first step is returned so that bad() tells it apart
+        // from no rows
+        if (!ret->next() && !ret->bad()) return nullptr;
+        return ret;
+    }
+
+    std::shared_ptr<Snapshot> select_columns(
+            const std::string& table, const std::vector<std::string>& columns,
+            const Condition& condition, const std::vector<OrderBy>& order_by,
+            size_t limit) override {
+        if (columns.empty()) return nullptr;
+        std::string sql = "SELECT ";
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (i > 0) sql.push_back(',');
+            sql += safe(columns[i]);
+        }
+        sql += " FROM " + safe(table);
+        sql += compile(condition);
+        sql += compile(order_by);
+        if (limit > 0) sql += " LIMIT ?";
+        unique_stmt stmt;
+        if (!prepare(sql, &stmt)) return nullptr;
+        int index = 1;
+        if (!bind(stmt, condition, &index)) return nullptr;
+        if (limit > 0 &&
+            !bind(stmt, index, static_cast<int64_t>(limit))) return nullptr;
+        std::shared_ptr<Snapshot> ret(new SnapshotImpl(stmt));
+        if (!ret->next() && !ret->bad()) return nullptr;
+        return ret;
+    }
+
+    std::shared_ptr<Snapshot> search(const std::string& table,
+                                     const std::vector<std::string>& words,
+                                     size_t limit) override {
+        if (words.empty() || limit == 0) return nullptr;
+        auto const index = safe(table) + "_text";
+        // Each word as a string, so nothing in them is FTS5 query syntax
+        std::string query;
+        for (const auto& word : words) {
+            if (!query.empty()) query.push_back(' ');
+            query.push_back('"');
+            for (auto c : word) {
+                if (c == '"') query.push_back('"');
+                query.push_back(c);
+            }
+            query.push_back('"');
+        }
+        std::string sql = "SELECT " + safe(table) + ".* FROM " + index +
+            " JOIN " + safe(table) + " ON " + safe(table) + ".rowid=" + index +
+            ".rowid WHERE " + index + " MATCH ? ORDER BY " + index +
+            ".rank LIMIT ?";
+        unique_stmt stmt;
+        if (!prepare(sql, &stmt)) return nullptr;
+        if (sqlite3_bind_text(stmt.get(), 1, query.data(), query.size(),
+                              SQLITE_TRANSIENT) != SQLITE_OK ||
+            !bind(stmt, 2, static_cast<int64_t>(limit))) return nullptr;
+        std::shared_ptr<Snapshot> ret(new SnapshotImpl(stmt));
+        if (!ret->next() && !ret->bad()) return nullptr;
         return ret;
     }
 
@@ -133,19 +324,150 @@ public:
         if (!prepare(sql, &stmt)) return -1;
         int index = 1;
         if (!bind(stmt, condition, &index)) return -1;
-        if (!exec(stmt)) return -1;
-        return sqlite3_changes(db_);
+        const std::vector<std::string>* text;
+        if (!text_columns(table, &text)) return -1;
+        if (text->empty()) {
+            if (!exec(stmt)) return -1;
+            return sqlite3_changes(db_);
+        }
+        Transaction transaction(this, true);
+        std::vector<int64_t> rowids;
+        if (!select_rowids(table, condition, &rowids) ||
+            !index_text(table, *text, rowids, true) ||
+            !exec(stmt)) return -1;
+        auto const changes = sqlite3_changes(db_);
+        if (!transaction.commit()) return -1;
+        return changes;
+    }
+
+    bool incremental_vacuum(int64_t pages) override {
+        if (!db_) return false;
+        unique_stmt stmt;
+        if (!prepare("PRAGMA auto_vacuum", &stmt) ||
+            sqlite3_step(stmt.get()) != SQLITE_ROW) return false;
+        if (sqlite3_column_int(stmt.get(), 0) != kAutoVacuumIncremental) {
+            // Created before auto_vacuum was set, it only takes effect after
+            // a full VACUUM. That rewrites the file once and also returns
+            // all unused pages
+            if (!prepare("PRAGMA auto_vacuum=INCREMENTAL", &stmt) ||
+                !exec(stmt) || !prepare("VACUUM", &stmt)) return false;
+            return exec(stmt);
+        }
+        if (!prepare("PRAGMA incremental_vacuum(" + std::to_string(pages) +
+                     ")", &stmt)) return false;
+        // Returns one row for each page freed. SQLITE_BUSY is returned after
+        // the busy timeout, give up then
+        while (true) {
+            switch (sqlite3_step(stmt.get())) {
+            case SQLITE_ROW:
+                continue;
+            case SQLITE_DONE:
+                return true;
+            default:
+                return false;
+            }
+        }
+    }
+
+    int64_t version() override {
+        if (!db_) return -1;
+        // data_version only changes for commits by other connections,
+        // total_changes covers this one
+        if (sqlite3_step(stmt_data_version_.get()) != SQLITE_ROW) {
+            sqlite3_reset(stmt_data_version_.get());
+            return -1;
+        }
+        auto const data_version = sqlite3_column_int64(
+                stmt_data_version_.get(), 0);
+        sqlite3_reset(stmt_data_version_.get());
+        auto const total_changes = sqlite3_total_changes(db_);
+        if (data_version != data_version_ || total_changes != total_changes_) {
+            data_version_ = data_version;
+            total_changes_ = total_changes;
+            version_++;
+        }
+        return version_;
+    }
+
+    bool stats(Stats* stats) override {
+        if (!db_) return false;
+        int current, highwater;
+        if (sqlite3_db_status(db_, SQLITE_DBSTATUS_CACHE_USED, &current,
+                              &highwater, 0) != SQLITE_OK) return false;
+        stats->cache_bytes = current;
+        stats->other_bytes = 0;
+        if (sqlite3_db_status(db_, SQLITE_DBSTATUS_SCHEMA_USED, &current,
+                              &highwater, 0) != SQLITE_OK) return false;
+        stats->other_bytes += current;
+        if (sqlite3_db_status(db_, SQLITE_DBSTATUS_STMT_USED, &current,
+                              &highwater, 0) != SQLITE_OK) return false;
+        stats->other_bytes += current;
+        return true;
+    }
+
+    bool set_cache_size(int64_t bytes) override {
+        if (!db_) return false;
+        // Negative cache_size is in KiB instead of pages
+        auto const kib = bytes > 0 ? std::max<int64_t>(bytes / 1024, 1)
+            : kDefaultCacheKiB;
+        unique_stmt stmt;
+        if (!prepare("PRAGMA cache_size=-" + std::to_string(kib), &stmt)) {
+            return false;
+        }
+        return exec(stmt);
+    }
+
+    void release_memory() override {
+        if (!db_) return;
+        sqlite3_db_release_memory(db_);
     }
 
+    // Transactions nest, only the outermost one talks to SQLite. A rollback
+    // of an inner transaction makes the outermost commit fail.
     bool start_transaction() override {
-        return exec(stmt_begin_);
+        if (transaction_depth_ > 0) {
+            transaction_depth_++;
+            return true;
+        }
+        if (!exec(stmt_begin_)) return false;
+        transaction_depth_ = 1;
+        transaction_failed_ = false;
+        return true;
+    }
+
+    bool start_write_transaction() override {
+        if (transaction_depth_ > 0) return start_transaction();
+        if (!exec(stmt_begin_immediate_)) return false;
+        transaction_depth_ = 1;
+        transaction_failed_ = false;
+        return true;
     }
 
     bool commit_transaction() override {
-        return exec(stmt_commit_);
+        if (transaction_depth_ == 0) return false;
+        if (transaction_depth_ > 1) {
+            transaction_depth_--;
+            return true;
+        }
+        if (transaction_failed_ || !exec(stmt_commit_)) {
+            // Don't leave the transaction open, everything after would
+            // only nest in it and never be committed
+            transaction_depth_ = 0;
+            if (!sqlite3_get_autocommit(db_)) exec(stmt_rollback_);
+            return false;
+        }
+        transaction_depth_ = 0;
+        return true;
     }
 
     bool rollback_transaction() override {
+        if (transaction_depth_ == 0) return false;
+        if (transaction_depth_ > 1) {
+            transaction_depth_--;
+            transaction_failed_ = true;
+            return true;
+        }
+        transaction_depth_ = 0;
         return exec(stmt_rollback_);
     }
 
@@ -200,9 +522,10 @@ public:
                 if (!it.second) {
                     it.first->second.swap(vector);
                 } else {
-                    if (data_.erase(name) == 0) {
-                        new_names_ = true;
-                    }
+                    // Blobs are bound after the other values, so moving a
+                    // column from data_ also changes the statement
+                    data_.erase(name);
+                    new_names_ = true;
                 }
             }
         }
@@ -213,6 +536,7 @@ public:
             if (!it.second) {
                 it.first->second = value;
             } else {
+                blob_.erase(name);
                 new_names_ = true;
             }
         }
@@ -242,7 +566,14 @@ public:
             for (const auto& pair : blob_) {
                 if (!db_->bind(stmt_, index++, pair.second)) return false;
             }
-            return db_->exec(stmt_);
+            const std::vector<std::string>* text;
+            if (!db_->text_columns(table_, &text)) return false;
+            if (text->empty()) return db_->exec(stmt_);
+            Transaction transaction(db_, true);
+            if (!db_->exec(stmt_) ||
+                !db_->index_text(table_, *text, { last_insert_rowid() },
+                                 false)) return false;
+            return transaction.commit();
         }
 
         int64_t last_insert_rowid() override {
@@ -292,7 +623,21 @@ public:
                 if (!db_->bind(stmt_, index++, pair.second)) return false;
             }
             if (!db_->bind(stmt_, condition_, &index)) return false;
-            return db_->exec(stmt_);
+            const std::vector<std::string>* text;
+            if (!db_->text_columns(table_, &text)) return false;
+            bool indexed = false;
+            for (const auto& column : *text) {
+                if (data_.count(column) || blob_.count(column)) indexed = true;
+            }
+            if (!indexed) return db_->exec(stmt_);
+            // The old text must be removed from the index before it's gone
+            Transaction transaction(db_, true);
+            std::vector<int64_t> rowids;
+            if (!db_->select_rowids(table_, condition_, &rowids) ||
+                !db_->index_text(table_, *text, rowids, true) ||
+                !db_->exec(stmt_) ||
+                !db_->index_text(table_, *text, rowids, false)) return false;
+            return transaction.commit();
         }
 
         int64_t last_insert_rowid() override {
@@ -424,7 +769,8 @@ public:
             if (!stmt_) return false;
             if (column >= static_cast<uint32_t>(
                         sqlite3_column_count(stmt_.get()))) return false;
-            return sqlite3_column_type(stmt_.get(), column) == SQLITE_NULL;
+            *value = sqlite3_column_type(stmt_.get(), column) == SQLITE_NULL;
+            return true;
         }
 
         bool next() override {
@@ -474,6 +820,99 @@ public:
         bool bad_;
     };
 
+    // Columns in the text index of table, empty if it has none
+    bool text_columns(const std::string& table,
+                      const std::vector<std::string>** columns) {
+        auto it = text_columns_.find(table);
+        if (it == text_columns_.end()) {
+            // Has no query plan to explain
+            auto const sql = "PRAGMA table_info(" + safe(table) + "_text)";
+            unique_stmt stmt;
+            if (!prepare(sql.c_str(), &stmt, nullptr)) return false;
+            std::vector<std::string> names;
+            while (true) {
+                auto ret = sqlite3_step(stmt.get());
+                if (ret == SQLITE_DONE) break;
+                if (ret != SQLITE_ROW) return false;
+                names.emplace_back(reinterpret_cast<const char*>(
+                        sqlite3_column_text(stmt.get(), 1)));
+            }
+            it = text_columns_.emplace(table, std::move(names)).first;
+        }
+        *columns = &it->second;
+        return true;
+    }
+
+    bool select_rowids(const std::string& table, const Condition& condition,
+                       std::vector<int64_t>* rowids) {
+        unique_stmt stmt;
+        if (!prepare("SELECT rowid FROM " + safe(table) + compile(condition),
+                     &stmt)) return false;
+        int index = 1;
+        if (!bind(stmt, condition, &index)) return false;
+        while (true) {
+            auto ret = sqlite3_step(stmt.get());
+            if (ret == SQLITE_DONE) return true;
+            if (ret != SQLITE_ROW) return false;
+            rowids->push_back(sqlite3_column_int64(stmt.get(), 0));
+        }
+    }
+
+    // Adds the rows to the text index of table, or with remove set takes
+    // them out of it. FTS5 needs the same text to remove a row as it was
+    // added with, so compressed columns are uncompressed for both
+    bool index_text(const std::string& table,
+                    const std::vector<std::string>& columns,
+                    const std::vector<int64_t>& rowids, bool remove) {
+        if (rowids.empty()) return true;
+        auto const index = safe(table) + "_text";
+        std::string names, values;
+        for (const auto& column : columns) {
+            names += "," + safe(column);
+            values += ",?";
+        }
+        unique_stmt read, write;
+        if (!prepare("SELECT " + names.substr(1) + " FROM " + safe(table) +
+                     " WHERE rowid=?", &read) ||
+            !prepare(remove
+                     ? "INSERT INTO " + index + "(" + index + ",rowid" +
+                       names + ") VALUES ('delete',?" + values + ")"
+                     : "INSERT INTO " + index + "(rowid" + names +
+                       ") VALUES (?" + values + ")", &write)) return false;
+        std::string text;
+        for (auto rowid : rowids) {
+            if (!bind(read, 1, rowid)) return false;
+            auto ret = sqlite3_step(read.get());
+            if (ret == SQLITE_DONE) {
+                sqlite3_reset(read.get());
+                continue;
+            }
+            if (ret != SQLITE_ROW || !bind(write, 1, rowid)) {
+                sqlite3_reset(read.get());
+                return false;
+            }
+            for (size_t i = 0; i < columns.size(); i++) {
+                auto value = sqlite3_column_value(read.get(), i);
+                int err;
+                if (sqlite3_value_type(value) == SQLITE_BLOB &&
+                    DB::uncompress_text(sqlite3_value_blob(value),
+                                        sqlite3_value_bytes(value), &text)) {
+                    err = sqlite3_bind_text(write.get(), i + 2, text.data(),
+                                            text.size(), SQLITE_TRANSIENT);
+                } else {
+                    err = sqlite3_bind_value(write.get(), i + 2, value);
+                }
+                if (err != SQLITE_OK) {
+                    sqlite3_reset(read.get());
+                    return false;
+                }
+            }
+            sqlite3_reset(read.get());
+            if (!exec(write)) return false;
+        }
+        return true;
+    }
+
     std::string compile(const Condition& condition) {
         if (condition.empty()) return "";
         std::string sql = " WHERE ";
@@ -559,11 +998,83 @@ public:
             return bind(stmt, (*index)++, condition.value());
         case Condition::COMP_UNARY:
             return true;
+        case Condition::COMP_SET:
+#if HAVE_JSON_EACH
+            return bind_array(stmt, (*index)++, condition.values());
+#else
+            for (const auto& value : condition.values()) {
+                if (!bind(stmt, (*index)++, value)) return false;
+            }
+            return true;
+#endif
+        case Condition::COMP_RANGE:
+            return bind(stmt, (*index)++, condition.low()) &&
+                bind(stmt, (*index)++, condition.high());
         }
         assert(false);
         return false;
     }
 
+#if HAVE_JSON_EACH
+    // Bind values as a JSON array, used by json_each() in the IN query
+    bool bind_array(unique_stmt& stmt, int index,
+                    const std::vector<Value>& values) {
+        std::string json = "[";
+        for (const auto& value : values) {
+            if (json.size() > 1) json.push_back(',');
+            switch (value.type()) {
+            case Type::STRING:
+                json_string(json, value.string());
+                break;
+            case Type::INT32:
+                json += std::to_string(value.i32());
+                break;
+            case Type::INT64:
+                json += std::to_string(value.i64());
+                break;
+            case Type::BOOL:
+                json += value.b() ? "1" : "0";
+                break;
+            case Type::DOUBLE: {
+                char tmp[32];
+                snprintf(tmp, sizeof(tmp), "%.17g", value.d());
+                json += tmp;
+                break;
+            }
+            case Type::RAW:
+                json += "null";
+                break;
+            }
+        }
+        json.push_back(']');
+        return sqlite3_bind_text(stmt.get(), index, json.data(), json.size(),
+                                 SQLITE_TRANSIENT) == SQLITE_OK;
+    }
+
+    static void json_string(std::string& out, const std::string& str) {
+        out.push_back('"');
+        for (auto c : str) {
+            switch (c) {
+            case '"':
+            case '\\':
+                out.push_back('\\');
+                out.push_back(c);
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char tmp[8];
+                    snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+                    out += tmp;
+                } else {
+                    out.push_back(c);
+                }
+                break;
+            }
+        }
+        out.push_back('"');
+    }
+#endif
+
     void compile(std::string& sql, const Condition& condition) {
         switch (condition.mode()) {
         case Condition::NOOP:
@@ -573,10 +1084,10 @@ public:
             compile(sql, condition.c1());
             switch (condition.bool_binary_op()) {
             case Condition::AND:
-                sql += " && ";
+                sql += " AND ";
                 break;
             case Condition::OR:
-                sql += " || ";
+                sql += " OR ";
                 break;
             }
             compile(sql, condition.c2());
@@ -603,7 +1114,7 @@ public:
                 sql += " < ";
                 break;
             case Condition::GREATER_THAN:
-                sql += " < ";
+                sql += " > ";
                 break;
             case Condition::LESS_EQUAL:
                 sql += " <= ";
@@ -624,6 +1135,33 @@ public:
                 break;
             }
             break;
+        case Condition::COMP_SET:
+            sql += "(" + safe(condition.column().name());
+            switch (condition.set_op()) {
+            case Condition::IN:
+                sql += " IN ";
+                break;
+            }
+#if HAVE_JSON_EACH
+            sql += "(SELECT value FROM json_each(?)))";
+#else
+            sql += '(';
+            for (size_t i = 0; i < condition.values().size(); i++) {
+                if (i > 0) sql += ',';
+                sql += '?';
+            }
+            sql += "))";
+#endif
+            break;
+        case Condition::COMP_RANGE:
+            sql += "(" + safe(condition.column().name());
+            switch (condition.range_op()) {
+            case Condition::BETWEEN:
+                sql += " BETWEEN ";
+                break;
+            }
+            sql += "? AND ?)";
+            break;
         }
     }
 
@@ -662,11 +1200,20 @@ public:
     }
 
     void prepare() {
-        static const char* const statements = "BEGIN;COMMIT;ROLLBACK";
+        // Only has effect on new databases, existing databases need a
+        // VACUUM to switch mode
+        static const char* const statements =
+            "PRAGMA auto_vacuum=INCREMENTAL;BEGIN;BEGIN IMMEDIATE;COMMIT;"
+            "ROLLBACK;"
+            "PRAGMA data_version";
         const char* ptr = statements;
-        if (!prepare(ptr, &stmt_begin_, &ptr) ||
+        unique_stmt stmt;
+        if (!prepare(ptr, &stmt, &ptr) || !exec(stmt) ||
+            !prepare(ptr, &stmt_begin_, &ptr) ||
+            !prepare(ptr, &stmt_begin_immediate_, &ptr) ||
             !prepare(ptr, &stmt_commit_, &ptr) ||
-            !prepare(ptr, &stmt_rollback_, &ptr)) {
+            !prepare(ptr, &stmt_rollback_, &ptr) ||
+            !prepare(ptr, &stmt_data_version_, &ptr)) {
             bad_ = true;
             return;
         }
@@ -674,8 +1221,10 @@ public:
 
     void unprepare() {
         stmt_begin_.reset();
+        stmt_begin_immediate_.reset();
         stmt_commit_.reset();
         stmt_rollback_.reset();
+        stmt_data_version_.reset();
     }
 
     bool prepare(const char* str, unique_stmt* stmt, const char** tail) {
@@ -691,6 +1240,7 @@ public:
 
     bool prepare(const std::string& str, unique_stmt* stmt) {
         assert(db_);
+        if (plan_cb_) explain(str);
         sqlite3_stmt* ptr;
         if (sqlite3_prepare_v2(db_, str.data(), str.size(), &ptr, nullptr) !=
             SQLITE_OK) {
@@ -701,15 +1251,60 @@ public:
         return true;
     }
 
+    void explain(const std::string& str) {
+        sqlite3_stmt* ptr;
+        auto sql = "EXPLAIN QUERY PLAN " + str;
+        if (sqlite3_prepare_v2(db_, sql.data(), sql.size(), &ptr, nullptr) !=
+            SQLITE_OK) {
+            return;
+        }
+        unique_stmt stmt(ptr);
+        std::vector<std::string> plan;
+        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            // Last column is the human readable detail, the others are ids
+            auto const column = sqlite3_column_count(stmt.get()) - 1;
+            plan.emplace_back(reinterpret_cast<const char*>(
+                                      sqlite3_column_blob(stmt.get(), column)),
+                              sqlite3_column_bytes(stmt.get(), column));
+        }
+        plan_cb_(str, plan);
+    }
+
     static const std::string& safe(const std::string& str) {
         return str;
     }
 
+    static const char* type_name(Type type) {
+        switch (type) {
+        case Type::STRING:
+            return " TEXT";
+        case Type::INT32:
+        case Type::INT64:
+        case Type::BOOL:
+            return " INTEGER";
+        case Type::DOUBLE:
+            return " REAL";
+        case Type::RAW:
+            return " BLOB";
+        }
+        assert(false);
+        return "";
+    }
+
     sqlite3 *db_;
     bool bad_;
+    SQLite3::PlanCallback const plan_cb_;
     unique_stmt stmt_begin_;
+    unique_stmt stmt_begin_immediate_;
     unique_stmt stmt_commit_;
     unique_stmt stmt_rollback_;
+    unique_stmt stmt_data_version_;
+    unsigned int transaction_depth_;
+    bool transaction_failed_;
+    int64_t data_version_;
+    int total_changes_;
+    int64_t version_;
+    std::map<std::string,std::vector<std::string>> text_columns_;
 };
 
 }  // namespace
@@ -721,4 +1316,88 @@ std::unique_ptr<DB> SQLite3::open(const std::string& path) {
     return db;
 }
 
+// static
+std::unique_ptr<DB> SQLite3::open(const std::string& path,
+                                  PlanCallback plan_cb) {
+    std::unique_ptr<DB> db(new DBImpl(plan_cb));
+    static_cast<DBImpl*>(db.get())->open(path);
+    return db;
+}
+
+// static
+bool SQLite3::backup(const std::string& path, const std::string& target,
+                     int pages_per_step, int pause_ms, std::string* error) {
+    sqlite3* ptr;
+    int err = sqlite3_open_v2(path.c_str(), &ptr, SQLITE_OPEN_READONLY,
+                              nullptr);
+    unique_db src(ptr);
+    if (err != SQLITE_OK) {
+        *error = "Unable to open " + path;
+        return false;
+    }
+    sqlite3_busy_timeout(src.get(), kBusyTimeoutMs);
+    // Write to a temporary file and rename it when done so that target is
+    // never a partial copy
+    auto const tmp = target + ".tmp";
+    err = sqlite3_open(tmp.c_str(), &ptr);
+    unique_db dst(ptr);
+    if (err != SQLITE_OK) {
+        *error = "Unable to open " + tmp;
+        return false;
+    }
+    auto backup = sqlite3_backup_init(dst.get(), "main", src.get(), "main");
+    if (!backup) {
+        *error = sqlite3_errmsg(dst.get());
+        return false;
+    }
+    int restarts = 0;
+    int busy = 0;
+    int copied = 0;
+    while (true) {
+        err = sqlite3_backup_step(backup, pages_per_step);
+        if (err == SQLITE_DONE) break;
+        if (err == SQLITE_OK) {
+            busy = 0;
+            // Every step copies more pages than the last, unless it started
+            // over. A growing source only adds to the remaining pages
+            auto const now = sqlite3_backup_pagecount(backup) -
+                sqlite3_backup_remaining(backup);
+            if (now <= copied && ++restarts >= kBackupMaxRestarts) {
+                *error = "Source changed too often, try again later";
+                break;
+            }
+            copied = now;
+        } else if (err != SQLITE_BUSY && err != SQLITE_LOCKED) {
+            *error = sqlite3_errstr(err);
+            break;
+        } else if (++busy >= kBackupMaxBusy) {
+            *error = "Source is busy, try again later";
+            break;
+        }
+        sqlite3_sleep(pause_ms);
+    }
+    if (sqlite3_backup_finish(backup) != SQLITE_OK || err != SQLITE_DONE) {
+        if (error->empty()) *error = sqlite3_errmsg(dst.get());
+        dst.reset();
+        remove(tmp.c_str());
+        return false;
+    }
+    dst.reset();
+    if (rename(tmp.c_str(), target.c_str())) {
+        *error = "Unable to rename " + tmp + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// static
+void SQLite3::set_memory_limit(int64_t bytes) {
+    sqlite3_soft_heap_limit64(bytes);
+}
+
+// static
+int64_t SQLite3::memory_used() {
+    return sqlite3_memory_used();
+}
+
 }  // namespace stuff
@@ -3,14 +3,41 @@
 
 #include "db.hh"
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace stuff {
 
 class SQLite3 {
 public:
     static std::unique_ptr<DB> open(const std::string& path);
+
+    // Called with the EXPLAIN QUERY PLAN details for every statement before
+    // it is prepared. Only meant for tests, it doubles the prepare cost.
+    typedef std::function<void(const std::string& sql,
+                               const std::vector<std::string>& plan)>
+        PlanCallback;
+
+    static std::unique_ptr<DB> open(const std::string& path,
+                                    PlanCallback plan_cb);
+
+    // Write a consistent copy of the database at path to target using the
+    // online backup API. Copies pages_per_step pages at a time and sleeps
+    // pause_ms between steps so that writers are not blocked for long.
+    // Writes to the source restart the copy, if that happens too often the
+    // backup fails rather than block the writers. Returns false in case of
+    // error, with a description in error
+    static bool backup(const std::string& path, const std::string& target,
+                       int pages_per_step, int pause_ms, std::string* error);
+
+    // Set a soft limit for the memory used by SQLite in this process, when
+    // it's reached caches are freed before allocating more. 0 means no limit
+    static void set_memory_limit(int64_t bytes);
+
+    // Returns the memory used by SQLite in this process, all connections
+    static int64_t memory_used();
 };
 
 }  // namespace stuff
@@ -40,4 +40,9 @@ std::string trim(const std::string& str) {
     return std::string(start, end + 1);
 }
 
+bool ends_with(const std::string& str, const std::string& suffix) {
+    return str.size() >= suffix.size() &&
+        str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 }  // namespace stuff
@@ -9,6 +9,8 @@ std::string ascii_tolower(const std::string& str);
 
 std::string trim(const std::string& str);
 
+bool ends_with(const std::string& str, const std::string& suffix);
+
 }  // namespace stuff
 
 #endif /* STRUTILS_HH */
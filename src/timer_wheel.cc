@@ -0,0 +1,178 @@
+#include "common.hh"
+
+#include <algorithm>
+
+#include "timer_wheel.hh"
+
+namespace stuff {
+
+namespace {
+
+// Slot value for timers taken out of the wheel to be fired
+const uint32_t kFiring = UINT32_MAX - 1;
+
+}  // namespace
+
+TimerWheel::TimerWheel(time_t now)
+    : now_(now), size_(0) {
+    for (auto& head : heads_) head = kNil;
+    for (auto& count : counts_) count = 0;
+}
+
+void TimerWheel::add(uint32_t id, time_t deadline) {
+    if (id >= nodes_.size()) {
+        nodes_.resize(id + 1, Node{0, kNil, kNil, kNil});
+    }
+    auto& node = nodes_[id];
+    if (node.slot < kFiring) {
+        unlink(id);
+    } else {
+        size_++;
+    }
+    node.deadline = deadline;
+    // The slot for now_ has already been handled
+    place(id, now_ + 1);
+}
+
+void TimerWheel::remove(uint32_t id) {
+    if (id >= nodes_.size()) return;
+    auto& node = nodes_[id];
+    if (node.slot == kNil) return;
+    if (node.slot == kFiring) {
+        // Already counted as gone, just don't fire it
+        node.slot = kNil;
+        return;
+    }
+    unlink(id);
+    node.slot = kNil;
+    size_--;
+}
+
+bool TimerWheel::contains(uint32_t id) const {
+    return id < nodes_.size() && nodes_[id].slot < kFiring;
+}
+
+void TimerWheel::advance(time_t now,
+                         const std::function<void(uint32_t)>& fired) {
+    if (now <= now_) return;
+    if (size_ == 0) {
+        now_ = now;
+        return;
+    }
+    std::vector<uint32_t> expired;
+    while (now_ < now) {
+        auto const lowest = lowest_level();
+        if (lowest == kLevels) {
+            now_ = now;
+            break;
+        }
+        if (lowest > 0) {
+            // Nothing happens until the timers in lowest move down, skip to
+            // the tick before that
+            now_ = std::min(now, now_ | level_mask(lowest));
+            if (now_ == now) break;
+        }
+        ++now_;
+        if ((now_ & (kSlots - 1)) == 0) {
+            // Move down timers from the coarser wheels, the next one only
+            // when this one also went all the way around
+            for (unsigned int level = 1; level < kLevels; level++) {
+                cascade(level);
+                if ((now_ >> (kBits * level)) & (kSlots - 1)) break;
+            }
+        }
+        auto& head = heads_[now_ & (kSlots - 1)];
+        if (head == kNil) continue;
+        // Take them all out first so fired can change the wheel as it likes
+        for (auto id = head; id != kNil; id = nodes_[id].next) {
+            nodes_[id].slot = kFiring;
+            expired.push_back(id);
+            counts_[0]--;
+            size_--;
+        }
+        head = kNil;
+        for (auto id : expired) {
+            if (nodes_[id].slot != kFiring) continue;
+            nodes_[id].slot = kNil;
+            fired(id);
+        }
+        expired.clear();
+    }
+}
+
+long TimerWheel::timeout() const {
+    auto const lowest = lowest_level();
+    if (lowest == kLevels) return -1;
+    if (lowest > 0) return (now_ | level_mask(lowest)) + 1 - now_;
+    for (auto tick = now_ + 1; ; ++tick) {
+        // Timers can move down into the first wheel when it wraps around
+        if (heads_[tick & (kSlots - 1)] != kNil ||
+            (tick & (kSlots - 1)) == 0) {
+            return tick - now_;
+        }
+    }
+}
+
+unsigned int TimerWheel::lowest_level() const {
+    unsigned int level = 0;
+    while (level < kLevels && counts_[level] == 0) level++;
+    return level;
+}
+
+// static
+time_t TimerWheel::level_mask(unsigned int level) {
+    return (static_cast<time_t>(1) << (kBits * level)) - 1;
+}
+
+void TimerWheel::place(uint32_t id, time_t earliest) {
+    auto& node = nodes_[id];
+    auto deadline = node.deadline;
+    unsigned int level = 0;
+    if (deadline < earliest) {
+        deadline = earliest;
+    } else {
+        auto const delta = static_cast<uint64_t>(deadline - now_);
+        while (level < kLevels - 1 && delta >> (kBits * (level + 1))) {
+            level++;
+        }
+        if (delta >> (kBits * kLevels)) {
+            // Beyond the last wheel, it will be placed again as it moves down
+            deadline = now_ + (static_cast<time_t>(1) << (kBits * kLevels)) - 1;
+        }
+    }
+    auto const slot = level * kSlots +
+        ((deadline >> (kBits * level)) & (kSlots - 1));
+    counts_[level]++;
+    node.slot = slot;
+    node.prev = kNil;
+    node.next = heads_[slot];
+    if (node.next != kNil) nodes_[node.next].prev = id;
+    heads_[slot] = id;
+}
+
+void TimerWheel::unlink(uint32_t id) {
+    auto& node = nodes_[id];
+    counts_[node.slot / kSlots]--;
+    if (node.prev != kNil) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[node.slot] = node.next;
+    }
+    if (node.next != kNil) nodes_[node.next].prev = node.prev;
+}
+
+void TimerWheel::cascade(unsigned int level) {
+    auto& head = heads_[level * kSlots +
+                        ((now_ >> (kBits * level)) & (kSlots - 1))];
+    auto id = head;
+    head = kNil;
+    while (id != kNil) {
+        auto const next = nodes_[id].next;
+        counts_[level]--;
+        // Called before the slot for now_ is handled
+        place(id, now_);
+        id = next;
+    }
+}
+
+}  // namespace stuff
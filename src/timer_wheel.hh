@@ -0,0 +1,74 @@
+#ifndef TIMER_WHEEL_HH
+#define TIMER_WHEEL_HH
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <vector>
+
+namespace stuff {
+
+// Hierarchical timer wheel with one second ticks. Each wheel has 64 slots,
+// the first covers the next 64 seconds, the second the next 64 * 64 and
+// so on. Timers in the coarser wheels are moved down as time passes.
+// Timers are kept in doubly linked lists, so add() and remove() are O(1).
+class TimerWheel {
+public:
+    explicit TimerWheel(time_t now);
+
+    // Ids are chosen by the caller and index a vector, so keep them dense.
+    // Adding an id already in the wheel moves it. A deadline that has
+    // already passed fires on the next tick.
+    void add(uint32_t id, time_t deadline);
+    void remove(uint32_t id);
+    bool contains(uint32_t id) const;
+
+    // Move time forward to now, calling fired for each timer that expires.
+    // It's safe to add and remove timers from fired.
+    void advance(time_t now, const std::function<void(uint32_t)>& fired);
+
+    // Seconds from now() until advance() has something to do, -1 if the
+    // wheel is empty
+    long timeout() const;
+
+    time_t now() const {
+        return now_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    static const unsigned int kBits = 6;
+    static const unsigned int kSlots = 1 << kBits;
+    static const unsigned int kLevels = 5;
+    static const uint32_t kNil = UINT32_MAX;
+
+    struct Node {
+        time_t deadline;
+        uint32_t prev;
+        uint32_t next;
+        // Index in heads_ or kNil when not in the wheel
+        uint32_t slot;
+    };
+
+    // First wheel with timers in it, kLevels if none
+    unsigned int lowest_level() const;
+    // Mask for the tick bits below the slot index of the wheel at level
+    static time_t level_mask(unsigned int level);
+    void place(uint32_t id, time_t earliest);
+    void unlink(uint32_t id);
+    void cascade(unsigned int level);
+
+    time_t now_;
+    size_t size_;
+    std::vector<Node> nodes_;
+    uint32_t heads_[kLevels * kSlots];
+    // Timers in each wheel
+    size_t counts_[kLevels];
+};
+
+}  // namespace stuff
+
+#endif /* TIMER_WHEEL_HH */
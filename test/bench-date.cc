@@ -0,0 +1,116 @@
+#include "common.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+
+#include "date.hh"
+
+using namespace stuff;
+
+namespace {
+
+const int kRounds = 100000;
+const double kDay = 24.0 * 60.0 * 60.0;
+
+const char* const kInputs[] = {
+    "17:30", "Wednesday 17:30", "15/03 17:30", "Friday 15/03 17:30",
+    "2025-03-15 17:30",
+};
+
+double now_ms() {
+    return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// What event_main and EventUtils did before Date
+bool strptime_parse(const std::string& value, time_t* date) {
+    struct tm _t, _tmp;
+    time_t now = time(NULL);
+    localtime_r(&now, &_t);
+    const char* const formats[] = {
+        "%H:%M", "%A %H:%M", "%d/%m %H:%M", "%A %d/%m %H:%M",
+        "%Y-%m-%d %H:%M",
+    };
+    for (auto format : formats) {
+        _tmp = _t;
+        auto ptr = strptime(value.c_str(), format, &_tmp);
+        if (ptr && !*ptr) {
+            *date = mktime(&_tmp);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string strftime_format(time_t date) {
+    time_t now = time(NULL);
+    struct tm _t;
+    struct tm* t = localtime_r(&date, &_t);
+    double diff = difftime(date, now);
+    char tmp[100];
+    if (diff <= kDay) {
+        strftime(tmp, sizeof(tmp), "%H:%M", t);
+    } else if (diff <= kDay * 7.0) {
+        strftime(tmp, sizeof(tmp), "%A %H:%M", t);
+    } else if (diff <= kDay * 365.0 / 2.0) {
+        strftime(tmp, sizeof(tmp), "%A %d/%m %H:%M", t);
+    } else {
+        strftime(tmp, sizeof(tmp), "%Y-%m-%d %H:%M", t);
+    }
+    return tmp;
+}
+
+void run(const std::string& name, const std::function<size_t()>& func) {
+    auto const begin = now_ms();
+    size_t total = 0;
+    for (int i = 0; i < kRounds; i++) {
+        total += func();
+    }
+    auto const time = now_ms() - begin;
+    std::cout << name << ": " << kRounds << " rounds in " << time << " ms ("
+              << time * 1000000.0 / kRounds << " ns/round, " << total
+              << ")" << std::endl;
+}
+
+}  // namespace
+
+int main() {
+    run("strptime parse", []() {
+            size_t ret = 0;
+            time_t date;
+            for (auto input : kInputs) {
+                if (strptime_parse(input, &date)) ret++;
+            }
+            return ret;
+        });
+    run("Date::parse", []() {
+            size_t ret = 0;
+            auto const now = time(NULL);
+            time_t date;
+            for (auto input : kInputs) {
+                if (Date::parse(input, now, &date)) ret++;
+            }
+            return ret;
+        });
+
+    // A listing of ten events over the next weeks
+    auto const start = time(NULL) + 3600;
+    run("strftime format", [start]() {
+            size_t ret = 0;
+            for (int i = 0; i < 10; i++) {
+                ret += strftime_format(start + i * 2 * kDay).size();
+            }
+            return ret;
+        });
+    run("Date::Formatter", [start]() {
+            size_t ret = 0;
+            Date::Formatter formatter(time(NULL));
+            for (int i = 0; i < 10; i++) {
+                ret += formatter.format(start + i * 2 * kDay).size();
+            }
+            return ret;
+        });
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#include "common.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <unistd.h>
+
+#include "db.hh"
+#include "event.hh"
+#include "log_db.hh"
+#include "sqlite3_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+const int kStormEvents = 20;
+const int kStormToggles = 2000;
+const int kColdEvents = 500;
+const int kColdGoing = 20;
+// Written in transactions this large, so that the log backend compacts its
+// log into a snapshot before the cold start
+const int kColdBatch = 50;
+
+typedef std::function<std::unique_ptr<DB>(const std::string&)> Opener;
+
+std::string g_dir;
+
+double now_ms() {
+    return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::shared_ptr<DB> open_db(const Opener& opener, const std::string& name) {
+    std::shared_ptr<DB> db = opener(g_dir + "/" + name);
+    if (!db || db->bad() || !Event::setup(db.get())) {
+        std::cerr << name << ": unable to open database" << std::endl;
+        return nullptr;
+    }
+    return db;
+}
+
+// Many small going/not going toggles on a few events
+bool rsvp_storm(const Opener& opener, const std::string& name) {
+    auto db = open_db(opener, name);
+    if (!db) return false;
+    auto const start = time(NULL) + 3600;
+    for (int i = 0; i < kStormEvents; i++) {
+        if (!Event::create(db, "event" + std::to_string(i),
+                           start + i)->store()) return false;
+    }
+    auto const begin = now_ms();
+    for (int i = 0; i < kStormToggles; i++) {
+        auto events = Event::all(db);
+        auto& event = events[i % events.size()];
+        event->update_going("user" + std::to_string(i % 50), i % 3 != 0);
+        if (!event->store()) return false;
+    }
+    auto const time = now_ms() - begin;
+    std::cout << name << ": rsvp storm: " << kStormToggles << " toggles in "
+              << time << " ms (" << time * 1000.0 / kStormToggles
+              << " us/toggle)" << std::endl;
+    return true;
+}
+
+// Open an existing database and list all events
+bool cold_start(const Opener& opener, const std::string& name) {
+    {
+        auto db = open_db(opener, name);
+        if (!db) return false;
+        auto const start = time(NULL) + 3600;
+        for (int i = 0; i < kColdEvents; i += kColdBatch) {
+            DB::Transaction transaction(db);
+            for (int j = i; j < i + kColdBatch && j < kColdEvents; j++) {
+                auto event = Event::create(db, "event" + std::to_string(j),
+                                           start + j);
+                for (int k = 0; k < kColdGoing; k++) {
+                    event->update_going("user" + std::to_string(k),
+                                        k % 4 != 0);
+                }
+                if (!event->store()) return false;
+            }
+            if (!transaction.commit()) return false;
+        }
+    }
+    auto const begin = now_ms();
+    auto db = open_db(opener, name);
+    if (!db) return false;
+    auto events = Event::all(db);
+    auto const time = now_ms() - begin;
+    if (events.size() != static_cast<size_t>(kColdEvents)) return false;
+    std::cout << name << ": cold start: " << kColdEvents << " events with "
+              << kColdGoing << " going each in " << time << " ms"
+              << std::endl;
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    char tmp[] = "/tmp/bench-db-XXXXXX";
+    if (!mkdtemp(tmp)) {
+        std::cerr << "Unable to create temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    g_dir = tmp;
+
+    Opener sqlite3 = [](const std::string& path) {
+        return SQLite3::open(path + ".db");
+    };
+    Opener log = [](const std::string& path) {
+        return LogDB::open(path + ".log");
+    };
+
+    bool ok = rsvp_storm(sqlite3, "sqlite3-storm") &&
+        rsvp_storm(log, "log-storm") &&
+        cold_start(sqlite3, "sqlite3-cold") &&
+        cold_start(log, "log-cold");
+
+    system(("rm -rf " + g_dir).c_str());
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,182 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "date.hh"
+
+using namespace stuff;
+
+namespace {
+
+const double kDay = 24.0 * 60.0 * 60.0;
+
+// The strptime() and strftime() versions Date replaced, the outputs must
+// stay the same
+bool legacy_parse(const std::string& value, time_t now, time_t* date) {
+    struct tm _t, _tmp;
+    localtime_r(&now, &_t);
+    _tmp = _t;
+    auto ptr = strptime(value.c_str(), "%H:%M", &_tmp);
+    if (ptr && !*ptr) goto done;
+    _tmp = _t;
+    ptr = strptime(value.c_str(), "%A %H:%M", &_tmp);
+    if (ptr && !*ptr) {
+        int days = _tmp.tm_wday - _t.tm_wday;
+        if (days <= 0) {
+            days += 7;
+        }
+        time_t tmp = mktime(&_tmp) + days * kDay;
+        localtime_r(&tmp, &_tmp);
+        goto done;
+    }
+    _tmp = _t;
+    ptr = strptime(value.c_str(), "%d/%m %H:%M", &_tmp);
+    if (ptr && !*ptr) goto done;
+    _tmp = _t;
+    ptr = strptime(value.c_str(), "%A %d/%m %H:%M", &_tmp);
+    if (ptr && !*ptr) goto done;
+    _tmp = _t;
+    ptr = strptime(value.c_str(), "%Y-%m-%d %H:%M", &_tmp);
+    if (ptr && !*ptr) goto done;
+    return false;
+ done:
+    *date = mktime(&_tmp);
+    return true;
+}
+
+std::string legacy_format(time_t date, time_t now) {
+    struct tm _t;
+    struct tm* t = localtime_r(&date, &_t);
+    double diff = difftime(date, now);
+    char tmp[100];
+    if (diff <= kDay) {
+        strftime(tmp, sizeof(tmp), "%H:%M", t);
+    } else if (diff <= kDay * 7.0) {
+        strftime(tmp, sizeof(tmp), "%A %H:%M", t);
+    } else if (diff <= kDay * 365.0 / 2.0) {
+        strftime(tmp, sizeof(tmp), "%A %d/%m %H:%M", t);
+    } else {
+        strftime(tmp, sizeof(tmp), "%Y-%m-%d %H:%M", t);
+    }
+    return tmp;
+}
+
+// Time zones without and with daylight saving time
+const char* const kZones[] = {
+    "UTC0",
+    "CET-1CEST,M3.5.0,M10.5.0/3",
+    "EST5EDT,M3.2.0,M11.1.0",
+    "ACST-9:30",
+};
+
+// 2024-01-15 12:00:00 UTC, 2024-03-30 23:59:00 UTC (before a DST change),
+// 2024-10-26 12:34:56 UTC and 2023-12-31 23:30:00 UTC
+const time_t kNows[] = { 1705320000, 1711843140, 1729946096, 1704065400 };
+
+std::vector<std::string> parse_inputs() {
+    std::vector<std::string> ret = {
+        "", " ", "17:30", "7:05", "0:00", "23:59", "24:00", "12:60", "5:6",
+        " 17:30", "17:30 ", "17 :30", "17: 30", "1730", "017:30", "12:345",
+        "Monday 17:30", "monday 17:30", "MONDAY 9:15", "Mon 17:30",
+        "mon 17:30", "Mond 17:30", "Monday17:30", "Monday  17:30",
+        " Monday 17:30", "Sunday 0:00", "Sat 23:59", "Thu 12:00",
+        "Wednesday 1:1", "Tues 12:00", "Tue 12:00", "Fri", "Friday",
+        "15/03 17:30", "1/1 0:00", "31/12 23:59", "29/02 12:00",
+        "31/02 12:00", "32/01 12:00", "0/1 12:00", "15/13 12:00",
+        "15/3 17:30", "1/27:30", "15 /03 12:00", "15/ 3 12:00",
+        "15/0312:00", "Friday 15/03 17:30", "fri 1/11 7:00",
+        "Someday 1/11 7:00", "2024-03-31 02:30", "2024-10-27 02:30",
+        "2025-1-5 8:00", "1999-12-31 23:59", "2024-05-2717:30",
+        "2024-13-01 12:00", "2024-00-10 12:00", "Monday 2024-05-06 17:30",
+        "20240-05-06 17:30", "-5:30", "12:30:00", "12:30 pm", "x12:30",
+    };
+    const char* const days[] = { "Sunday", "Mon", "tuesday", "WED", "thu",
+                                 "Friday", "sat" };
+    for (auto day : days) {
+        for (int hour = 0; hour < 24; hour += 5) {
+            ret.push_back(std::string(day) + " " + std::to_string(hour) +
+                          ":" + std::to_string(hour * 2));
+        }
+    }
+    for (int month = 1; month <= 12; month++) {
+        for (int day = 1; day <= 31; day += 6) {
+            auto date = std::to_string(day) + "/" + std::to_string(month);
+            ret.push_back(date + " 10:00");
+            ret.push_back("Tue " + date + " 2:30");
+            ret.push_back("2025-" + std::to_string(month) + "-" +
+                          std::to_string(day) + " 3:15");
+        }
+    }
+    return ret;
+}
+
+bool test_parse() {
+    auto const inputs = parse_inputs();
+    bool ret = true;
+    size_t parsed = 0;
+    for (auto zone : kZones) {
+        setenv("TZ", zone, 1);
+        tzset();
+        for (auto now : kNows) {
+            for (const auto& input : inputs) {
+                time_t expected = 0, got = 0;
+                bool const expected_ok = legacy_parse(input, now, &expected);
+                bool const got_ok = Date::parse(input, now, &got);
+                if (got_ok) parsed++;
+                if (expected_ok != got_ok || expected != got) {
+                    std::cerr << "parse: " << zone << " " << now << " \""
+                              << input << "\": expected " << expected_ok
+                              << " " << expected << ", got " << got_ok
+                              << " " << got << std::endl;
+                    ret = false;
+                }
+            }
+        }
+    }
+    // Most of the inputs are valid
+    if (parsed < inputs.size() * 4 * 2) {
+        std::cerr << "parse: only " << parsed << " parsed" << std::endl;
+        return false;
+    }
+    return ret;
+}
+
+bool test_format() {
+    bool ret = true;
+    for (auto zone : kZones) {
+        setenv("TZ", zone, 1);
+        tzset();
+        for (auto now : kNows) {
+            Date::Formatter formatter(now);
+            // Both close dates and ones far enough apart to cross daylight
+            // saving time changes, not in order
+            for (int i = -100; i < 2000; i++) {
+                auto const date = now + i * 9601 + (i % 7) * 86400 * 3;
+                auto const expected = legacy_format(date, now);
+                auto const got = formatter.format(date);
+                if (expected != got) {
+                    std::cerr << "format: " << zone << " " << now << " "
+                              << date << ": expected " << expected
+                              << ", got " << got << std::endl;
+                    ret = false;
+                    break;
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+}  // namespace
+
+int main() {
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_parse()) ok++;
+    tot++; if (test_format()) ok++;
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
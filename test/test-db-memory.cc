@@ -0,0 +1,102 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+#include "db.hh"
+#include "event.hh"
+#include "log_db.hh"
+#include "sqlite3_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+std::string g_dir;
+
+bool fill(std::shared_ptr<DB> db) {
+    if (!Event::setup(db.get())) {
+        std::cerr << "unable to setup database: " << db->last_error()
+                  << std::endl;
+        return false;
+    }
+    auto const start = time(NULL) + 3600;
+    DB::Transaction transaction(db);
+    for (int i = 0; i < 500; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   start + i);
+        event->set_text(std::string(200, 'x'));
+        event->update_going("user", true);
+        if (!event->store()) return false;
+    }
+    return transaction.commit();
+}
+
+bool test_sqlite3() {
+    std::shared_ptr<DB> db = SQLite3::open(g_dir + "/test.db");
+    if (!db || db->bad() || !fill(db)) return false;
+    Event::all(db);
+    DB::Stats before;
+    if (!db->stats(&before) || before.cache_bytes <= 0 ||
+        before.other_bytes <= 0) {
+        std::cerr << "sqlite3: no memory reported" << std::endl;
+        return false;
+    }
+    if (SQLite3::memory_used() < before.cache_bytes) {
+        std::cerr << "sqlite3: process uses less than connection"
+                  << std::endl;
+        return false;
+    }
+    db->release_memory();
+    DB::Stats after;
+    if (!db->stats(&after) || after.cache_bytes >= before.cache_bytes) {
+        std::cerr << "sqlite3: release_memory didn't release the cache"
+                  << std::endl;
+        return false;
+    }
+    if (!db->set_cache_size(16 * 1024)) {
+        std::cerr << "sqlite3: set_cache_size failed: " << db->last_error()
+                  << std::endl;
+        return false;
+    }
+    Event::all(db);
+    if (!db->stats(&after) || after.cache_bytes > 64 * 1024) {
+        std::cerr << "sqlite3: cache is larger than set: "
+                  << after.cache_bytes << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_log() {
+    std::shared_ptr<DB> db = LogDB::open(g_dir + "/test.log");
+    if (!db || db->bad() || !fill(db)) return false;
+    DB::Stats stats;
+    if (!db->stats(&stats) || stats.cache_bytes < 500 * 200) {
+        std::cerr << "log: rows not reported" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    char tmp[] = "/tmp/test-db-memory-XXXXXX";
+    if (!mkdtemp(tmp)) {
+        std::cerr << "Unable to create temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    g_dir = tmp;
+
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_sqlite3()) ok++;
+    tot++; if (test_log()) ok++;
+
+    system(("rm -rf " + g_dir).c_str());
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
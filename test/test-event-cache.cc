@@ -0,0 +1,190 @@
+#include "common.hh"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+#include "config.hh"
+#include "db.hh"
+#include "event.hh"
+#include "event_utils.hh"
+#include "sqlite3_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+std::string g_dir;
+std::unique_ptr<Config> g_cfg;
+
+void error_cb(const std::string& message) {
+    std::cerr << "error: " << message << std::endl;
+}
+
+// One EventUtils per request, like event and page do
+std::unique_ptr<EventUtils> request() {
+    return EventUtils::create("test", error_cb, g_cfg.get(), nullptr);
+}
+
+bool test_own_write() {
+    if (!request()->all().empty()) {
+        std::cerr << "own_write: expected no events" << std::endl;
+        return false;
+    }
+    auto utils = request();
+    auto event = utils->create("first", time(NULL) + 3600);
+    if (!event || !event->store()) return false;
+    auto events = request()->all();
+    if (events.size() != 1 || events[0]->name() != "first") {
+        std::cerr << "own_write: event not seen" << std::endl;
+        return false;
+    }
+    // Changes to the returned events don't leak into the cache
+    events[0]->set_name("changed");
+    auto next = request()->next();
+    if (!next || next->name() != "first") {
+        std::cerr << "own_write: cache modified" << std::endl;
+        return false;
+    }
+    next->update_going("user", true);
+    if (!next->store() || !request()->next()->is_going("user")) {
+        std::cerr << "own_write: going not seen" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_other_write() {
+    request()->all();
+    std::shared_ptr<DB> db = SQLite3::open(g_dir + "/test.db");
+    if (!db || db->bad()) return false;
+    if (!Event::create(db, "second", time(NULL) + 7200)->store()) {
+        return false;
+    }
+    auto events = request()->all();
+    if (events.size() != 2 || events[1]->name() != "second") {
+        std::cerr << "other_write: event not seen" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_expire() {
+    auto utils = request();
+    if (!utils->create("soon", time(NULL) + 1)->store()) return false;
+    auto next = request()->next();
+    if (!next || next->name() != "soon") {
+        std::cerr << "expire: event not seen" << std::endl;
+        return false;
+    }
+    sleep(2);
+    next = request()->next();
+    if (!next || next->name() == "soon") {
+        std::cerr << "expire: started event still returned" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_request_view() {
+    auto utils = request();
+    auto events = utils->all();
+    if (events.empty()) return false;
+    auto const count = events.size();
+    auto event = utils->create("early", time(NULL) + 60);
+    if (!event->store()) return false;
+    utils->created(event.get());
+    auto next = utils->next();
+    if (!next || next->id() != event->id() ||
+        utils->all().size() != count + 1) {
+        std::cerr << "request_view: created event not first" << std::endl;
+        return false;
+    }
+    auto first = next->id();
+    next->set_start(time(NULL) + 86400 * 30);
+    if (!next->store()) return false;
+    utils->updated(next.get(), first);
+    events = utils->all();
+    if (events.size() != count + 1 || events.back()->id() != first) {
+        std::cerr << "request_view: updated event not last" << std::endl;
+        return false;
+    }
+    std::vector<Event*> canceled(1, events.back().get());
+    if (!utils->cancel(canceled) || utils->all().size() != count) {
+        std::cerr << "request_view: canceled event still there"
+                  << std::endl;
+        return false;
+    }
+    // And the next request agrees
+    if (request()->all().size() != count) {
+        std::cerr << "request_view: database disagrees" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+size_t count_named(const std::vector<std::unique_ptr<Event>>& events,
+                   const std::string& name) {
+    size_t ret = 0;
+    for (const auto& event : events) {
+        if (event->name() == name) ret++;
+    }
+    return ret;
+}
+
+// An occurrence that becomes due is seen without any change to the database
+bool test_window() {
+    const time_t kDay = 24 * 60 * 60;
+    // The third occurrence starts 28 days and 2 seconds from now, just
+    // outside the four week window for a few seconds
+    auto series = request()->create("series", time(NULL) + 8 * kDay + 2);
+    series->set_repeat(10, 0);
+    if (!series->store()) return false;
+    if (count_named(request()->all(), "series") != 2) {
+        std::cerr << "window: expected two occurrences" << std::endl;
+        return false;
+    }
+    sleep(4);
+    if (count_named(request()->all(), "series") != 3) {
+        std::cerr << "window: new occurrence not seen" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    // Occurrences are a number of local days apart
+    setenv("TZ", "UTC0", 1);
+
+    char tmp[] = "/tmp/test-event-cache-XXXXXX";
+    if (!mkdtemp(tmp)) {
+        std::cerr << "Unable to create temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    g_dir = tmp;
+    {
+        std::ofstream out(g_dir + "/event.config");
+        out << "db_path = " << g_dir << std::endl;
+    }
+    g_cfg = Config::create();
+    if (!g_cfg->load(g_dir + "/event.config")) {
+        std::cerr << "Unable to load config" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_own_write()) ok++;
+    tot++; if (test_other_write()) ok++;
+    tot++; if (test_expire()) ok++;
+    tot++; if (test_request_view()) ok++;
+    tot++; if (test_window()) ok++;
+
+    system(("rm -rf " + g_dir).c_str());
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,352 @@
+#include "common.hh"
+
+#include <iostream>
+#include <map>
+
+#include "db.hh"
+#include "event.hh"
+#include "sqlite3_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+std::map<std::string, std::vector<std::string>> g_plans;
+unsigned int g_prepared;
+
+void plan_cb(const std::string& sql, const std::vector<std::string>& plan) {
+    g_plans[sql] = plan;
+    g_prepared++;
+}
+
+bool starts_with(const std::string& str, const std::string& prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool check_plans(const std::string& test) {
+    bool ok = true;
+    for (const auto& pair : g_plans) {
+        if (starts_with(pair.first, "CREATE ") ||
+            starts_with(pair.first, "INSERT ")) continue;
+        if (pair.second.empty()) {
+            std::cerr << test << ": no plan for '" << pair.first << "'"
+                      << std::endl;
+            ok = false;
+            continue;
+        }
+        for (const auto& detail : pair.second) {
+            // json_each() used for IN is always scanned
+            if (starts_with(detail, "SCAN json_each VIRTUAL TABLE")) continue;
+            // Full-text index lookups, M is MATCH
+            if (starts_with(detail, "SCAN events_text VIRTUAL TABLE INDEX") &&
+                detail.find(":M") != std::string::npos) continue;
+            if (starts_with(detail, "SCAN ") ||
+                detail.find("USE TEMP B-TREE") != std::string::npos) {
+                std::cerr << test << ": '" << pair.first << "' uses '"
+                          << detail << "'" << std::endl;
+                ok = false;
+            }
+        }
+    }
+    g_plans.clear();
+    return ok;
+}
+
+std::shared_ptr<DB> open_db() {
+    std::shared_ptr<DB> db = SQLite3::open(":memory:", plan_cb);
+    if (!db || db->bad()) {
+        std::cerr << "unable to open database" << std::endl;
+        return nullptr;
+    }
+    if (!Event::setup(db.get())) {
+        std::cerr << "unable to setup database: " << db->last_error()
+                  << std::endl;
+        return nullptr;
+    }
+    // Setup and migrations run once per database, scanning is fine there
+    g_plans.clear();
+    return db;
+}
+
+bool test_create() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    event->set_text("some text");
+    if (!event->store()) {
+        std::cerr << "create: store failed" << std::endl;
+        return false;
+    }
+    return check_plans("create");
+}
+
+bool test_next() {
+    auto db = open_db();
+    if (!db) return false;
+    Event::create(db, "test", time(NULL) + 3600)->store();
+    g_plans.clear();
+    auto event = Event::next(db);
+    if (!event) {
+        std::cerr << "next: no event" << std::endl;
+        return false;
+    }
+    return check_plans("next");
+}
+
+bool test_all() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test1", time(NULL) + 3600);
+    event->update_going("user1", true);
+    event->store();
+    event = Event::create(db, "test2", time(NULL) + 7200);
+    event->update_going("user2", true);
+    event->update_going("user1", false);
+    event->store();
+    g_plans.clear();
+    auto events = Event::all(db);
+    if (events.size() != 2) {
+        std::cerr << "all: expected two events" << std::endl;
+        return false;
+    }
+    if (!events[0]->is_going("user1") || events[0]->is_going("user2") ||
+        !events[1]->is_going("user2") || events[1]->is_going("user1")) {
+        std::cerr << "all: unexpected going" << std::endl;
+        return false;
+    }
+    return check_plans("all");
+}
+
+bool test_lazy_going() {
+    auto db = open_db();
+    if (!db) return false;
+    for (int i = 0; i < 3; i++) {
+        auto event = Event::create(db, "test" + std::to_string(i),
+                                   time(NULL) + 3600 * (i + 1));
+        event->update_going("user" + std::to_string(i), true);
+        event->store();
+    }
+    g_plans.clear();
+    g_prepared = 0;
+    auto events = Event::all(db);
+    // One select for the events and one for the repeating events
+    if (g_prepared != 2) {
+        std::cerr << "lazy_going: going loaded by all()" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        if (!events[i]->is_going("user" + std::to_string(i))) {
+            std::cerr << "lazy_going: unexpected going" << std::endl;
+            return false;
+        }
+    }
+    // One select for all events and one for the user names, not one per
+    // event
+    if (g_prepared != 4) {
+        std::cerr << "lazy_going: expected two selects for going, got "
+                  << g_prepared - 2 << std::endl;
+        return false;
+    }
+    return check_plans("lazy_going");
+}
+
+bool test_repeat() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "weekly", time(NULL) + 3600);
+    event->set_repeat(7, 0);
+    if (!event->store()) return false;
+    Event::create(db, "single", time(NULL) + 7200)->store();
+    g_plans.clear();
+    auto events = Event::all(db);
+    if (events.size() != 5 || events[0]->name() != "weekly" ||
+        events[1]->name() != "single" || events[0]->series() != event->id()) {
+        std::cerr << "repeat: unexpected events" << std::endl;
+        return false;
+    }
+    events[0]->update_going("user", true);
+    if (!events[0]->store()) return false;
+    auto next = Event::next(db);
+    if (Event::all(db).size() != 5 || !next || next->id() != events[0]->id() ||
+        !next->is_going("user")) {
+        std::cerr << "repeat: stored occurrence not used" << std::endl;
+        return false;
+    }
+    return check_plans("repeat");
+}
+
+bool test_find() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    Event::create(db, "Board games", now + 3600)->store();
+    auto event = Event::create(db, "Pub", now + 7200);
+    event->set_text("After the board meeting");
+    event->store();
+    event = Event::create(db, "Old board games", now - 7200);
+    event->set_text("More board games");
+    event->store();
+    Event::create(db, "Lunch", now + 3600)->store();
+    g_plans.clear();
+    auto events = Event::find(db, "BOARD  \"games", 10);
+    if (events.size() != 2 || events[0]->name() == events[1]->name() ||
+        events[0]->name().find("oard games") == std::string::npos ||
+        events[1]->name().find("oard games") == std::string::npos) {
+        std::cerr << "find: unexpected result" << std::endl;
+        return false;
+    }
+    if (Event::find(db, "board", 2).size() != 2 ||
+        !Event::find(db, "dinner", 10).empty()) {
+        std::cerr << "find: unexpected limit" << std::endl;
+        return false;
+    }
+    // Renamed events are found by their new name only
+    auto& renamed = events[0]->name() == "Board games" ? events[0] : events[1];
+    renamed->set_name("Chess");
+    if (!renamed->store() || Event::find(db, "board", 10).size() != 2 ||
+        Event::find(db, "chess", 10).size() != 1) {
+        std::cerr << "find: index not updated" << std::endl;
+        return false;
+    }
+    return check_plans("find");
+}
+
+bool test_between() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 5; i++) {
+        Event::create(db, "test" + std::to_string(i), now + i * 3600)->store();
+    }
+    g_plans.clear();
+    auto snapshot = db->select("events",
+                               DB::Condition("start", DB::Condition::BETWEEN,
+                                             static_cast<int64_t>(now + 3600),
+                                             static_cast<int64_t>(now + 10800)),
+                               DB::OrderBy("start"));
+    int count = 0;
+    if (snapshot) {
+        do {
+            count++;
+        } while (snapshot->next());
+    }
+    if (count != 3) {
+        std::cerr << "between: expected three events, got " << count
+                  << std::endl;
+        return false;
+    }
+    return check_plans("between");
+}
+
+bool test_headers() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 5; i++) {
+        Event::create(db, "test" + std::to_string(i), now + i * 3600)->store();
+    }
+    auto event = Event::create(db, "daily", now + 1800);
+    event->set_repeat(1, 0);
+    event->store();
+    g_plans.clear();
+    if (Event::headers(db, 3).size() != 3) {
+        std::cerr << "headers: expected three events" << std::endl;
+        return false;
+    }
+    return check_plans("headers");
+}
+
+bool test_update() {
+    auto db = open_db();
+    if (!db) return false;
+    Event::create(db, "test", time(NULL) + 3600)->store();
+    auto event = Event::next(db);
+    g_plans.clear();
+    event->set_name("other");
+    event->update_going("user1", true);
+    if (!event->store()) {
+        std::cerr << "update: store failed" << std::endl;
+        return false;
+    }
+    if (!check_plans("update")) return false;
+    event = Event::next(db);
+    if (event->name() != "other" || !event->is_going("user1")) {
+        std::cerr << "update: not stored" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_store_going() {
+    auto db = open_db();
+    if (!db) return false;
+    Event::create(db, "test", time(NULL) + 3600)->store();
+    auto event = Event::next(db);
+    g_plans.clear();
+    event->update_going("user1", true, "note");
+    event->update_going("user2", false);
+    if (!event->store()) {
+        std::cerr << "store_going: store failed" << std::endl;
+        return false;
+    }
+    return check_plans("store_going");
+}
+
+bool test_capacity() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    event->set_capacity(1);
+    event->store();
+    g_plans.clear();
+    for (auto user : { "user1", "user2", "user3" }) {
+        event = Event::next(db);
+        event->update_going(user, true);
+        if (!event->store()) return false;
+    }
+    // Promotes user2
+    event = Event::next(db);
+    event->update_going("user1", false);
+    if (!event->store()) return false;
+    event = Event::next(db);
+    if (!event->is_going("user2") || event->waiting_count() != 1) {
+        std::cerr << "capacity: waitlist not promoted" << std::endl;
+        return false;
+    }
+    return check_plans("capacity");
+}
+
+bool test_remove() {
+    auto db = open_db();
+    if (!db) return false;
+    Event::create(db, "test", time(NULL) + 3600)->store();
+    auto event = Event::next(db);
+    g_plans.clear();
+    if (!event->remove()) {
+        std::cerr << "remove: remove failed" << std::endl;
+        return false;
+    }
+    return check_plans("remove");
+}
+
+}  // namespace
+
+int main() {
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_create()) ok++;
+    tot++; if (test_next()) ok++;
+    tot++; if (test_all()) ok++;
+    tot++; if (test_lazy_going()) ok++;
+    tot++; if (test_repeat()) ok++;
+    tot++; if (test_find()) ok++;
+    tot++; if (test_between()) ok++;
+    tot++; if (test_headers()) ok++;
+    tot++; if (test_update()) ok++;
+    tot++; if (test_store_going()) ok++;
+    tot++; if (test_capacity()) ok++;
+    tot++; if (test_remove()) ok++;
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1012 @@
+#include "common.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include "db.hh"
+#include "event.hh"
+#include "sqlite3_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+// Made by main(), for the tests that need database files
+std::string g_dir;
+
+std::shared_ptr<DB> open_db() {
+    std::shared_ptr<DB> db = SQLite3::open(":memory:");
+    if (!db || db->bad() || !Event::setup(db.get())) {
+        std::cerr << "unable to open database" << std::endl;
+        return nullptr;
+    }
+    return db;
+}
+
+std::string names(const Event* event) {
+    std::vector<Event::Going> going;
+    event->going(&going);
+    std::string ret;
+    for (const auto& entry : going) {
+        if (!ret.empty()) ret.push_back(' ');
+        if (!entry.is_going) ret.push_back('!');
+        if (entry.waiting) ret.push_back('?');
+        ret.append(entry.name());
+    }
+    return ret;
+}
+
+bool test_going_order() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    event->update_going("a", true);
+    event->update_going("b", false);
+    event->update_going("c", true);
+    event->update_going("d", false);
+    if (names(event.get()) != "a c !b !d") {
+        std::cerr << "going_order: unexpected order: " << names(event.get())
+                  << std::endl;
+        return false;
+    }
+    // Changing moves to the end of the new part
+    event->update_going("b", true);
+    event->update_going("a", false, "busy");
+    if (names(event.get()) != "c b !d !a") {
+        std::cerr << "going_order: unexpected order after update: "
+                  << names(event.get()) << std::endl;
+        return false;
+    }
+    Event::Going going("", false, "", 0);
+    if (!event->find_going("a", &going) || going.is_going ||
+        going.note != "busy" || event->find_going("e", &going) ||
+        !event->is_going("b") || event->is_going("d")) {
+        std::cerr << "going_order: lookup failed" << std::endl;
+        return false;
+    }
+    if (!event->store()) return false;
+    // Stored lists are ordered by added time in seconds, so only check
+    // that the same entries come back
+    auto loaded = Event::next(db);
+    std::vector<Event::Going> list;
+    if (loaded) loaded->going(&list);
+    if (list.size() != 4 || !loaded->find_going("a", &going) ||
+        going.is_going || going.note != "busy") {
+        std::cerr << "going_order: unexpected stored list: "
+                  << (loaded ? names(loaded.get()) : "") << std::endl;
+        return false;
+    }
+    auto const before = names(loaded.get());
+    auto clone = loaded->clone();
+    clone->update_going("c", false);
+    if (names(loaded.get()) != before || !loaded->is_going("c") ||
+        clone->is_going("c")) {
+        std::cerr << "going_order: clone shares list" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_many() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    for (int i = 0; i < 5000; i++) {
+        event->update_going("user" + std::to_string(i), i % 2 == 0);
+    }
+    for (int i = 0; i < 5000; i++) {
+        event->update_going("user" + std::to_string(i), i % 2 != 0);
+    }
+    std::vector<Event::Going> going;
+    event->going(&going);
+    if (going.size() != 5000 || going.front().name() != "user1" ||
+        going.back().name() != "user4998") {
+        std::cerr << "many: unexpected list" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_names() {
+    auto const before = Event::Names::size();
+    uint32_t found;
+    {
+        auto const id = Event::Names::intern("test_names");
+        if (Event::Names::intern("test_names") != id ||
+            !Event::Names::find("test_names", &found) || found != id ||
+            Event::Names::get(id) != "test_names" ||
+            Event::Names::find("test_names_unknown", &found)) {
+            std::cerr << "names: interning failed" << std::endl;
+            return false;
+        }
+        Event::Going going("test_names", true, "", 0);
+        if (going.name_id != id || going.name() != "test_names") {
+            std::cerr << "names: going not interned" << std::endl;
+            return false;
+        }
+        auto copy = going;
+        going = Event::Going("test_names_other", true, "", 0);
+        if (copy.name() != "test_names" ||
+            Event::Names::size() != before + 2) {
+            std::cerr << "names: copy lost its name" << std::endl;
+            return false;
+        }
+    }
+    if (Event::Names::size() != before ||
+        Event::Names::find("test_names", &found)) {
+        std::cerr << "names: unused names kept" << std::endl;
+        return false;
+    }
+    // Threads sharing, dropping and interning the same names again
+    auto const shared = Event::Names::intern("test_names_shared");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&shared]() {
+                for (int i = 0; i < 10000; i++) {
+                    std::vector<Event::Names::Ref> refs(4, shared);
+                    refs.push_back(Event::Names::intern(
+                            "test_names_" + std::to_string(i % 8)));
+                    if (Event::Names::get(refs.back()).empty()) break;
+                }
+            });
+    }
+    for (auto& thread : threads) thread.join();
+    if (Event::Names::get(shared) != "test_names_shared" ||
+        Event::Names::size() != before + 1) {
+        std::cerr << "names: shared between threads" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_counts() {
+    auto db = open_db();
+    if (!db) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    if (!event->store()) return false;
+    auto loaded = Event::next(db);
+    if (!loaded || loaded->going_count() != 0 ||
+        loaded->not_going_count() != 0) {
+        std::cerr << "counts: new event not empty" << std::endl;
+        return false;
+    }
+    event->update_going("a", true);
+    event->update_going("b", true);
+    event->update_going("c", false);
+    if (event->going_count() != 2 || event->not_going_count() != 1 ||
+        !event->store()) {
+        std::cerr << "counts: unexpected counts before store" << std::endl;
+        return false;
+    }
+    event->update_going("b", false);
+    if (!event->store()) return false;
+    loaded = Event::next(db);
+    if (!loaded || loaded->going_count() != 1 ||
+        loaded->not_going_count() != 2) {
+        std::cerr << "counts: unexpected stored counts" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+size_t rows(std::shared_ptr<DB> db) {
+    size_t ret = 0;
+    auto snapshot = db->select("events");
+    if (snapshot) {
+        do {
+            ret++;
+        } while (snapshot->next());
+    }
+    return ret;
+}
+
+bool test_repeat() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    // Started a long time ago, still going on
+    auto event = Event::create(db, "daily", now - 1000 * 86400 + 7200);
+    event->set_repeat(1, now + 10 * 86400);
+    if (!event->store()) return false;
+    auto events = Event::all(db);
+    if (events.size() != 10 || events[0]->start() < now ||
+        events[0]->start() > now + 86400 || events[9]->start() > now +
+        10 * 86400 || rows(db) != 1) {
+        std::cerr << "repeat: unexpected occurrences" << std::endl;
+        return false;
+    }
+    events[3]->set_text("changed");
+    events[5]->update_going("user", false);
+    if (!events[3]->store() || !events[5]->store() || rows(db) != 3) {
+        std::cerr << "repeat: occurrences not stored" << std::endl;
+        return false;
+    }
+    events = Event::all(db);
+    if (events.size() != 10 || events[3]->text() != "changed" ||
+        events[4]->text() != "" || events[5]->not_going_count() != 1) {
+        std::cerr << "repeat: stored occurrences not used" << std::endl;
+        return false;
+    }
+    if (Event::expire(db.get(), now, 100) != 0 || rows(db) != 3) {
+        std::cerr << "repeat: repeating event expired" << std::endl;
+        return false;
+    }
+    if (!events[7]->remove() || rows(db) != 0 || !Event::all(db).empty()) {
+        std::cerr << "repeat: not all occurrences removed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_between() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 4; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   now + 86400 * (i + 1));
+        if (!event->store()) return false;
+    }
+    auto event = Event::create(db, "weekly", now - 30 * 86400 + 3600);
+    event->set_repeat(7, 0);
+    if (!event->store()) return false;
+    auto events = Event::between(db, now + 86400, now + 3 * 86400);
+    size_t weekly = 0;
+    for (const auto& e : events) {
+        if (e->start() < now + 86400 || e->start() > now + 3 * 86400) {
+            std::cerr << "between: event outside range" << std::endl;
+            return false;
+        }
+        if (e->name() == "weekly") weekly++;
+    }
+    if (events.size() != 3 + weekly || weekly > 1) {
+        std::cerr << "between: unexpected events" << std::endl;
+        return false;
+    }
+    // Occurrences far ahead, no matter the repeat window
+    events = Event::between(db, now + 300 * 86400, now + 328 * 86400);
+    if (events.size() != 4 || events[0]->name() != "weekly" ||
+        std::abs(events[3]->start() - events[0]->start() - 21 * 86400) >
+        3600) {
+        std::cerr << "between: unexpected occurrences" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_headers() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 6; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   now + 86400 * i + 3600);
+        if (i == 2) event->update_going("user", true);
+        if (!event->store()) return false;
+    }
+    Event::create(db, "past", now - 3600)->store();
+    auto event = Event::create(db, "daily", now - 10 * 86400 + 7200);
+    event->set_repeat(1, now + 4 * 86400);
+    if (!event->store()) return false;
+    auto events = Event::all(db);
+    events[1]->update_going("user", false);
+    if (!events[1]->store()) return false;
+    events = Event::all(db);
+    auto headers = Event::headers(db, 100);
+    if (headers.size() != events.size()) {
+        std::cerr << "headers: expected " << events.size() << " got "
+                  << headers.size() << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (headers[i].id != events[i]->id() ||
+            headers[i].name != events[i]->name() ||
+            headers[i].start != events[i]->start() ||
+            headers[i].going_count != events[i]->going_count()) {
+            std::cerr << "headers: " << i << " is not " << events[i]->name()
+                      << std::endl;
+            return false;
+        }
+    }
+    // Occurrences and events sorted together before the limit
+    headers = Event::headers(db, 4);
+    if (headers.size() != 4 || headers[3].id != events[3]->id() ||
+        !Event::headers(db, 0).empty()) {
+        std::cerr << "headers: unexpected result with limit" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_dump() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "Board \"games\"\n", now + 3600);
+    event->set_text("text\twith\x01 \xc3\xa5");
+    event->update_going("user1", true, "note");
+    event->update_going("user2", false);
+    if (!event->store()) return false;
+    event = Event::create(db, "weekly", now + 7200);
+    event->set_repeat(7, 0);
+    if (!event->store()) return false;
+    auto events = Event::all(db);
+    events[1]->update_going("user2", true);
+    if (!events[1]->store()) return false;
+    std::stringstream out;
+    if (!Event::dump(db.get(), &out)) {
+        std::cerr << "dump: failed" << std::endl;
+        return false;
+    }
+    auto copy = open_db();
+    std::string error;
+    // Small batches to commit more than once
+    if (!copy || !Event::restore(copy.get(), &out, 2, &error)) {
+        std::cerr << "dump: restore failed: " << error << std::endl;
+        return false;
+    }
+    auto copied = Event::all(copy);
+    events = Event::all(db);
+    if (copied.size() != events.size()) {
+        std::cerr << "dump: expected " << events.size() << " events, got "
+                  << copied.size() << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        if (copied[i]->id() != events[i]->id() ||
+            copied[i]->name() != events[i]->name() ||
+            copied[i]->text() != events[i]->text() ||
+            copied[i]->start() != events[i]->start() ||
+            copied[i]->repeat_days() != events[i]->repeat_days() ||
+            copied[i]->going_count() != events[i]->going_count() ||
+            names(copied[i].get()) != names(events[i].get())) {
+            std::cerr << "dump: " << events[i]->name() << " not copied"
+                      << std::endl;
+            return false;
+        }
+    }
+    if (Event::find(copy, "games", 10).size() != 1) {
+        std::cerr << "dump: text index not created" << std::endl;
+        return false;
+    }
+    // Only into empty databases
+    out.clear();
+    out.str("");
+    if (Event::restore(copy.get(), &out, 2, &error)) {
+        std::cerr << "dump: restored twice" << std::endl;
+        return false;
+    }
+    copy = open_db();
+    std::stringstream bad("{\"type\":\"user\",\"id\":1,\"name\":\"a\"}\n"
+                          "\n{\"type\":\"event\",\"id\":\"1\"}\n");
+    if (Event::restore(copy.get(), &bad, 1, &error) ||
+        error != "Line 3: Bad event") {
+        std::cerr << "dump: unexpected error '" << error << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_capacity() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "test", now + 3600);
+    event->set_capacity(2);
+    event->update_going("a", true);
+    event->update_going("b", true);
+    event->update_going("c", true);
+    if (names(event.get()) != "a b ?c" || !event->store()) {
+        std::cerr << "capacity: unexpected new list: " << names(event.get())
+                  << std::endl;
+        return false;
+    }
+    event = Event::next(db);
+    if (!event || event->capacity() != 2 || event->going_count() != 2 ||
+        event->waiting_count() != 1) {
+        std::cerr << "capacity: unexpected stored counts" << std::endl;
+        return false;
+    }
+    event->update_going("d", true);
+    // Keeps the seat
+    event->update_going("b", true, "late");
+    if (!event->store()) return false;
+    event = Event::next(db);
+    Event::Going going("", false, "", 0);
+    if (names(event.get()) != "a b ?c ?d" || !event->find_going("b", &going) ||
+        going.note != "late" || event->is_going("c")) {
+        std::cerr << "capacity: unexpected list: " << names(event.get())
+                  << std::endl;
+        return false;
+    }
+    event->update_going("a", false);
+    if (!event->store()) return false;
+    event = Event::next(db);
+    if (names(event.get()) != "b c ?d !a" || event->going_count() != 2 ||
+        event->waiting_count() != 1 || event->not_going_count() != 1) {
+        std::cerr << "capacity: waitlist not promoted: "
+                  << names(event.get()) << std::endl;
+        return false;
+    }
+    event->set_capacity(5);
+    if (!event->store()) return false;
+    event = Event::next(db);
+    if (names(event.get()) != "b c d !a" || event->waiting_count() != 0) {
+        std::cerr << "capacity: raising did not promote: "
+                  << names(event.get()) << std::endl;
+        return false;
+    }
+    // Lowering keeps everyone going but the next one has to wait
+    event->set_capacity(1);
+    event->update_going("e", true);
+    if (!event->store()) return false;
+    event = Event::next(db);
+    if (names(event.get()) != "b c d ?e !a" || event->capacity() != 1) {
+        std::cerr << "capacity: unexpected list after lowering: "
+                  << names(event.get()) << std::endl;
+        return false;
+    }
+
+    // Two requests storing the same occurrence for the first time
+    db = open_db();
+    if (!db) return false;
+    event = Event::create(db, "weekly", now + 3600);
+    event->set_repeat(7, 0);
+    event->set_capacity(1);
+    if (!event->store()) return false;
+    auto first = Event::next(db);
+    auto second = Event::next(db);
+    if (!first || !second || first->capacity() != 1) return false;
+    first->update_going("a", true);
+    second->update_going("b", true);
+    if (!first->store() || !second->store()) {
+        std::cerr << "capacity: occurrence stored twice" << std::endl;
+        return false;
+    }
+    event = Event::next(db);
+    if (event->id() != first->id() || names(event.get()) != "a ?b") {
+        std::cerr << "capacity: unexpected occurrence list: "
+                  << names(event.get()) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_failed_commit() {
+    auto const path = g_dir + "/failed_commit.db";
+    std::shared_ptr<DB> db = SQLite3::open(path);
+    if (!db || db->bad() || !Event::setup(db.get())) return false;
+    // A rolled back nested transaction fails the outer one, which must
+    // not be left open
+    if (!db->start_transaction() || !db->start_transaction() ||
+        !db->rollback_transaction() || db->commit_transaction() ||
+        db->rollback_transaction()) {
+        std::cerr << "failed_commit: transaction left open" << std::endl;
+        return false;
+    }
+    if (!Event::create(db, "later", time(NULL) + 3600)->store()) return false;
+    db = SQLite3::open(path);
+    if (!db || Event::all(db).size() != 1) {
+        std::cerr << "failed_commit: later write lost" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int auto_vacuum(const std::string& path) {
+    sqlite3* db;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) return -1;
+    sqlite3_stmt* stmt;
+    int ret = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA auto_vacuum", -1, &stmt,
+                           nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            ret = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+    return ret;
+}
+
+// Databases created without auto_vacuum are converted by the first vacuum
+bool test_vacuum_convert() {
+    auto const path = g_dir + "/vacuum_convert.db";
+    sqlite3* raw;
+    if (sqlite3_open(path.c_str(), &raw) != SQLITE_OK) return false;
+    sqlite3_exec(raw, "PRAGMA auto_vacuum=NONE; CREATE TABLE old (id)",
+                 nullptr, nullptr, nullptr);
+    sqlite3_close(raw);
+    if (auto_vacuum(path) != 0) return false;
+    std::shared_ptr<DB> db = SQLite3::open(path);
+    if (!db || db->bad() || !Event::setup(db.get())) return false;
+    if (!db->incremental_vacuum(1) || !db->incremental_vacuum(1)) {
+        std::cerr << "vacuum_convert: vacuum failed: " << db->last_error()
+                  << std::endl;
+        return false;
+    }
+    if (auto_vacuum(path) != 2) {
+        std::cerr << "vacuum_convert: still not incremental" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A backup of a source that is written to between all steps must give up
+// instead of running forever or blocking the writer
+bool test_busy_backup() {
+    auto const path = g_dir + "/busy_backup.db";
+    auto const copy = g_dir + "/busy_backup_copy.db";
+    std::shared_ptr<DB> db = SQLite3::open(path);
+    if (!db || db->bad() || !Event::setup(db.get())) return false;
+    for (int i = 0; i < 200; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   time(NULL) + 3600 + i);
+        // Random text so that it isn't compressed
+        std::string text;
+        for (int j = 0; j < 2000; j++) text.push_back('a' + rand() % 26);
+        event->set_text(text);
+        if (!event->store()) return false;
+    }
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+        std::shared_ptr<DB> db = SQLite3::open(path);
+        auto event = Event::next(db);
+        for (int i = 0; !done; i++) {
+            event->update_going("user" + std::to_string(i % 10),
+                                i / 10 % 2);
+            event->store();
+            usleep(1000);
+        }
+    });
+    std::string error;
+    auto const ret = SQLite3::backup(path, copy, 1, 5, &error);
+    done = true;
+    writer.join();
+    if (ret || error.empty() || access(copy.c_str(), F_OK) == 0) {
+        std::cerr << "busy_backup: expected failure" << std::endl;
+        return false;
+    }
+    error.clear();
+    if (!SQLite3::backup(path, copy, 1, 0, &error)) {
+        std::cerr << "busy_backup: failed when idle: " << error << std::endl;
+        return false;
+    }
+    db = SQLite3::open(copy);
+    if (!db || Event::all(db).size() != 200) {
+        std::cerr << "busy_backup: copy is incomplete" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Joins and parts from many connections at once must not give out more
+// seats than there are
+bool test_concurrent_join() {
+    const int kThreads = 8;
+    const int kJoins = 10;
+    const size_t kCapacity = 10;
+    auto const path = g_dir + "/concurrent_join.db";
+    std::shared_ptr<DB> db = SQLite3::open(path);
+    if (!db || db->bad() || !Event::setup(db.get())) return false;
+    auto event = Event::create(db, "test", time(NULL) + 3600);
+    event->set_capacity(kCapacity);
+    if (!event->store()) return false;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+                std::shared_ptr<DB> db = SQLite3::open(path);
+                for (int j = 0; j < kJoins; j++) {
+                    auto event = db ? Event::next(db) : nullptr;
+                    if (!event) {
+                        failed++;
+                        continue;
+                    }
+                    event->update_going("user" + std::to_string(t) + "_" +
+                                        std::to_string(j), j != kJoins - 1);
+                    // Part again with the first one
+                    if (j == kJoins - 1) {
+                        event->update_going("user" + std::to_string(t) + "_0",
+                                            false);
+                    }
+                    if (!event->store()) failed++;
+                }
+            });
+    }
+    for (auto& thread : threads) thread.join();
+    if (failed) {
+        std::cerr << "concurrent_join: " << failed << " stores failed"
+                  << std::endl;
+        return false;
+    }
+    event = Event::next(db);
+    std::vector<Event::Going> going;
+    event->going(&going);
+    size_t seated = 0, waiting = 0, not_going = 0;
+    for (const auto& entry : going) {
+        if (!entry.is_going) {
+            not_going++;
+        } else if (entry.waiting) {
+            waiting++;
+        } else {
+            seated++;
+        }
+    }
+    auto const joined = static_cast<size_t>(kThreads * (kJoins - 2));
+    event = Event::next(db);
+    if (seated != kCapacity || waiting != joined - kCapacity ||
+        not_going != static_cast<size_t>(kThreads * 2) ||
+        event->going_count() != seated ||
+        event->waiting_count() != waiting ||
+        event->not_going_count() != not_going) {
+        std::cerr << "concurrent_join: " << seated << " going, "
+                  << waiting << " waiting, " << not_going
+                  << " not going, counted " << event->going_count()
+                  << ", " << event->waiting_count() << ", "
+                  << event->not_going_count() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Users as "name:going/waiting/not_going" ordered by name
+std::string stats(DB* db, size_t* events) {
+    std::vector<Event::UserStats> users;
+    if (!Event::stats(db, events, &users)) return "failed";
+    std::sort(users.begin(), users.end(),
+              [](const Event::UserStats& u1, const Event::UserStats& u2) {
+                  return u1.name < u2.name;
+              });
+    std::string ret;
+    for (const auto& user : users) {
+        if (!ret.empty()) ret.push_back(' ');
+        ret.append(user.name + ":" + std::to_string(user.going) + "/" +
+                   std::to_string(user.waiting) + "/" +
+                   std::to_string(user.not_going));
+    }
+    return ret;
+}
+
+bool test_stats() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "first", now + 3600);
+    event->update_going("a", true);
+    event->update_going("b", false);
+    if (!event->store()) return false;
+    event = Event::create(db, "second", now + 7200);
+    event->set_capacity(1);
+    if (!event->store()) return false;
+    auto events = Event::all(db);
+    events[1]->update_going("a", true);
+    events[1]->update_going("b", true);
+    events[1]->update_going("c", true);
+    if (!events[1]->store()) return false;
+    size_t count;
+    if (stats(db.get(), &count) != "a:2/0/0 b:0/1/1 c:0/1/0" || count != 2) {
+        std::cerr << "stats: unexpected counts: " << stats(db.get(), &count)
+                  << std::endl;
+        return false;
+    }
+    // b gets the seat
+    events[1]->update_going("a", false);
+    if (!events[1]->store()) return false;
+    event = Event::create(db, "weekly", now + 10800);
+    event->set_repeat(7, 0);
+    if (!event->store()) return false;
+    events = Event::all(db);
+    events[2]->update_going("c", false);
+    events[3]->update_going("c", true);
+    if (!events[2]->store() || !events[3]->store()) return false;
+    auto const expected = "a:1/0/1 b:1/0/1 c:1/1/1";
+    if (stats(db.get(), &count) != expected || count != 4) {
+        std::cerr << "stats: unexpected counts after update: "
+                  << stats(db.get(), &count) << ", " << count << " events"
+                  << std::endl;
+        return false;
+    }
+    if (!Event::rebuild_stats(db.get()) ||
+        stats(db.get(), &count) != expected || count != 4) {
+        std::cerr << "stats: rebuild differs: " << stats(db.get(), &count)
+                  << std::endl;
+        return false;
+    }
+    // Canceling takes them back, expiring doesn't
+    if (!events[2]->remove() || Event::expire(db.get(), now + 5000, 10) != 1 ||
+        stats(db.get(), &count) != "a:1/0/1 b:1/0/1 c:0/1/0" || count != 2) {
+        std::cerr << "stats: unexpected counts after remove: "
+                  << stats(db.get(), &count) << ", " << count << " events"
+                  << std::endl;
+        return false;
+    }
+    std::stringstream out;
+    auto copy = open_db();
+    std::string error;
+    if (!Event::dump(db.get(), &out) || !copy ||
+        !Event::restore(copy.get(), &out, 100, &error) ||
+        stats(copy.get(), &count) != "a:1/0/1 b:1/0/1 c:0/1/0" ||
+        count != 2) {
+        std::cerr << "stats: not restored: " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// An agenda long enough to be compressed, with word somewhere in the middle
+std::string agenda(const std::string& word) {
+    std::string ret;
+    for (int i = 0; i < 50; i++) {
+        ret += std::to_string(i) + ". Item number " + std::to_string(i) +
+            (i == 25 ? " " + word : "") + "\n";
+    }
+    return ret;
+}
+
+bool test_compressed() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "meeting", now + 3600);
+    event->set_text(agenda("budget"));
+    event->update_going("a", true, agenda("snacks"));
+    if (!event->store()) return false;
+    event = Event::create(db, "short", now + 7200);
+    event->set_text("budget");
+    if (!event->store()) return false;
+    auto snapshot = db->select_columns("events",
+                                       std::vector<std::string>(1, "text"),
+                                       DB::Column("name") ==
+                                       DB::Value(std::string("meeting")));
+    std::vector<uint8_t> data;
+    if (!snapshot || !snapshot->get(0, &data) ||
+        data.size() >= agenda("budget").size()) {
+        std::cerr << "compressed: text not compressed" << std::endl;
+        return false;
+    }
+    auto events = Event::find(db, "budget", 10);
+    Event::Going going("", false, "", 0);
+    // The short one is the better match
+    if (events.size() != 2 || events[1]->text() != agenda("budget") ||
+        !events[1]->find_going("a", &going) ||
+        going.note != agenda("snacks")) {
+        std::cerr << "compressed: not read back" << std::endl;
+        return false;
+    }
+    // The index drops the old words
+    events[1]->set_text(agenda("travel"));
+    events[1]->update_going("a", true, "short");
+    if (!events[1]->store() || Event::find(db, "budget", 10).size() != 1 ||
+        Event::find(db, "travel", 10).size() != 1) {
+        std::cerr << "compressed: index not updated" << std::endl;
+        return false;
+    }
+    // Occurrences copy the text without uncompressing it
+    event = Event::create(db, "weekly", now + 10800);
+    event->set_text(agenda("coffee"));
+    event->set_repeat(7, 0);
+    if (!event->store()) return false;
+    events = Event::all(db);
+    events[3]->update_going("a", false);
+    if (!events[3]->store() || Event::find(db, "coffee", 10).size() != 2) {
+        std::cerr << "compressed: occurrence not stored" << std::endl;
+        return false;
+    }
+    std::stringstream out;
+    auto copy = open_db();
+    std::string error;
+    if (!Event::dump(db.get(), &out) ||
+        out.str().find("travel") == std::string::npos || !copy ||
+        !Event::restore(copy.get(), &out, 100, &error) ||
+        Event::find(copy, "travel", 10).size() != 1 ||
+        Event::find(copy, "coffee", 10).size() != 2) {
+        std::cerr << "compressed: not restored: " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Tools that only have SQLite, such as the sqlite3 shell, can still modify
+// events
+bool test_other_tools() {
+    auto const path = g_dir + "/other_tools.db";
+    std::shared_ptr<DB> db = SQLite3::open(path);
+    if (!db || db->bad() || !Event::setup(db.get())) return false;
+    auto event = Event::create(db, "meeting", time(NULL) + 3600);
+    event->set_text(agenda("budget"));
+    if (!event->store()) return false;
+    sqlite3* raw;
+    if (sqlite3_open(path.c_str(), &raw) != SQLITE_OK) return false;
+    char* error = nullptr;
+    auto const ret = sqlite3_exec(raw, "UPDATE events SET name='other';"
+                                  "DELETE FROM events", nullptr, nullptr,
+                                  &error);
+    if (ret != SQLITE_OK) {
+        std::cerr << "other_tools: " << (error ? error : "failed")
+                  << std::endl;
+    }
+    sqlite3_free(error);
+    sqlite3_close(raw);
+    return ret == SQLITE_OK && Event::all(db).empty() &&
+        Event::find(db, "budget", 10).empty();
+}
+
+bool test_remove_many() {
+    auto db = open_db();
+    if (!db) return false;
+    for (int i = 0; i < 6; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   time(NULL) + 3600 * (i + 1));
+        event->update_going("user", true);
+        if (!event->store()) return false;
+    }
+    auto events = Event::all(db);
+    std::vector<Event*> remove;
+    remove.push_back(events[0].get());
+    remove.push_back(events[2].get());
+    remove.push_back(events[5].get());
+    if (!Event::remove(db.get(), remove) || events[2]->id() != 0) {
+        std::cerr << "remove_many: remove failed" << std::endl;
+        return false;
+    }
+    events = Event::all(db);
+    if (events.size() != 3 || events[0]->name() != "event1" ||
+        events[2]->name() != "event4" || rows(db) != 3) {
+        std::cerr << "remove_many: unexpected events left" << std::endl;
+        return false;
+    }
+    size_t going = 0;
+    auto snapshot = db->select("events_going");
+    if (snapshot) {
+        do {
+            going++;
+        } while (snapshot->next());
+    }
+    if (going != 3) {
+        std::cerr << "remove_many: going rows left" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Changes to an event from all() show before its going list is loaded,
+// also when no event has any going rows yet
+bool test_update_unloaded() {
+    auto db = open_db();
+    if (!db) return false;
+    auto const now = time(NULL);
+    if (!Event::create(db, "first", now + 3600)->store() ||
+        !Event::create(db, "second", now + 7200)->store()) {
+        return false;
+    }
+    auto events = Event::all(db);
+    if (events.size() != 2) return false;
+    events[0]->update_going("joe", true);
+    std::vector<Event::Going> going;
+    events[0]->going(&going);
+    if (!events[0]->is_going("joe") || going.size() != 1 ||
+        events[1]->is_going("joe")) {
+        std::cerr << "update_unloaded: change not shown" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_migrate() {
+    std::shared_ptr<DB> db = SQLite3::open(":memory:");
+    if (!db || db->bad()) return false;
+    // Version 1 had the user name in each going row and no users table
+    DB::Declaration decl;
+    decl.push_back(std::make_pair("id", DB::PrimaryKey(DB::Type::INT64)));
+    decl.push_back(std::make_pair("name", DB::NotNull(DB::Type::STRING)));
+    decl.push_back(std::make_pair("start", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("text", DB::Type::STRING));
+    if (!db->insert_table("events", decl)) return false;
+    decl.clear();
+    decl.push_back(std::make_pair("event", DB::NotNull(DB::Type::INT64)));
+    decl.push_back(std::make_pair("name", DB::NotNull(DB::Type::STRING)));
+    decl.push_back(std::make_pair("is_going", DB::NotNull(DB::Type::BOOL)));
+    decl.push_back(std::make_pair("note", DB::Type::STRING));
+    decl.push_back(std::make_pair("added", DB::NotNull(DB::Type::INT64)));
+    if (!db->insert_table("events_going", decl)) return false;
+    if (Event::is_setup(db.get())) {
+        std::cerr << "migrate: old version is set up" << std::endl;
+        return false;
+    }
+    auto const start = static_cast<int64_t>(time(NULL) + 3600);
+    for (int64_t id = 1; id <= 2; id++) {
+        auto editor = db->insert("events");
+        editor->set("id", id);
+        editor->set("name", "event" + std::to_string(id));
+        editor->set("start", start + id);
+        if (!editor->commit()) return false;
+        for (auto name : { "a", "b" }) {
+            editor = db->insert("events_going");
+            editor->set("event", id);
+            editor->set("name", name);
+            editor->set("is_going", id == 1);
+            editor->set("note", std::string(name) == "b" ? "note" : "");
+            editor->set("added", static_cast<int64_t>(name[0]));
+            if (!editor->commit()) return false;
+        }
+    }
+    if (!Event::setup(db.get()) || !Event::setup(db.get()) ||
+        !Event::is_setup(db.get())) {
+        std::cerr << "migrate: setup failed: " << db->last_error()
+                  << std::endl;
+        return false;
+    }
+    auto events = Event::all(db);
+    if (events.size() != 2 || events[0]->going_count() != 2 ||
+        events[1]->not_going_count() != 2) {
+        std::cerr << "migrate: counters not set" << std::endl;
+        return false;
+    }
+    Event::Going going("", false, "", 0);
+    if (names(events[0].get()) != "a b" ||
+        names(events[1].get()) != "!a !b" ||
+        !events[1]->find_going("b", &going) || going.note != "note") {
+        std::cerr << "migrate: going lists not kept" << std::endl;
+        return false;
+    }
+    auto snapshot = db->select("users");
+    int users = 0;
+    if (snapshot) {
+        do {
+            users++;
+        } while (snapshot->next());
+    }
+    if (users != 2) {
+        std::cerr << "migrate: expected two users, got " << users
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    unsigned int ok = 0, tot = 0;
+
+    char dir[] = "/tmp/test-event-XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "unable to create " << dir << std::endl;
+        return EXIT_FAILURE;
+    }
+    g_dir = dir;
+
+    tot++; if (test_going_order()) ok++;
+    tot++; if (test_many()) ok++;
+    tot++; if (test_names()) ok++;
+    tot++; if (test_counts()) ok++;
+    tot++; if (test_repeat()) ok++;
+    tot++; if (test_between()) ok++;
+    tot++; if (test_headers()) ok++;
+    tot++; if (test_dump()) ok++;
+    tot++; if (test_capacity()) ok++;
+    tot++; if (test_failed_commit()) ok++;
+    tot++; if (test_vacuum_convert()) ok++;
+    tot++; if (test_busy_backup()) ok++;
+    tot++; if (test_concurrent_join()) ok++;
+    tot++; if (test_stats()) ok++;
+    tot++; if (test_compressed()) ok++;
+    tot++; if (test_other_tools()) ok++;
+    tot++; if (test_remove_many()) ok++;
+    tot++; if (test_update_unloaded()) ok++;
+    tot++; if (test_migrate()) ok++;
+
+    if (system(("rm -rf " + g_dir).c_str()) != 0) {
+        std::cerr << "unable to remove " << g_dir << std::endl;
+        tot++;
+    }
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -72,6 +72,55 @@ bool test_quote() {
     return true;
 }
 
+bool test_parse() {
+    auto obj = JsonObject::parse(
+            " {\"s\":\"a\\\"b\\\\c\\n\\u00e5\\ud83d\\ude00\", \"i\": -42,"
+            "\"big\":9223372036854775807,\"d\":1.5e2,\"t\":true,"
+            "\"f\":false,\"n\":null,\"o\":{\"a\":[1,\"x\",[]]}} ");
+    if (!obj) {
+        std::cerr << "parse: failed" << std::endl;
+        return false;
+    }
+    std::shared_ptr<JsonObject> o;
+    std::shared_ptr<JsonArray> a;
+    if (!test_equal("parse", obj->get("s", ""),
+                    "a\"b\\c\n\xc3\xa5\xf0\x9f\x98\x80") ||
+        obj->get("i", static_cast<int64_t>(0)) != -42 ||
+        obj->get("big", static_cast<int64_t>(0)) != INT64_MAX ||
+        obj->get("d", 0.0) != 150.0 || !obj->get("t", false) ||
+        obj->get("f", true) || !obj->is_null("n") ||
+        !obj->get("o", &o) || !o->get("a", &a) || a->size() != 3 ||
+        a->get(0, static_cast<int64_t>(0)) != 1 ||
+        a->get(1, "") != std::string("x")) {
+        std::cerr << "parse: unexpected values" << std::endl;
+        return false;
+    }
+    // What str() writes is read back
+    obj = JsonObject::create();
+    obj->put("s", std::string("\x01\t\"\\ \xc3\xa5", 7));
+    obj = JsonObject::parse(obj->str());
+    if (!obj || obj->get("s", "") !=
+        std::string("\x01\t\"\\ \xc3\xa5", 7)) {
+        std::cerr << "parse: round trip failed" << std::endl;
+        return false;
+    }
+    for (const char* bad : {"", "[]", "{", "{\"a\"}", "{\"a\":}",
+                "{\"a\":1,}", "{\"a\":01}", "{\"a\":\"\\x\"}",
+                "{\"a\":\"\\udc00\"}", "{} {}", "{\"a\":tru}"}) {
+        if (JsonObject::parse(bad)) {
+            std::cerr << "parse: accepted '" << bad << "'" << std::endl;
+            return false;
+        }
+    }
+    std::string deep;
+    for (int i = 0; i < 1000; i++) deep += "{\"a\":";
+    if (JsonObject::parse(deep + "1" + std::string(1000, '}'))) {
+        std::cerr << "parse: too deep accepted" << std::endl;
+        return false;
+    }
+    return true;
+}
+
 }  // namespace
 
 int main() {
@@ -79,6 +128,7 @@ int main() {
 
     tot++; if (test_simple()) ok++;
     tot++; if (test_quote()) ok++;
+    tot++; if (test_parse()) ok++;
 
     std::cout << "OK " << ok << "/" << tot << std::endl;
     return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -0,0 +1,505 @@
+#include "common.hh"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+#include "db.hh"
+#include "event.hh"
+#include "log_db.hh"
+
+using namespace stuff;
+
+namespace {
+
+std::string g_dir;
+
+std::shared_ptr<DB> open_db(const std::string& name) {
+    std::shared_ptr<DB> db = LogDB::open(g_dir + "/" + name);
+    if (!db || db->bad()) {
+        std::cerr << name << ": unable to open database";
+        if (db) std::cerr << ": " << db->last_error();
+        std::cerr << std::endl;
+        return nullptr;
+    }
+    if (!Event::setup(db.get())) {
+        std::cerr << name << ": unable to setup database: "
+                  << db->last_error() << std::endl;
+        return nullptr;
+    }
+    return db;
+}
+
+bool test_persist() {
+    auto db = open_db("persist");
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "second", now + 7200);
+    event->set_text("text");
+    if (!event->store()) return false;
+    event = Event::create(db, "first", now + 3600);
+    event->update_going("user1", true, "note");
+    event->update_going("user2", false);
+    if (!event->store()) return false;
+    db.reset();
+    db = open_db("persist");
+    if (!db) return false;
+    auto events = Event::all(db);
+    if (events.size() != 2 || events[0]->name() != "first" ||
+        events[1]->name() != "second" || events[1]->text() != "text") {
+        std::cerr << "persist: unexpected events" << std::endl;
+        return false;
+    }
+    std::vector<Event::Going> going;
+    events[0]->going(&going);
+    if (going.size() != 2 || going[0].name() != "user1" ||
+        going[0].note != "note" || !going[0].is_going ||
+        going[1].name() != "user2" || going[1].is_going) {
+        std::cerr << "persist: unexpected going" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_shared() {
+    auto db1 = open_db("shared");
+    auto db2 = open_db("shared");
+    if (!db1 || !db2) return false;
+    if (!Event::create(db1, "event", time(NULL) + 3600)->store()) return false;
+    auto event = Event::next(db2);
+    if (!event || event->name() != "event") {
+        std::cerr << "shared: event not seen by other connection"
+                  << std::endl;
+        return false;
+    }
+    event->update_going("user", true);
+    if (!event->store()) return false;
+    event = Event::next(db1);
+    if (!event->is_going("user")) {
+        std::cerr << "shared: going not seen by other connection"
+                  << std::endl;
+        return false;
+    }
+    if (!event->remove() || Event::next(db2)) {
+        std::cerr << "shared: remove not seen by other connection"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_compact() {
+    auto db = open_db("compact");
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 10; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   now + 3600 + i);
+        if (!event->store()) return false;
+    }
+    auto other = open_db("compact");
+    if (!other) return false;
+    for (auto& event : Event::all(db)) {
+        event->update_going("user", true);
+        if (!event->store()) return false;
+    }
+    Event::all(db).front()->remove();
+    if (!db->incremental_vacuum(1)) {
+        std::cerr << "compact: failed: " << db->last_error() << std::endl;
+        return false;
+    }
+    Event::create(db, "last", now + 7200)->store();
+    // Other connection must notice the compaction
+    auto events = Event::all(other);
+    if (events.size() != 10 || !events[0]->is_going("user") ||
+        events.back()->name() != "last") {
+        std::cerr << "compact: unexpected events in other connection"
+                  << std::endl;
+        return false;
+    }
+    db.reset();
+    other.reset();
+    db = open_db("compact");
+    if (!db) return false;
+    events = Event::all(db);
+    if (events.size() != 10 || !events[0]->is_going("user")) {
+        std::cerr << "compact: unexpected events after reopen" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// After a compaction the log can grow back to the exact size another
+// connection has read, it must still notice
+bool test_regrow() {
+    auto db = open_db("regrow");
+    if (!db || !db->incremental_vacuum(1)) return false;
+    auto other = open_db("regrow");
+    if (!other) return false;
+    auto const start = time(NULL) + 3600;
+    if (!Event::create(db, "a", start)->store() ||
+        Event::all(other).size() != 1) {
+        return false;
+    }
+    if (!db->incremental_vacuum(1) ||
+        !Event::create(db, "b", start)->store()) {
+        return false;
+    }
+    if (Event::all(other).size() != 2) {
+        std::cerr << "regrow: other connection missed the change"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_backup() {
+    auto db = open_db("backup");
+    if (!db) return false;
+    auto const start = time(NULL) + 3600;
+    if (!Event::create(db, "compacted", start)->store() ||
+        !db->incremental_vacuum(1) ||
+        !Event::create(db, "logged", start + 1)->store()) {
+        return false;
+    }
+    if (!LogDB::backup(g_dir + "/backup", g_dir + "/backup-copy")) {
+        std::cerr << "backup: failed" << std::endl;
+        return false;
+    }
+    auto copy = open_db("backup-copy");
+    if (!copy) return false;
+    auto events = Event::all(copy);
+    if (events.size() != 2 || events[0]->name() != "compacted" ||
+        events[1]->name() != "logged") {
+        std::cerr << "backup: unexpected events in copy" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_rollback() {
+    auto db = open_db("rollback");
+    if (!db) return false;
+    if (!Event::create(db, "keep", time(NULL) + 3600)->store()) return false;
+    {
+        DB::Transaction transaction(db);
+        Event::create(db, "drop", time(NULL) + 3600)->store();
+    }
+    auto events = Event::all(db);
+    if (events.size() != 1 || events[0]->name() != "keep") {
+        std::cerr << "rollback: unexpected events" << std::endl;
+        return false;
+    }
+    // A rolled back nested transaction fails the outer one, which must
+    // not be left open
+    if (!db->start_transaction() || !db->start_transaction() ||
+        !db->rollback_transaction() || db->commit_transaction() ||
+        db->rollback_transaction()) {
+        std::cerr << "rollback: outer transaction left open" << std::endl;
+        return false;
+    }
+    if (!Event::create(db, "later", time(NULL) + 7200)->store()) return false;
+    db = open_db("rollback");
+    if (!db || Event::all(db).size() != 2) {
+        std::cerr << "rollback: later write lost" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_capacity() {
+    const int kThreads = 4;
+    const int kJoins = 10;
+    auto db = open_db("capacity");
+    if (!db) return false;
+    auto event = Event::create(db, "event", time(NULL) + 3600);
+    event->set_capacity(5);
+    if (!event->store()) return false;
+    // Each connection holds its own lock on the file
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+                auto db = open_db("capacity");
+                for (int j = 0; j < kJoins; j++) {
+                    auto event = db ? Event::next(db) : nullptr;
+                    if (!event) {
+                        failed++;
+                        continue;
+                    }
+                    event->update_going("user" + std::to_string(t) + "_" +
+                                        std::to_string(j), true);
+                    if (!event->store()) failed++;
+                }
+            });
+    }
+    for (auto& thread : threads) thread.join();
+    event = Event::next(db);
+    if (failed || !event || event->going_count() != 5 ||
+        event->waiting_count() != kThreads * kJoins - 5) {
+        std::cerr << "capacity: " << failed << " failed, "
+                  << (event ? event->going_count() : 0) << " going"
+                  << std::endl;
+        return false;
+    }
+    std::vector<Event::Going> going;
+    event->going(&going);
+    auto const promoted = going[5].name();
+    event->update_going(going[0].name(), false);
+    if (!event->store()) return false;
+    db = open_db("capacity");
+    event = db ? Event::next(db) : nullptr;
+    if (!event || !event->is_going(promoted) || event->going_count() != 5 ||
+        event->waiting_count() != kThreads * kJoins - 6) {
+        std::cerr << "capacity: waitlist not promoted" << std::endl;
+        return false;
+    }
+    // Statistics were kept in step by all the connections
+    size_t events = 0;
+    std::vector<Event::UserStats> users;
+    if (!Event::stats(db.get(), &events, &users) || events != 1 ||
+        users.size() != kThreads * kJoins) {
+        std::cerr << "capacity: unexpected stats" << std::endl;
+        return false;
+    }
+    size_t seats = 0, waiting = 0, not_going = 0;
+    for (const auto& user : users) {
+        seats += user.going;
+        waiting += user.waiting;
+        not_going += user.not_going;
+    }
+    if (seats != 5 || waiting != kThreads * kJoins - 6 || not_going != 1) {
+        std::cerr << "capacity: stats " << seats << "/" << waiting << "/"
+                  << not_going << std::endl;
+        return false;
+    }
+    return true;
+}
+
+size_t count(std::shared_ptr<DB::Snapshot> snapshot) {
+    size_t ret = 0;
+    if (snapshot) {
+        do {
+            ret++;
+        } while (snapshot->next());
+    }
+    return ret;
+}
+
+bool test_conditions() {
+    auto db = open_db("conditions");
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 5; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   now + 3600 * (i + 1));
+        if (!event->store()) return false;
+    }
+    std::vector<DB::Value> ids;
+    ids.emplace_back(static_cast<int64_t>(1));
+    ids.emplace_back(static_cast<int64_t>(3));
+    ids.emplace_back(static_cast<int64_t>(3));
+    ids.emplace_back(static_cast<int64_t>(7));
+    if (count(db->select("events",
+                         DB::Condition("id", DB::Condition::IN, ids))) != 2) {
+        std::cerr << "conditions: unexpected result for IN" << std::endl;
+        return false;
+    }
+    std::vector<DB::Value> names;
+    names.emplace_back(std::string("event0"));
+    names.emplace_back(std::string("event4"));
+    if (count(db->select("events",
+                         DB::Condition("name", DB::Condition::IN,
+                                       names))) != 2) {
+        std::cerr << "conditions: unexpected result for IN on names"
+                  << std::endl;
+        return false;
+    }
+    DB::Condition between("start", DB::Condition::BETWEEN,
+                          static_cast<int64_t>(now + 7200),
+                          static_cast<int64_t>(now + 14400));
+    if (count(db->select("events", between)) != 3 ||
+        count(db->select("events",
+                         DB::Condition(between, DB::Condition::AND,
+                                       DB::Condition("name",
+                                                     DB::Condition::IN,
+                                                     names)))) != 0) {
+        std::cerr << "conditions: unexpected result for BETWEEN"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_select_columns() {
+    auto db = open_db("select_columns");
+    if (!db) return false;
+    auto const now = time(NULL);
+    for (int i = 0; i < 5; i++) {
+        auto event = Event::create(db, "event" + std::to_string(i),
+                                   now + 3600 * (5 - i));
+        event->set_text("text");
+        if (!event->store()) return false;
+    }
+    std::vector<std::string> columns;
+    columns.push_back("start");
+    columns.push_back("name");
+    auto snapshot = db->select_columns("events", columns,
+                                       DB::Condition("id",
+                                                     DB::Condition::NOT_EQUAL,
+                                                     static_cast<int64_t>(1)),
+                                       std::vector<DB::OrderBy>(
+                                               1, DB::OrderBy("start")),
+                                       3);
+    std::string name, text;
+    int64_t start;
+    if (!snapshot || !snapshot->get(0, &start) || start != now + 3600 ||
+        !snapshot->get(1, &name) || name != "event4" ||
+        snapshot->get("text", &text) || snapshot->get(2, &text) ||
+        !snapshot->get("name", &name)) {
+        std::cerr << "select_columns: unexpected first row" << std::endl;
+        return false;
+    }
+    if (!snapshot->next() || !snapshot->next() || !snapshot->get(1, &name) ||
+        name != "event2" || snapshot->next()) {
+        std::cerr << "select_columns: unexpected rows" << std::endl;
+        return false;
+    }
+    columns.push_back("nothing");
+    if (db->select_columns("events", columns) ||
+        count(db->select_columns("events", std::vector<std::string>(
+                                         1, "id"))) != 5) {
+        std::cerr << "select_columns: unexpected result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_dump() {
+    auto db = open_db("dump");
+    if (!db) return false;
+    auto const now = time(NULL);
+    auto event = Event::create(db, "Board games", now + 3600);
+    event->update_going("user", true, "note");
+    if (!event->store()) return false;
+    event = Event::create(db, "Lunch", now + 7200);
+    event->set_repeat(1, 0);
+    if (!event->store()) return false;
+    std::stringstream out;
+    std::string error;
+    auto copy = open_db("dump_copy");
+    if (!Event::dump(db.get(), &out) || !copy ||
+        !Event::restore(copy.get(), &out, 100, &error)) {
+        std::cerr << "dump: failed: " << error << std::endl;
+        return false;
+    }
+    copy.reset();
+    copy = open_db("dump_copy");
+    if (!copy) return false;
+    auto events = Event::all(copy);
+    if (events.size() < 2 || events[0]->name() != "Board games" ||
+        !events[0]->is_going("user") || events[1]->series() == 0 ||
+        Event::find(copy, "board", 10).size() != 1) {
+        std::cerr << "dump: unexpected events after restore" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_search() {
+    auto db = open_db("search");
+    if (!db) return false;
+    auto const now = time(NULL);
+    Event::create(db, "Board games", now + 3600)->store();
+    auto event = Event::create(db, "Old board games", now - 7200);
+    event->set_text("More board games");
+    event->store();
+    // Long enough to be stored compressed
+    std::string text;
+    for (int i = 0; i < 50; i++) text += "Pizza and drinks, ";
+    event = Event::create(db, "Dinner", now + 7200);
+    event->set_text(text + "then board games");
+    event->store();
+    Event::create(db, "Lunch", now + 3600)->store();
+    // Compacting keeps the text index
+    if (!db->incremental_vacuum(1)) return false;
+    db.reset();
+    db = open_db("search");
+    if (!db) return false;
+    auto events = Event::find(db, "BOARD games", 10);
+    auto const dinner = Event::find(db, "pizza", 10);
+    if (events.size() != 3 || events[0]->name() != "Old board games" ||
+        events[1]->name() != "Board games" ||
+        Event::find(db, "board", 1).size() != 1 ||
+        !Event::find(db, "board lunch", 10).empty() || dinner.size() != 1 ||
+        dinner[0]->text() != text + "then board games") {
+        std::cerr << "search: unexpected result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_rename() {
+    auto db = open_db("rename");
+    if (!db) return false;
+    DB::Declaration decl;
+    decl.push_back(std::make_pair("name", DB::Unique(DB::Type::STRING)));
+    if (!db->insert_table("old", decl)) return false;
+    auto editor = db->insert("old");
+    editor->set("name", "a");
+    if (!editor->commit()) return false;
+    if (!db->rename_table("old", "new") ||
+        db->rename_table("old", "other") ||
+        db->rename_table("new", "events")) {
+        std::cerr << "rename: unexpected result" << std::endl;
+        return false;
+    }
+    db.reset();
+    db = open_db("rename");
+    if (!db) return false;
+    if (count(db->select("new")) != 1 || db->select("old")) {
+        std::cerr << "rename: table not renamed" << std::endl;
+        return false;
+    }
+    editor = db->insert("new");
+    editor->set("name", "a");
+    if (editor->commit()) {
+        std::cerr << "rename: unique constraint lost" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    char tmp[] = "/tmp/test-log-db-XXXXXX";
+    if (!mkdtemp(tmp)) {
+        std::cerr << "Unable to create temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    g_dir = tmp;
+
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_persist()) ok++;
+    tot++; if (test_shared()) ok++;
+    tot++; if (test_compact()) ok++;
+    tot++; if (test_regrow()) ok++;
+    tot++; if (test_backup()) ok++;
+    tot++; if (test_rollback()) ok++;
+    tot++; if (test_capacity()) ok++;
+    tot++; if (test_conditions()) ok++;
+    tot++; if (test_select_columns()) ok++;
+    tot++; if (test_dump()) ok++;
+    tot++; if (test_search()) ok++;
+    tot++; if (test_rename()) ok++;
+
+    system(("rm -rf " + g_dir).c_str());
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
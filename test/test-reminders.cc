@@ -0,0 +1,294 @@
+#include "common.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+
+#include "reminders.hh"
+#include "timer_wheel.hh"
+
+using namespace stuff;
+
+namespace {
+
+const time_t kStart = 1700000000;
+
+uint32_t g_seed = 42;
+
+uint32_t rand32() {
+    g_seed = g_seed * 1103515245 + 12345;
+    return g_seed >> 8;
+}
+
+bool test_wheel_order() {
+    TimerWheel wheel(kStart);
+    std::vector<time_t> deadlines;
+    // Spread over all the wheels but the last, some already passed
+    for (uint32_t id = 0; id < 2000; id++) {
+        time_t deadline = kStart - 10 + rand32() % (1 << (6 * (id % 4 + 1)));
+        deadlines.push_back(deadline);
+        wheel.add(id, deadline);
+    }
+    size_t fired = 0;
+    bool ret = true;
+    while (wheel.size() > 0) {
+        wheel.advance(wheel.now() + 1, [&](uint32_t id) {
+                fired++;
+                auto const expected = std::max(deadlines[id], kStart + 1);
+                if (wheel.now() != expected) {
+                    std::cerr << "wheel_order: " << id << " fired at "
+                              << wheel.now() << ", expected " << expected
+                              << std::endl;
+                    ret = false;
+                }
+            });
+    }
+    if (fired != deadlines.size()) {
+        std::cerr << "wheel_order: fired " << fired << std::endl;
+        return false;
+    }
+    return ret;
+}
+
+bool test_wheel_far() {
+    TimerWheel wheel(kStart);
+    // Beyond what the wheels cover
+    time_t const far = kStart + (static_cast<time_t>(1) << 31);
+    wheel.add(0, far);
+    wheel.add(1, kStart + 100);
+    std::vector<uint32_t> fired;
+    auto const record = [&](uint32_t id) { fired.push_back(id); };
+    wheel.advance(far - 1, record);
+    if (fired.size() != 1 || fired[0] != 1 || !wheel.contains(0)) {
+        std::cerr << "wheel_far: fired too early" << std::endl;
+        return false;
+    }
+    wheel.advance(far, record);
+    if (fired.size() != 2 || wheel.size() != 0) {
+        std::cerr << "wheel_far: not fired" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_wheel_remove() {
+    TimerWheel wheel(kStart);
+    for (uint32_t id = 0; id < 100; id++) {
+        wheel.add(id, kStart + 10 + id % 3);
+    }
+    for (uint32_t id = 0; id < 100; id += 2) wheel.remove(id);
+    // Moved, further away
+    wheel.add(1, kStart + 5000);
+    std::vector<int> fired(100);
+    wheel.advance(kStart + 100, [&](uint32_t id) {
+            fired[id]++;
+            if (id == 9) {
+                // 11 is in a later tick, 0 fires right away
+                wheel.remove(11);
+                wheel.add(0, kStart);
+            }
+        });
+    for (uint32_t id = 0; id < 100; id++) {
+        int const expected = id == 0 || (id % 2 == 1 && id != 1 && id != 11);
+        if (fired[id] != expected) {
+            std::cerr << "wheel_remove: " << id << " fired " << fired[id]
+                      << " times" << std::endl;
+            return false;
+        }
+    }
+    if (wheel.size() != 1 || !wheel.contains(1) || wheel.timeout() < 0) {
+        std::cerr << "wheel_remove: unexpected state" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_wheel_timeout() {
+    TimerWheel wheel(kStart);
+    if (wheel.timeout() != -1) return false;
+    wheel.add(7, kStart + 3 * 3600);
+    size_t fired = 0, wakeups = 0;
+    while (wheel.size() > 0) {
+        auto const timeout = wheel.timeout();
+        if (timeout <= 0 || timeout > 4096) {
+            std::cerr << "wheel_timeout: bad timeout " << timeout
+                      << std::endl;
+            return false;
+        }
+        wakeups++;
+        wheel.advance(wheel.now() + timeout, [&](uint32_t) { fired++; });
+    }
+    if (fired != 1 || wheel.now() != kStart + 3 * 3600 ||
+        wakeups > 3 + 64) {
+        std::cerr << "wheel_timeout: fired " << fired << " at "
+                  << wheel.now() << " after " << wakeups << " wakeups"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_wheel_many() {
+    TimerWheel wheel(kStart);
+    uint32_t const count = 300000;
+    for (uint32_t id = 0; id < count; id++) {
+        wheel.add(id, kStart + 1 + rand32() % (30 * 86400));
+    }
+    for (uint32_t id = 0; id < count; id += 3) wheel.remove(id);
+    for (uint32_t id = 1; id < count; id += 3) {
+        wheel.add(id, kStart + 1 + rand32() % 86400);
+    }
+    if (wheel.size() != count - (count + 2) / 3) {
+        std::cerr << "many: unexpected size " << wheel.size() << std::endl;
+        return false;
+    }
+    size_t fired = 0;
+    bool removed = false;
+    wheel.advance(kStart + 86400, [&](uint32_t id) {
+            if (id % 3 == 0) removed = true;
+            fired++;
+        });
+    if (removed || fired < count / 3 || wheel.size() != count -
+        (count + 2) / 3 - fired) {
+        std::cerr << "many: fired " << fired << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool test_encode() {
+    Reminders::Reminder reminder;
+    reminder.id = -12345678901;
+    reminder.at = kStart;
+    reminder.days = 7;
+    reminder.until = kStart + 86400 * 70;
+    reminder.message = std::string("hello\0world", 11);
+    std::string data;
+    Reminders::encode(reminder, &data);
+    Reminders::Reminder out;
+    if (!Reminders::decode(data, &out) || out.id != reminder.id ||
+        out.at != reminder.at || out.days != reminder.days ||
+        out.until != reminder.until || out.message != reminder.message) {
+        std::cerr << "encode: round trip failed" << std::endl;
+        return false;
+    }
+    reminder.at = 0;
+    data.clear();
+    Reminders::encode(reminder, &data);
+    if (!Reminders::decode(data, &out) || out.at != 0 || out.id != reminder.id ||
+        Reminders::decode(data.substr(0, 10), &out)) {
+        std::cerr << "encode: remove failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+typedef std::vector<std::pair<std::string, std::string>> Sent;
+
+bool test_journal() {
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    char dir[] = "/tmp/test-reminders-XXXXXX";
+    if (!mkdtemp(dir)) return false;
+    auto const path = std::string(dir) + "/reminders";
+    Sent sent;
+    auto const send = [&](const std::string& channel,
+                          const std::string& message) {
+        sent.emplace_back(channel, message);
+    };
+    bool ret = false;
+    {
+        auto reminders = Reminders::open(path, kStart);
+        if (!reminders) goto done;
+        Reminders::Reminder reminder;
+        reminder.id = 1;
+        reminder.at = kStart + 60;
+        reminder.message = "once";
+        reminders->update("a", reminder);
+        // Replaced by the next one
+        reminder.at = kStart + 30;
+        reminder.message = "replaced";
+        reminders->update("b", reminder);
+        reminder.at = kStart + 120;
+        reminder.message = "b";
+        reminders->update("b", reminder);
+        reminder.id = 2;
+        reminder.at = kStart + 3600;
+        reminder.days = 1;
+        reminder.until = kStart + 3600 + 86400 * 2;
+        reminder.message = "daily";
+        reminders->update("a", reminder);
+        reminder.id = 3;
+        reminder.at = kStart + 90;
+        reminder.days = 0;
+        reminder.message = "removed";
+        reminders->update("a", reminder);
+        reminder.at = 0;
+        reminders->update("a", reminder);
+        reminders->advance(kStart + 100, send);
+        if (sent.size() != 1 || sent[0].second != "once" ||
+            reminders->size() != 2) {
+            std::cerr << "journal: unexpected reminders sent" << std::endl;
+            goto done;
+        }
+    }
+    {
+        // A crash while writing leaves half a record
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        if (fd == -1 || write(fd, "\0\0\0\x05" "abc", 7) != 7) goto done;
+        close(fd);
+        auto reminders = Reminders::open(path, kStart + 110);
+        if (!reminders || reminders->size() != 2) {
+            std::cerr << "journal: reminders not read back" << std::endl;
+            goto done;
+        }
+        sent.clear();
+        reminders->advance(kStart + 86400 * 5, send);
+        if (sent.size() != 4 || sent[0].second != "b" ||
+            sent[1].second != "daily" || sent[3].second != "daily" ||
+            reminders->size() != 0) {
+            std::cerr << "journal: unexpected reminders sent after open"
+                      << std::endl;
+            goto done;
+        }
+    }
+    {
+        // Too late now
+        auto reminders = Reminders::open(path, kStart);
+        Reminders::Reminder reminder;
+        reminder.id = 1;
+        reminder.at = kStart + 10;
+        reminder.message = "late";
+        if (!reminders || !reminders->update("c", reminder)) goto done;
+        reminders.reset();
+        reminders = Reminders::open(path, kStart + 3600);
+        if (!reminders || reminders->size() != 0) {
+            std::cerr << "journal: late reminder kept" << std::endl;
+            goto done;
+        }
+    }
+    ret = true;
+ done:
+    system(("rm -rf " + std::string(dir)).c_str());
+    return ret;
+}
+
+}  // namespace
+
+int main() {
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_wheel_order()) ok++;
+    tot++; if (test_wheel_far()) ok++;
+    tot++; if (test_wheel_remove()) ok++;
+    tot++; if (test_wheel_timeout()) ok++;
+    tot++; if (test_wheel_many()) ok++;
+    tot++; if (test_encode()) ok++;
+    tot++; if (test_journal()) ok++;
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}
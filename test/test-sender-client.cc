@@ -0,0 +1,124 @@
+#include "common.hh"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "config.hh"
+#include "reminders.hh"
+#include "sender_client.hh"
+#include "sender_reader.hh"
+#include "sockutils.hh"
+
+using namespace stuff;
+
+namespace {
+
+typedef std::vector<std::pair<std::string, std::string>> Frames;
+
+// Read frames from the first connection to listener until it's closed
+bool read_frames(int listener, Frames* messages, Frames* reminders) {
+    sockguard sock(accept(listener, nullptr, nullptr));
+    if (!sock || !make_nonblocking(sock.get())) return false;
+    SenderReader reader(sock.release());
+    auto const message = [&](const std::string& channel,
+                             const std::string& data) {
+        messages->emplace_back(channel, data);
+    };
+    auto const reminder = [&](const std::string& channel,
+                              const std::string& data) {
+        reminders->emplace_back(channel, data);
+    };
+    while (true) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(reader.sock(), &read_set);
+        struct timeval timeout;
+        timeout.tv_sec = 10;
+        timeout.tv_usec = 0;
+        auto const ret = select(reader.sock() + 1, &read_set, nullptr,
+                                nullptr, &timeout);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        if (!reader.read(message, reminder)) return true;
+    }
+}
+
+bool test_frames() {
+    char dir[] = "/tmp/test-sender-client-XXXXXX";
+    if (!mkdtemp(dir)) return false;
+    auto const path = std::string(dir) + "/sender";
+    bool ret = false;
+    {
+        sockguard listener(socket(PF_LOCAL, SOCK_STREAM, 0));
+        struct sockaddr_un name;
+        name.sun_family = AF_LOCAL;
+        strncpy(name.sun_path, path.c_str(), sizeof(name.sun_path));
+        name.sun_path[sizeof(name.sun_path) - 1] = '\0';
+        if (!listener ||
+            bind(listener.get(), reinterpret_cast<struct sockaddr*>(&name),
+                 SUN_LEN(&name)) || listen(listener.get(), 1)) goto done;
+        {
+            std::ofstream out(std::string(dir) + "/config");
+            out << "sender = " << path << std::endl;
+        }
+        auto config = Config::create();
+        if (!config->load(std::string(dir) + "/config")) goto done;
+        Frames messages, reminders;
+        bool read_ok = false;
+        std::thread thread([&]() {
+                read_ok = read_frames(listener.get(), &messages, &reminders);
+            });
+        {
+            auto client = SenderClient::create(config.get());
+            if (client) {
+                // Larger than the socket buffers so the writes are partial
+                client->remind("general", 17, 1700000000, 7, 0,
+                               "Meeting soon");
+                client->send("general", std::string(512 * 1024, 'x'));
+                client->forget("random", 17);
+            }
+        }
+        thread.join();
+        if (!read_ok) {
+            std::cerr << "frames: connection failed" << std::endl;
+            goto done;
+        }
+        Reminders::Reminder reminder;
+        if (messages.size() != 1 || messages[0].first != "general" ||
+            messages[0].second != std::string(512 * 1024, 'x') ||
+            reminders.size() != 2 || reminders[0].first != "general" ||
+            !Reminders::decode(reminders[0].second, &reminder) ||
+            reminder.id != 17 || reminder.at != 1700000000 ||
+            reminder.days != 7 || reminder.message != "Meeting soon" ||
+            reminders[1].first != "random" ||
+            !Reminders::decode(reminders[1].second, &reminder) ||
+            reminder.id != 17 || reminder.at != 0) {
+            std::cerr << "frames: got " << messages.size() << " messages and "
+                      << reminders.size() << " reminders" << std::endl;
+            goto done;
+        }
+    }
+    ret = true;
+ done:
+    system(("rm -rf " + std::string(dir)).c_str());
+    return ret;
+}
+
+}  // namespace
+
+int main() {
+    unsigned int ok = 0, tot = 0;
+
+    tot++; if (test_frames()) ok++;
+
+    std::cout << "OK " << ok << "/" << tot << std::endl;
+    return ok == tot ? EXIT_SUCCESS : EXIT_FAILURE;
+}